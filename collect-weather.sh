@@ -1,3 +1,3 @@
 #!/bin/bash
 
-/home/pi/Desktop/AcuRite-Connection-Stuff/weatherstation 2| python /home/pi/Desktop/AcuRite-Connection-Stuff/readWeatherData.py
\ No newline at end of file
+/home/pi/Desktop/AcuRite-Connection-Stuff/weatherstation -q -D /home/pi/Desktop/AcuRite-Connection-Stuff/Data
\ No newline at end of file
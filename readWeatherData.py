@@ -48,7 +48,7 @@ while True:
                 f = open(filepath, 'a')
 
             #append data at the end
-            f.write(date+','+str(t.hour)+':'+str(t.minute)+':'+str(t.second)+','+str(data['windSpeed']['WS'])+','+str(data['windDirection']['WD'])+','+str(data['temperature']['T'])+','+str(data['humidity']['H'])+','+str(data['rainCounter']['RC']+'\n'))
+            f.write(date+','+str(t.hour)+':'+str(t.minute)+':'+str(t.second)+','+str(data['windSpeed']['WS'])+','+str(data['windDirection']['WDS'])+','+str(data['temperature']['T'])+','+str(data['humidity']['H'])+','+str(data['rainCounter']['RC'])+'\n')
             #close the file
             f.close()
 
@@ -26,7 +26,7 @@
     on a Pi, use the command line below to build it since the build of libusb-1.0.19
     places things in /usr/local
 
-    cc -o weatherstation  weatherstation.c -L/usr/local/lib -lusb-1.0
+    cc -o weatherstation  weatherstation.c wxloop.c wxring.c wxupload.c wxhttp.c wxspool.c wxsqlite.c wxarchive.c wxcapture.c wxdecode.c wxsink.c wxcsv.c wxmetrics.c wxtrace.c wxhistory.c wxquery.c wxchange.c wxagg.c wxderive.c wxsched.c wxrecover.c wxlog.c wxshm.c wxmqtt.c -L/usr/local/lib -lusb-1.0 -lcurl -lsqlite3 -lpthread -lrt
     use ldd weatherstation to check which libraries are linked in.
     If you still have trouble with compilation, remember that cc has a -v
     parameter that can help you unwind what is happening.
@@ -38,63 +38,252 @@
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <limits.h>
 #include <libusb-1.0/libusb.h>
-#include <curl/curl.h>
 
-#define WXVERSION "0.0.10"
+#include "weatherstation.h"
+#include "wxhttp.h"
+#include "wxloop.h"
+#include "wxspool.h"
+#include "wxsqlite.h"
+#include "wxarchive.h"
+#include "wxcapture.h"
+#include "wxdecode.h"
+#include "wxupload.h"
+#include "wxsink.h"
+#include "wxcsv.h"
+#include "wxmetrics.h"
+#include "wxtrace.h"
+#include "wxhistory.h"
+#include "wxquery.h"
+#include "wxchange.h"
+#include "wxagg.h"
+#include "wxderive.h"
+#include "wxsched.h"
+#include "wxrecover.h"
+#include "wxlog.h"
+#include "wxshm.h"
+#include "wxmqtt.h"
 
-#define TRUE    1
-#define FALSE   0
+#define WXVERSION "0.0.10"
 
 //this bit added by JZ
 //time intervals in seconds to wait between updates
-int timeint1 = 10; //report type 1
+int timeint1 = 10; //report type 1, when we don't know when the head sends, see wxsched.h
 int timeint2 = 300; //report type 2
 int timeint3 = 15; //put out data
 int timeint4 = 600; //upload data
 
+int noisy = 1;  //This will print the packets as they come in
+int quiet = 0;  // -q, and nothing goes to stdout (see showTimer())
+
+// Everything runs off this one event loop, see wxloop.h
+struct wxloop *mainLoop;
+int usbFailed = FALSE;  // set when a read fails so main() exits non-zero
+
+// The uploads happen on their own thread so a slow web site can't hold
+// up reading the station.  This is how many observations can be waiting.
+#define UPLOADDEPTH 16
+struct wxupload *uploader;
+// One connection per site, kept open for the life of the process
+#define UPLOAD_WU   0
+#define UPLOAD_MC   1
+#define UPLOADSITES 2
+struct wxhttp *httpClient;
+char *uploadSite[UPLOADSITES] = {"wunderground", "markandgrace"};
+// Uploads that fail are kept on disk and sent later.  Replays go out
+// REPLAYSLOTS at a time on their own connections, at most REPLAYBATCH
+// per observation so the live ones don't get held up.
+#define SPOOLDIR        "spool"
+#define SPOOLSEGMENTS   64      // of WXSPOOL_SEGSIZE each, 4MB all told
+#define REPLAYSLOTS     4
+#define REPLAYBATCH     32
+struct wxspool *spool;
+char *spoolDir = SPOOLDIR;
+// Local database of every frame, only kept if we're given a file name
+#define DBBATCHROWS 60
+#define DBBATCHSECS 300
+struct wxsqlite *sqliteDb;
+char *dbPath = NULL;
+// Compressed long term archive (-a).  Blocks are written when they fill
+// up or every ARCHIVEFLUSHSECS, whichever comes first.  Each station has
+// its own, see stationPath().
+#define ARCHIVEFLUSHSECS 3600
+char *archivePath = NULL;
+
 // The vendor id and product number for the AcuRite 5 in 1 weather head.
 #define VENDOR 0x24c0
 #define PRODUCT 0x0003
 
-// I store things about the weather device USB connection here.
+// This is where I read the USB device to get the latest data.  The reads
+// are asynchronous so nothing waits on the console; the event loop hands
+// the answer to reportDone() when it shows up.
+#define REPORTSZ 50
+struct usbReport {
+    struct stationData *station;
+    int whichOne;
+    int inFlight;
+    uint64_t sentAt;    // us, for how long the console took to answer
+    unsigned int sample;    // the trace id of the read that's out
+    uint64_t traceAt;
+    struct libusb_transfer *transfer;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + REPORTSZ]; // where we want the data to go
+};
+
+// I store things about each weather device USB connection here, along
+// with everything else that belongs to that one console.  Every console
+// plugged in gets one, up to MAXSTATIONS of them, and they're all read
+// off the same event loop.
 struct stationData
 {
+    int index;
+    char name[32];  // where it's plugged in, bus-port.port
     libusb_device *device;
     libusb_device_handle *handle;
     int verbose;
-} weatherStation;
-
-#define WUNDERSTRSZ 64
-struct stationWU
-{
-    // my PWS ID and password
-    char stationID[WUNDERSTRSZ];
-    char stationPassword[WUNDERSTRSZ];
-};
-
-
-// These are the sensors the the 5 in 1 weather head provides
-struct weatherData {
-    float   windSpeed;
-    time_t  wsTime;
-    int     windDirection;
-    time_t  wdTime;
-    float   temperature;
-    time_t  tTime;
-    int     humidity;
-    time_t  hTime;
-    int     rainCounter;
-    time_t  rcTime;
-    int     rainRaw;
-    time_t  rrTime;
-    float   barometer;
-    time_t  bTime;
-} weatherData;
+    int failed;     // stopped answering, we leave it alone
+    int gone;       // unplugged, waiting for it to come back
+    long long lostAt;   // ms, when it stopped, to say how long it was out
+    struct usbReport reports[2];
+    struct wxsched sched;   // when to read report 1 next
+    struct wxrecover recover;   // what to try when it doesn't answer
+    unsigned char lastFrame[REPORTSZ];  // and what it brought back last time
+    int lastLength;
+    struct wxdecoder dec;   // its latest weather
+    unsigned int sample;    // and the trace id of the report it came from
+    struct wxchange change;     // which of it is new
+    struct wxchange_sink shown, uploaded;   // and what stdout and the sites last got
+    struct wxagg agg;       // gusts, rain rates, the day's highs and lows
+    struct stationWU wu;
+    int upload;     // has credentials to upload with
+    struct wxcsv *csv;
+    struct wxarchive *archive;
+} stations[MAXSTATIONS];
+int nstations = 0;
+// How many of them the upload thread can look at.  nstations goes up
+// before the station's filled in, this only once it's all there,
+// credentials too, and they don't change after.  See publishStations().
+atomic_int stationsReady = 0;
+int usbStarted = FALSE;
+// When each station's next report 1 read is due, soonest first, and the
+// one timer that goes off for it
+struct wxsched_heap pollQueue;
+int pollTimer = -1;
+// How long a console gets to answer before the read's counted as
+// failed (-t ms).  It normally takes a few ms; libusb's example 100
+// seconds left a console that had hung unread for that long.
+#define USBTIMEOUT 1000
+int transferTimeout = USBTIMEOUT;
+// Wunderground IDs and passwords by where the console is plugged in (-W)
+char *credentialsPath = NULL;
+
+// When libusb can tell us about consoles coming and going, one that's
+// unplugged is let go and picked up again when it's plugged back in,
+// while everything else carries on.  There's not much the callback is
+// allowed to do from inside libusb, so it leaves the new arrivals here
+// and hotplugWork() does the rest off the loop.
+#define HOTPLUGRETRY 1000   // ms between tries on one that won't open
+int hotplug = FALSE;
+libusb_hotplug_callback_handle hotplugHandle;
+int hotplugTimer = -1;
+libusb_device *arrived[MAXSTATIONS];
+int narrived = 0;
+
+// Where the consoles were plugged in last time, one per line, so they
+// can be picked out of the device list without looking at anything
+// else and keep the same station numbers from one run to the next.
+// All the printing about every device on the bus and every descriptor
+// they have only happens with -v.
+#define DEVICECACHE "consoles"
+char *deviceCache = DEVICECACHE;
+int diagnostics = FALSE;
+// How long it takes to get going, in ms from when main() started
+long long startedAt;
+long long openedAt;
+int firstSample = FALSE;
+
+// Raw reports can be captured to a file (-c) and played back later (-p)
+// instead of reading the console, either at the speed they were
+// captured or as fast as they'll go (-F).
+struct wxcapture *capture;
+char *capturePath = NULL;
+struct wxcapture *replay;
+struct wxcapture_rec replayRec;
+char *replayPath = NULL;
+int replayFast = FALSE;
+int replayTimer = -1;
+
+// What goes out on stdout every timeint3 seconds (-o), and how many
+// records are held back to go out together (-b).
+struct wxsink *output;
+int outputFormat = WXSINK_JSON;
+int outputBatch = 1;
+
+// The day's CSV file (-D dir), what readWeatherData.py used to write,
+// one directory of them per station.  Rows are written out every
+// CSVFLUSHSECS and fsync'd as -S says.
+#define CSVFLUSHSECS 60
+char *csvDir = NULL;
+int csvSync = WXCSV_SYNC_DAY;
+
+// Counters and timings, scraped from 127.0.0.1:port/metrics (-M port).
+// The loop, the upload thread and the MQTT one each count into their
+// own shard.
+struct wxmetrics *metrics;
+struct wxmetrics_shard *loopMetrics, *uploadMetrics, *mqttMetrics;
+int metricsPort = 0;
+int mUsbCalls[2], mUsbFails[2], mUsbLatency[2];
+int mFrames[WXMSG_TYPES], mFramesOther, mFramesConsole;
+int mUploads[UPLOADSITES], mUploadFails[UPLOADSITES], mUploadLatency[UPLOADSITES];
+int mSpooled, mReplayed;
+int mRepeats;
+int mRecoveries[WXRECOVER_STEPS][2], mRecoveryLatency[WXRECOVER_STEPS], mGiveUps;
+int mMqttLatency;
+
+// Trace spans for following a sample from the USB to the upload (-T
+// file).  Every read gets the next sample id; SIGUSR1 writes what the
+// rings have to the file, and so does shutting down.
+struct wxtrace_ring *loopTrace, *uploadTrace;
+char *tracePath = NULL;
+unsigned int nextSample = 0;
+
+// The last HISTORYSIZE reports from all the stations, kept in memory
+// and served as JSON from 127.0.0.1:port (-Q port), see wxquery.h.
+// At one every ten seconds that's well over a day with one console.
+#define HISTORYSIZE 16384
+struct wxhistory *history;
+struct wxquery *query;
+int queryPort = 0;
+
+// Every report, in /dev/shm/name for other programs on the box to read
+// (-m name), see wxshm.h
+struct wxshm *shared;
+char *sharedName = NULL;
+
+// And onto an MQTT broker (-B url), from a thread of its own, see
+// wxmqtt.h.  This is how many can be waiting for it.
+#define MQTTDEPTH 256
+struct wxmqtt *mqtt;
+struct wxmqtt_options mqttOptions;
+int useMqtt = FALSE;
+
+// Leave stdout and the uploads alone when nothing has changed by more
+// than its deadband (-E name=value,...), but send something at least
+// every heartbeat seconds (-H).  Without -H everything goes out every
+// time like it always did.  The CSV files keep every row regardless.
+struct wxchange_policy changePolicy;
+int mSuppressed[2];
 
 // This is just a function prototype for the compiler
 void closeUpAndLeave();
+int recoverStep(struct stationData *st);
+char *stationPath(const char *base, struct stationData *st, char *path, size_t size);
 
 //#if PLATFORM == 'Linux'
 #if __linux__
@@ -109,200 +298,143 @@ size_t strlcpy(char *dst, const char *src, size_t dstsize)
 }
 #endif
 
-// I want to catch control-C and close down gracefully
-void sig_handler(int signo)
+// kill -USR1 for a look at the trace without stopping
+void traceSignal(int signo, void *arg)
 {
-  if (signo == SIGINT)
-    fprintf(stderr,"Shutting down ...\n");
-    closeUpAndLeave();
+    if (wxtrace_dump(tracePath) < 0)
+        wxlog_error("Couldn't write the trace to %s, %s\n", tracePath, strerror(errno));
+    else
+        wxlog_info("Trace written to %s\n", tracePath);
 }
 
-// Array to translate the integer direction provided to text
-char *Direction[] = {
-    "NW",
-    "WSW",
-    "WNW",
-    "W",
-    "NNW",
-    "SW",
-    "N",
-    "SSW",
-    "ENE",
-    "SE",
-    "E",
-    "ESE",
-    "NE",
-    "SSE",
-    "NNE",
-    "S"
-};
+// I want to catch control-C and close down gracefully.  The signal comes
+// in through the event loop, so it's safe to do real work here.
+void sig_handler(int signo, void *arg)
+{
+    wxlog_info("Shutting down ...\n");
+    wxloop_stop(mainLoop);
+}
 
-char *DirectionNum[] = {
-    "315",
-    "248",
-    "293",
-    "270",
-    "358",
-    "225",
-    "0",
-    "298",
-    "68",
-    "135",
-    "90",
-    "113",
-    "45",
-    "168",
-    "23",
-    "180"
-};
+// snprintf onto the end of what's in buf already, len long.  Returns the
+// new length, which stops growing once buf is full.
+size_t appendf(char *buf, size_t size, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (len >= size)
+        return len;
+    va_start(ap, fmt);
+    n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return len;
+    return len + n < size ? len + n : size - 1;
+}
 
-/*
-This tiny thing simply takes the data and prints it so we can see it
-*/
-void showit(void) {
-
-    fprintf(stdout, "{\"windSpeed\":{\"WS\":\"%0.1f\",\"t\":\"%ld\"},"
-                    "\"windDirection\":{\"WDS\":\"%s\",\"t\":\"%ld\"},"
-                    "\"windDirection\":{\"WDD\":\"%s\",\"t\":\"%ld\"},"
-                    "\"windDirRaw\":{\"WDR\":\"%d\",\"t\":\"%ld\"},"
-                    "\"temperature\":{\"T\":\"%0.1f\",\"t\":\"%ld\"},"
-                    "\"humidity\":{\"H\":\"%d\",\"t\":\"%ld\"},"
-                    "\"rainCounter\":{\"RC\":\"%d\",\"t\":\"%ld\"},"
-                    "\"rainRaw\":{\"RR\":\"%d\",\"t\":\"%ld\"},"
-                    "\"Barometer\":{\"BP\":\"%0.1f\",\"t\":\"%ld\"}"
-                    "}\n",
-            weatherData.windSpeed, weatherData.wsTime,
-            Direction[weatherData.windDirection],weatherData.wdTime,
-            DirectionNum[weatherData.windDirection],weatherData.wdTime,
-            weatherData.windDirection,weatherData.wdTime,
-            weatherData.temperature, weatherData.tTime,
-            (int)weatherData.humidity, weatherData.hTime,
-            weatherData.rainCounter, weatherData.rcTime,
-            weatherData.rainRaw, weatherData.rrTime,
-            weatherData.barometer, weatherData.bTime
-        );
-    fflush(stdout);
-    return;
+// Rain since midnight.  The aggregates know, unless nothing has come
+// from the rain gauge yet.
+double rainToday(const struct weatherData * wx, const struct wxagg_summary * agg)
+{
+    if (agg->valid & WXAGG_RAIN)
+        return agg->rainDay;
+    return wx->rainCounter*0.01;
 }
 
-int mccurl(struct weatherData * wx, struct stationWU * wu)
+// These two just build the URL for their site and queue it on the
+// shared client; uploadObservation() sends them together.
+int mccurl(const struct weatherData * wx, const struct wxagg_summary * agg, struct stationWU * wu, time_t when,
+           char * url, size_t size)
 {
-    CURL *      curl;
-    CURLcode    retval;
-    int         error = TRUE;
-    time_t      now;
     struct tm * dt;
-    char        url[2048];
     char        dest[70];
 
-    time(&now);
-    dt = gmtime(&now);
+    // Use the time of the observation, not now, it may be going out late
+    dt = gmtime(&when);
 
     strftime(dest, sizeof(dest)-1, "%FT%T", dt);
     char *urlfmt = "https://markandgrace.com/wx/index.php?view=upload&tm=%s&t1=%0.1f&rh=%d&wdspd=%0.1f&wddir=%s&rn=%0.1f&bp=%0.1f";
-    snprintf(url, sizeof(url)-1,
+    snprintf(url, size-1,
             urlfmt,
             dest,
             wx->temperature,
             wx->humidity,
             wx->windSpeed,
             Direction[wx->windDirection],
-            (wx->rainCounter*0.01),
+            rainToday(wx, agg),
             wx->barometer
         );
-    fprintf(stderr, "strlen(url)=%ld\nurl=%s\n", strlen(url), url);
+    wxlog_debug("strlen(url)=%ld\nurl=%s\n", strlen(url), url);
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-    if(curl)
-    {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        retval = curl_easy_perform(curl);
-        curl_easy_cleanup(curl);
-        fprintf(stderr,"CURL retval: %d\n", retval);
-    }
-    return 0;
+    return wxhttp_get(httpClient, UPLOAD_MC, url);
 }
 
 
-int wucurl(struct weatherData * wx, struct stationWU * wu)
+int wucurl(const struct weatherData * wx, const struct wxagg_summary * agg, struct stationWU * wu, time_t when,
+           char * url, size_t size)
 {
-    CURL *      curl;
-    CURLcode    retval;
-    int         error = TRUE;
-    time_t      now;
     struct tm * dt;
-    char        url[2048];
-
-    time(&now);
-    dt = gmtime(&now);
+    char        dest[70];
+    size_t      len;
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+    dt = gmtime(&when);
+    // Wunderground wants "YYYY-MM-DD HH:MM:SS" url encoded
+    strftime(dest, sizeof(dest)-1, "%Y-%m-%d+%H%%3A%M%%3A%S", dt);
 
     char *urlfmt = "http://weatherstation.wunderground.com/weatherstation/updateweatherstation.php?"
       "ID=%s"
       "&PASSWORD=%s"
-      "&dateutc=now" //"&dateutc=%04d-%02d-%02dT%02d:%02d:%02d"
+      "&dateutc=%s"
       "&windspeedmph=%0.1f"
       "&winddir=%s"
       "&tempf=%0.1f"
-      "&dailyrainin=%0.1f"
+      "&dailyrainin=%0.2f"
       "&humidity=%d"
       "&baromin=%0.1f"
-      "&dewptf=%0.1f"
-      "&softwaretype=mark-clayton.com-%s&action=updateraw";
+      "&dewptf=%0.1f";
 
  /* 1 ID
   * 2 passwd
-  * 3 yr
-  * 4 mon
-  * 5 day
-  * 6 hr
-  * 7 min
-  * 8 sec
+  * 3 dateutc, when the observation was taken
   * 9 winspeed
   * 11 Outdoor temp
-  * 12 rain in inches
+  * 12 rain in inches since local midnight
   * 14 humidity
   */
-    double dewpt = wx->temperature - ((100.0 - (double)wx->humidity) / 5.0);
-    snprintf(url, sizeof(url)-1,
+    double dewpt = wxderive_dewpoint(wx->temperature, wx->humidity);
+    len = appendf(url, size, 0,
             urlfmt,
             wu->stationID,
             wu->stationPassword,
-            //dt->tm_year,
-            //dt->tm_mon,
-            //dt->tm_mday,
-            //dt->tm_hour,
-            //dt->tm_min,
-            //dt->tm_sec,
+            dest,
             wx->windSpeed,
             DirectionNum[wx->windDirection],
             wx->temperature,
-            (wx->rainCounter*0.01),
+            rainToday(wx, agg),
             wx->humidity,
             wx->barometer,
-            dewpt,
-            WXVERSION
+            dewpt
         );
-    fprintf(stderr, "strlen(url)=%ld\nurl=%s\n", strlen(url), url);
-
-    curl = curl_easy_init();
-    if(curl)
-    {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        retval = curl_easy_perform(curl);
-        curl_easy_cleanup(curl);
-        fprintf(stderr,"CURL retval: %d\n", retval);
-        error = FALSE;
-    }
-    return error;
+    // The rolling ones, once there's been enough to work them out
+    if (agg->valid & WXAGG_WIND)
+        len = appendf(url, size, len, "&windspdmph_avg2m=%0.1f", agg->windAvg);
+    if (agg->valid & WXAGG_GUST)
+        len = appendf(url, size, len, "&windgustmph_10m=%0.1f", agg->gust);
+    if (agg->valid & WXAGG_RAIN)
+        len = appendf(url, size, len, "&rainin=%0.2f", agg->rainHour);
+    appendf(url, size, len, "&softwaretype=mark-clayton.com-%s&action=updateraw", WXVERSION);
+    wxlog_debug("strlen(url)=%ld\nurl=%s\n", strlen(url), url);
+
+    return wxhttp_get(httpClient, UPLOAD_WU, url);
 }
 
-int write_line(struct weatherData * wx, struct stationWU * wu)
+// The latest observation, one line of it, in file.txt for the first
+// station and file.txt.1, file.txt.2 ... for the others
+int write_line(const struct weatherData * wx, const struct wxagg_summary * agg, struct stationData * st)
 {
     FILE* fptr;
-    double dewpt = wx->temperature - ((100.0 - (double)wx->humidity) / 5.0);
+    size_t len;
+    char        path[PATH_MAX];
 
     time_t      now;
     struct tm * dt;
@@ -314,428 +446,1076 @@ int write_line(struct weatherData * wx, struct stationWU * wu)
 
     strftime(dest, sizeof(dest)-1, "%FT%T", dt);
     char *obfmt = "tm=%s;t1=%0.1f;rh=%d;wdspd=%0.1f;wddir=%s;rn=%0.1f;bp=%0.1f";
-    snprintf(ob, sizeof(ob)-1,
+    len = appendf(ob, sizeof(ob), 0,
             obfmt,
             dest,
             wx->temperature,
             wx->humidity,
             wx->windSpeed,
             Direction[wx->windDirection],
-            (wx->rainCounter*0.01),
+            rainToday(wx, agg),
             wx->barometer
         );
-
-    fptr = fopen("file.txt", "w");
+    len = appendf(ob, sizeof(ob), len, ";dp=%0.1f;hi=%0.1f;wc=%0.1f;at=%0.1f",
+            wxderive_dewpoint(wx->temperature, wx->humidity),
+            wxderive_heatindex(wx->temperature, wx->humidity),
+            wxderive_windchill(wx->temperature, wx->windSpeed),
+            wxderive_apparent(wx->temperature, wx->humidity, wx->windSpeed));
+    if (agg->valid & WXAGG_WIND)
+        len = appendf(ob, sizeof(ob), len, ";wdavg=%0.1f", agg->windAvg);
+    if (agg->valid & WXAGG_GUST)
+        len = appendf(ob, sizeof(ob), len, ";gust=%0.1f", agg->gust);
+    if (agg->valid & WXAGG_RAIN)
+        len = appendf(ob, sizeof(ob), len, ";rnhr=%0.2f", agg->rainHour);
+    if (agg->valid & WXAGG_TEMP)
+        appendf(ob, sizeof(ob), len, ";t1min=%0.1f;t1max=%0.1f", agg->tempMin, agg->tempMax);
+
+    fptr = fopen(stationPath("file.txt", st, path, sizeof(path)), "w");
+    if (fptr == NULL){
+        wxlog_error("Couldn't write %s, %s\n", path, strerror(errno));
+        return -1;
+    }
     fprintf(fptr, "%s\n", ob);
-    fclose(fptr);
+    if (fclose(fptr) != 0){
+        wxlog_error("Couldn't write %s, %s\n", path, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-int store_sqlite(struct weatherData * wxdata)
+// Every frame goes in the database, if there is one (-d).  The rows are
+// batched up in wxsqlite, see dbTimer() for the stragglers.
+int store_sqlite(struct stationData *st, int report)
 {
-    int ret = 0;
+    if (sqliteDb == NULL)
+        return 0;
+    return wxsqlite_store(sqliteDb, st->index, report, frameTime, &st->dec.wx);
+}
 
-    return ret;
+// The first station's files are named the way they always were, the
+// others get their number tacked on: archive, archive.1, archive.2 ...
+char *stationPath(const char *base, struct stationData *st, char *path, size_t size)
+{
+    if (st->index == 0)
+        snprintf(path, size, "%s", base);
+    else
+        snprintf(path, size, "%s.%d", base, st->index);
+    return path;
 }
 
-/*
-This code translates the data from the 5 in 1 sensors to something
-that can be used by a human.
-*/
-float getWindSpeed(char *data){
-    int leftSide = (data[3] & 0x1f) << 3;
-    int rightSide = (data[4] & 0x70) >> 4;
-    float speed = (leftSide | rightSide) / 2.0;
-    return(speed);
-}
-int getWindDirection(char *data){
-    return(data[4] & 0x0f);
-}
-float getTemp(char *data)
-{
-    // This item spans bytes, have to reconstruct it
-    int leftSide = (data[4] & 0x0f) << 7;
-    int rightSide = data[5] & 0x7f;
-    float combined = leftSide | rightSide;
-    return((combined - 400) / 10.0);
-}
-int getHumidity(char *data)
-{
-    int howWet = data[6] &0x7f;
-    return(howWet);
-}
-
-int getRainCount(char* data, int* rawCount, int noisy)
-{
-    static int  did_daily_reset = 0;
-    time_t utcnow;
-    struct tm* locnow;
-    int count = *rawCount;
-    int raincount = 0;
-    int reading = (data[6] &0x7f);
-
-    if(0 == reading && 0 < count) /* console value went to zero, counter reset? */
-    {
-        count = 0;
-    }
-
-    if(0 == count) //first starting up
-        count = reading;
-
-    raincount = reading - count;
-
-    // reset daily rain count to zero right after midnight
-    time(&utcnow);
-    locnow = localtime(&utcnow);
-    if(0 == locnow->tm_hour & 0 == did_daily_reset)
-    {
-        if(noisy) fprintf(stderr, "Did daily rain reset\n");
-        did_daily_reset = 1;
-        count = raincount;
-    }
-    if(1 == locnow->tm_hour & 1 == did_daily_reset)
-    {
-        if(noisy) fprintf(stderr, "Ready for tomorrows daily rain reset\n");
-        did_daily_reset = 0;
-    }
-
-    *rawCount = count;
-    return(raincount);
-}
-
-float getConsoleTemp(char* data, int noisy)
-{
-    unsigned int  left = (data[21] & 0x00);
-    unsigned int  lefts = (data[21]<<8);
-    unsigned int  right = (data[22] & 0x00FF);
-    unsigned int  reading = lefts | right;
-    reading &= 0x0000FFFF;
-    fprintf(stderr, "CT = %X %X %X %X %ld", left, lefts, right, reading, sizeof(unsigned int));
-    float temp = reading / 511.13;
-    fprintf(stderr, "\nConsole Temp = %0.2f\n", temp);
-    return temp;
-}
-
-float getBaroPress(char* data, int noisy)
-{
-    unsigned int  left = (data[23] & 0x00);
-    unsigned int  lefts = (data[23]<<8);
-    unsigned int  right = (data[24] & 0x00FF);
-    unsigned int  reading = lefts | right;
-    reading &= 0x0000FFFF;
-    fprintf(stderr, "BP = %X %X %X %X %ld", left, lefts, right, reading, sizeof(unsigned int));
-    float bar = 6.23 * (reading) - 20402;
-    bar /= 100.0; // convert to mbar from pascals
-    fprintf(stderr, "\nBP = %0.2f\n", bar);
-    return bar;
-}
-
-// Now that I have the data from the station, do something useful with it.
-void decode(char *data, int length, int noisy){
-    //int i;
-    //for(i=0; i<length; i++){
-    //    fprintf(stderr,"%02X ",data[i]);
-    //}
-    //fprintf(stderr,"\n");
-    time_t seconds = time (NULL);
-    //There are two varieties of data, both of them have wind speed
-    // first variety of the data
-    if ((data[2] & 0x0f) == 1){ // this has wind speed, direction and rainfall
-        //# 0x7 indicates battery ok, 0xb indicates low battery?
-        //a = (data[3] & 0xf0) >> 4
-        //return 0 if a == 0x7 else 1
-        sensor_battery = (data[3] & 0xf0) >> 4;
-        //if(noisy)
-            fprintf(stderr,"Sensor Battery: 0x%1x ", sensor_battery);
-        if(noisy)
-            fprintf(stderr,"Wind Speed: %.1f ",getWindSpeed(data));
-        weatherData.windSpeed = getWindSpeed(data);
-        weatherData.wsTime = seconds;
-        if(noisy)
-            fprintf(stderr,"Wind Direction: %s ",Direction[getWindDirection(data)]);
-        weatherData.wdTime = seconds;
-        weatherData.windDirection = getWindDirection(data);
-        weatherData.rainCounter = getRainCount(data, &(weatherData.rainRaw), noisy);
-        weatherData.rcTime = seconds;
-        weatherData.rrTime = seconds;
-        if(noisy){
-            fprintf(stderr,"\nRain Counter: %d ",weatherData.rainCounter);
-            fprintf(stderr,"\n");
-        }
-    }
-    // this is the other variety
-    if ((data[2] & 0x0f) == 8){ // this has wind speed, temp and relative humidity
-        if(noisy)
-            fprintf(stderr,"Wind Speed: %.1f ",getWindSpeed(data));
-        weatherData.windSpeed = getWindSpeed(data);
-        weatherData.wsTime = seconds;
-        if(noisy)
-            fprintf(stderr,"Temperature: %.1f ",getTemp(data));
-        weatherData.temperature = getTemp(data);
-        weatherData.tTime = seconds;
-        if(noisy){
-            fprintf(stderr,"Humidity: %d ", getHumidity(data));
-            //fprintf(stderr,"\n");
-        }
-        weatherData.humidity = getHumidity(data);
-        weatherData.hTime = seconds;
+// Set up the next station.  Returns NULL if there's no room for it.
+struct stationData *newStation(void)
+{
+    struct stationData *st;
+    int i;
+
+    if (nstations == MAXSTATIONS)
+        return NULL;
+    st = &stations[nstations];
+    memset(st, '\0', sizeof(struct stationData));
+    st->index = nstations++;
+    snprintf(st->name, sizeof(st->name), "%d", st->index);
+    wxagg_init(&st->agg);
+    wxsched_init(&st->sched, timeint1*1000L);
+    wxrecover_init(&st->recover, (unsigned int)time(NULL) ^ (st->index << 16));
+    for(i=0; i<2; i++){
+        st->reports[i].station = st;
+        st->reports[i].whichOne = i+1;
     }
+    return st;
 }
 
-void decode2(char *data, int length, int noisy)
+// The stations so far are all filled in, let the upload thread see them
+void publishStations(void)
 {
-    time_t seconds = time (NULL);
+    atomic_store_explicit(&stationsReady, nstations, memory_order_release);
+}
 
-    getConsoleTemp(data, noisy);
-    weatherData.barometer = getBaroPress(data, noisy); // convert to mbar from pascals
-    weatherData.barometer += 21.1; //adjust for altitude, but what alt????
-    weatherData.barometer /= 33.86389;
-    weatherData.bTime = seconds;
-    if(noisy){
-        fprintf(stderr,"Baro: %0.2f ", weatherData.barometer);
-        fprintf(stderr,"\n");
+// The per station files, for a station we just found
+void openStationFiles(struct stationData *st)
+{
+    char path[PATH_MAX];
+
+    if (csvDir){
+        st->csv = wxcsv_open(stationPath(csvDir, st, path, sizeof(path)), csvSync);
+        if (st->csv == NULL)
+            wxlog_warn("Couldn't use %s for the CSV files, going on without them\n", path);
+    }
+    if (archivePath){
+        st->archive = wxarchive_open(stationPath(archivePath, st, path, sizeof(path)));
+        if (st->archive == NULL)
+            wxlog_warn("Couldn't open archive %s, going on without it\n", path);
     }
-    return;
 }
 
+// Lines of "where-it's-plugged-in stationID password", # for comments.
+// A station that isn't in there doesn't get uploaded, unless it's the
+// only one, then it gets the ID and password we were built with.
+void loadCredentials(struct stationData *st)
+{
+    char line[256], name[32], id[WUNDERSTRSZ], password[WUNDERSTRSZ];
+    FILE *fp = NULL;
+
+    if (credentialsPath){
+        fp = fopen(credentialsPath, "r");
+        if (fp == NULL)
+            wxlog_error("Couldn't read credentials from %s, %s\n", credentialsPath, strerror(errno));
+    }
+    while (fp && fgets(line, sizeof(line), fp)){
+        if (line[0] == '#' || sscanf(line, "%31s %63s %63s", name, id, password) != 3)
+            continue;
+        if (strcmp(st->name, name) == 0){
+            strlcpy(st->wu.stationID, id, sizeof(st->wu.stationID));
+            strlcpy(st->wu.stationPassword, password, sizeof(st->wu.stationPassword));
+            wxlog_secret(password);
+            st->upload = TRUE;
+        }
+    }
+    if (fp)
+        fclose(fp);
+    if (nstations == 1 && !st->upload){
+        strlcpy(st->wu.stationID, STATIONID, sizeof(st->wu.stationID));
+        strlcpy(st->wu.stationPassword, STATIONKEY, sizeof(st->wu.stationPassword));
+        st->upload = TRUE;
+    }
+    if (!st->upload)
+        wxlog_warn("Station %s has no credentials, it won't be uploaded\n", st->name);
+}
 
 /*
 This code is related to dealing with the USB device
 */
-// This searches the USB bus tree to find the device
-int findDevice(libusb_device **devs)
+// Name a console for where it's plugged in, bus-port.port, that doesn't
+// change from one run to the next or when it's unplugged and put back.
+char *deviceName(libusb_device *dev, char *name, size_t size)
 {
-    libusb_device *dev;
-    int err = 0, i = 0, j = 0;
     uint8_t path[8];
+    int j, n, r;
 
-    while ((dev = devs[i++]) != NULL) {
-        struct libusb_device_descriptor desc;
-        int r = libusb_get_device_descriptor(dev, &desc);
-        if (r < 0) {
-            fprintf(stderr,"Couldn't get device descriptor, %s\n", libusb_strerror(err));
-            return(1);
-        }
+    n = snprintf(name, size, "%d", libusb_get_bus_number(dev));
+    r = libusb_get_port_numbers(dev, path, sizeof(path));
+    for (j = 0; j < r && n < (int)size; j++)
+        n += snprintf(name + n, size - n, "%c%d", j ? '.' : '-', path[j]);
+    return name;
+}
+
+// Is this one of ours?  Say what it is while we're at it, if asked.
+int isConsole(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    int r = libusb_get_device_descriptor(dev, &desc);
 
-        fprintf(stderr,"%04x:%04x (bus %d, device %d)",
+    if (r < 0) {
+        wxlog_error("Couldn't get device descriptor, %s\n", libusb_strerror(r));
+        return FALSE;
+    }
+    if (diagnostics)
+        wxlog_debug("%04x:%04x (bus %d, device %d)\n",
             desc.idVendor, desc.idProduct,
             libusb_get_bus_number(dev), libusb_get_device_address(dev));
+    return desc.idVendor == VENDOR && desc.idProduct == PRODUCT;
+}
 
-        //r = libusb_get_port_numbers(dev, path, sizeof(path));
-        //if (r > 0) {
-        //  fprintf(stderr," path: %d", path[0]);
-        //  for (j = 1; j < r; j++)
-        //      fprintf(stderr,".%d", path[j]);
-        //}
-        fprintf(stderr,"\n");
-
-        if (desc.idVendor == VENDOR && desc.idProduct == PRODUCT){
-            fprintf(stderr,"Found the one I want\n");
-            weatherStation.device = dev;
-            return (1);
-        }
+struct stationData *stationNamed(const char *name)
+{
+    int i;
+
+    for(i=0; i<nstations; i++)
+        if (strcmp(stations[i].name, name) == 0)
+            return &stations[i];
+    return NULL;
+}
+
+// Give the console a station, unless it has one already.  Returns FALSE
+// when there's no more room.
+int addDevice(libusb_device *dev, const char *name)
+{
+    struct stationData *st;
+    int i;
+
+    for(i=0; i<nstations; i++)
+        if (stations[i].device == dev)
+            return TRUE;
+    st = newStation();
+    if (st == NULL){
+        wxlog_warn("More than %d stations, ignoring the rest\n", MAXSTATIONS);
+        return FALSE;
+    }
+    strlcpy(st->name, name, sizeof(st->name));
+    wxlog_info("Found one I want at %s\n", st->name);
+    // Ours to keep after the list is freed
+    st->device = libusb_ref_device(dev);
+    return TRUE;
+}
+
+// A console that was here last time and isn't now keeps its station,
+// and its number, for when it's plugged back in.  Returns FALSE when
+// there's no more room.
+int addMissing(const char *name)
+{
+    struct stationData *st = newStation();
+
+    if (st == NULL){
+        wxlog_warn("More than %d stations, ignoring the rest\n", MAXSTATIONS);
+        return FALSE;
     }
-    return(0);
+    strlcpy(st->name, name, sizeof(st->name));
+    wxlog_info("Station %s isn't plugged in, keeping its number for it\n", st->name);
+    st->failed = TRUE;
+    st->gone = TRUE;
+    st->lostAt = wxloop_now_ms();
+    return TRUE;
+}
+
+// This searches the USB bus tree to find the devices, every one of them.
+// The ones that were there last time come first, in the same order, so
+// each gets the station number it had, whether it's here or not; the
+// station number is what its files, database rows and uploads go by.
+// Take a line out of the cache to let its number go.
+int findDevices(libusb_device **devs)
+{
+    char line[64], name[32];
+    FILE *fp;
+    int i, room = TRUE;
+
+    fp = fopen(deviceCache, "r");
+    while (fp && room && fgets(line, sizeof(line), fp)){
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || stationNamed(line))
+            continue;
+        for(i=0; devs[i] != NULL; i++)
+            if (strcmp(deviceName(devs[i], name, sizeof(name)), line) == 0 && isConsole(devs[i]))
+                break;
+        if (devs[i] != NULL)
+            room = addDevice(devs[i], line);
+        else
+            room = addMissing(line);
+    }
+    if (fp)
+        fclose(fp);
+    for(i=0; room && devs[i] != NULL; i++)
+        if (isConsole(devs[i]))
+            room = addDevice(devs[i], deviceName(devs[i], name, sizeof(name)));
+    return(nstations);
+}
+
+// Remember where they're plugged in for next time
+void saveDevices(void)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int i;
+
+    if (deviceCache == NULL || nstations == 0)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.new", deviceCache);
+    fp = fopen(tmp, "w");
+    if (fp == NULL){
+        wxlog_error("Couldn't write %s, %s\n", tmp, strerror(errno));
+        return;
+    }
+    for(i=0; i<nstations; i++)
+        fprintf(fp, "%s\n", stations[i].name);
+    if (fclose(fp) != 0 || rename(tmp, deviceCache) < 0){
+        wxlog_error("Couldn't write %s, %s\n", deviceCache, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+int usbTimer = -1;  // only used when libusb can't do its own timeouts
+
+// How many reads are still out on any station
+int inFlight(void){
+    int i, n = 0;
+
+    for(i=0; i<nstations; i++)
+        n += stations[i].reports[0].inFlight + stations[i].reports[1].inFlight;
+    return n;
 }
 
 // to handle testing and try to be clean about closing the USB device,
 // I'll catch the signal and close off.
 void closeUpAndLeave(){
-    //OK, done with it, close off and let it go.
-    fprintf(stderr,"Done with device, release and close it\n");
-    int err = libusb_release_interface(weatherStation.handle, 0); //release the claimed interface
-    if(err) {
-        fprintf(stderr,"Couldn't release interface, %s\n", libusb_strerror(err));
-        exit(1);
+    // Playing back a capture, there's no device to let go of
+    if (!usbStarted)
+        return;
+    struct timeval tv = {0, 100000};
+    struct stationData *st;
+    int i, n, tries;
+
+    //OK, done with them, close off and let them go.
+    wxlog_info("Done with the devices, release and close them\n");
+    if (hotplug){
+        libusb_hotplug_deregister_callback(NULL, hotplugHandle);
+        hotplug = FALSE;
+        for(i=0; i<narrived; i++)
+            libusb_unref_device(arrived[i]);
+        narrived = 0;
+    }
+    // Don't pull a handle out from under a read that's still pending
+    for(n=0; n<nstations; n++)
+        for(i=0; i<2; i++)
+            if(stations[n].reports[i].inFlight)
+                libusb_cancel_transfer(stations[n].reports[i].transfer);
+    for(tries=0; tries<10 && inFlight(); tries++)
+        libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    for(n=0; n<nstations; n++){
+        st = &stations[n];
+        for(i=0; i<2; i++)
+            if(!st->reports[i].inFlight && st->reports[i].transfer)
+                libusb_free_transfer(st->reports[i].transfer);
+        if (st->device){
+            libusb_unref_device(st->device);
+            st->device = NULL;
+        }
+        if (st->handle == NULL)
+            continue;
+        int err = libusb_release_interface(st->handle, 0); //release the claimed interface
+        if(err)
+            wxlog_warn("Couldn't release interface on %s, %s\n", st->name, libusb_strerror(err));
+        libusb_close(st->handle);
+        st->handle = NULL;
     }
-    libusb_close(weatherStation.handle);
+    libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
     libusb_exit(NULL);
+    usbStarted = FALSE;
     //exit(0); moved to calling locations
 }
 
-// This is where I read the USB device to get the latest data.
-unsigned char data[50]; // where we want the data to go
-int getit(int whichOne, int noisy){
-    int actual; // how many bytes were actually read
+// Let libusb finish whatever is ready.  Never blocks.
+void usbService(void){
+    struct timeval tv = {0, 0};
 
+    libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    // Most platforms give libusb a timerfd for transfer timeouts.  Where
+    // they don't, we have to wake up for the next timeout ourselves.
+    if(usbTimer >= 0 && libusb_get_next_timeout(NULL, &tv) == 1)
+        wxloop_arm_timer(mainLoop, usbTimer, tv.tv_sec*1000 + tv.tv_usec/1000 + 1, 0);
+}
+void usbReady(int fd, int events, void *arg){
+    usbService();
+}
+void usbTimeout(int id, void *arg){
+    usbService();
+}
+void usbFdAdded(int fd, short events, void *arg){
+    int ev = 0;
+    if(events & POLLIN) ev |= WXLOOP_READ;
+    if(events & POLLOUT) ev |= WXLOOP_WRITE;
+    if(wxloop_add_io(mainLoop, fd, ev, usbReady, NULL) < 0)
+        wxlog_error("Couldn't watch libusb fd %d\n", fd);
+}
+void usbFdRemoved(int fd, void *arg){
+    wxloop_del_io(mainLoop, fd);
+}
+
+// Everything a report goes through once we have it, whether it just came
+// off the USB or out of a capture file.  The console hands back the last
+// frame it heard however often it's asked, so a report 1 that's the same
+// as the one before is the same frame again and goes no further.
+// Returns FALSE for one of those.
+int processReport(struct stationData *st, int whichOne, unsigned char *data, int actual, time_t when, unsigned int sample){
+    uint64_t t;
+
+    if (whichOne == 1){
+        if (actual == st->lastLength && memcmp(data, st->lastFrame, actual) == 0){
+            wxmetrics_inc(loopMetrics, mRepeats);
+            return FALSE;
+        }
+        st->lastLength = actual < REPORTSZ ? actual : REPORTSZ;
+        memcpy(st->lastFrame, data, st->lastLength);
+    }
+    frameTime = when;
+    st->sample = sample;
+    if (!firstSample && usbStarted && whichOne == 1){
+        firstSample = TRUE;
+        wxlog_info("First sample from %s %lldms after starting, %lldms of it finding and opening the consoles\n",
+            st->name, wxloop_now_ms() - startedAt, openedAt - startedAt);
+    }
+    // If you want both of the reports that the station provides,
+    // just allow for it.  Right this second, I've found every thing
+    // I need in report 1.  When I look further at report 2, this will
+    // change
+    wxlog_hex(WXLOG_DEBUG, data, actual, "%s%sR%d:%d:",
+        nstations > 1 ? st->name : "", nstations > 1 ? " " : "", whichOne, actual);
+    t = wxtrace_begin();
+    if (whichOne == 1){
+        // The actual data starts after the first byte
+        // The first byte is the report number returned by
+        // the usb read.
+        decode(&st->dec, &data[1], actual-1, noisy);
+        if (actual-1 >= WXFRAME_MIN)
+            wxmetrics_inc(loopMetrics, mFrames[data[3] & 0x0f]);
+    }
+    if (whichOne == 2) {
+        decode2(&st->dec, data, actual-1, noisy);
+        wxmetrics_inc(loopMetrics, mFramesConsole);
+    }
+    wxchange_note(&st->change, &st->dec.wx);
+    wxagg_update(&st->agg, &st->dec.wx, when);
+    wxtrace_end(loopTrace, "decode", sample, t);
+    t = wxtrace_begin();
+    if (history)
+        wxhistory_add(history, st->index, when, &st->dec.wx);
+    if (shared)
+        wxshm_publish(shared, st->index, sample, when, &st->dec.wx);
+    // Dropped ones are counted in the ring
+    if (mqtt)
+        wxmqtt_submit(mqtt, st->index, when, &st->dec.wx);
+    if (store_sqlite(st, whichOne) < 0)
+        wxlog_error("Couldn't store report %d\n", whichOne);
+    if (st->archive && wxarchive_append(st->archive, when, &st->dec.wx) < 0)
+        wxlog_error("Couldn't archive report %d\n", whichOne);
+    wxtrace_end(loopTrace, "store", sample, t);
+    return TRUE;
+}
+
+// The poll timer goes off for whichever station is due first
+void armPolls(void){
+    long long due;
+
+    if (wxsched_peek(&pollQueue, &due) < 0)
+        wxloop_arm_timer(mainLoop, pollTimer, 0, 0);
+    else
+        wxloop_arm_timer(mainLoop, pollTimer, due > wxloop_now_ms() ? due - wxloop_now_ms() : 1, 0);
+}
+void queuePoll(struct stationData *st, long wait){
+    wxsched_set(&pollQueue, st->index, wxloop_now_ms() + wait);
+    armPolls();
+}
+
+// One console has stopped answering.  With hotplug it gets let go and
+// picked up again, see hotplugWork().  Otherwise the others carry on
+// without it; when there aren't any others, we're done.
+void stationFailed(struct stationData *st){
+    int i;
+
+    if (!st->failed)
+        st->lostAt = wxloop_now_ms();
+    st->failed = TRUE;
+    if (hotplug){
+        wxloop_arm_timer(mainLoop, hotplugTimer, 1, 0);
+        return;
+    }
+    for(i=0; i<nstations; i++)
+        if (!stations[i].failed)
+            return;
+    usbFailed = TRUE;
+    wxloop_stop(mainLoop);
+}
+
+// A reset that made the console come back as a new device leaves
+// nothing to read from, it can only be opened again.
+void reopenNow(struct stationData *st){
+    long long since = st->recover.since;
+    int failed = wxrecover_skip(&st->recover, WXRECOVER_REOPEN, wxloop_now_ms());
+
+    if (failed >= 0){
+        wxmetrics_inc(loopMetrics, mRecoveries[failed][0]);
+        wxmetrics_observe(loopMetrics, mRecoveryLatency[failed], (wxloop_now_ms() - since) * 1000);
+    }
+    wxlog_warn("Trying %s on %s\n", wxrecover_name(WXRECOVER_REOPEN), st->name);
+    queuePoll(st, 1);
+}
+
+// A read didn't work.  Unless it's been pulled out, that's a step up the
+// ladder in wxrecover.h, and the next report 1 read waits as long as it
+// says.  At the top of the ladder the station's given up on like before.
+void usbTrouble(struct stationData *st, int gone){
+    long long since = st->recover.since;
+    long wait;
+    int step, failed;
+
+    // Not pulled out, just reset into somebody else
+    if (gone && st->recover.step == WXRECOVER_RESET && st->recover.pending == WXRECOVER_RETRY){
+        reopenNow(st);
+        return;
+    }
+    if (gone){
+        st->gone = TRUE;
+        stationFailed(st);
+        return;
+    }
+    step = wxrecover_failed(&st->recover, wxloop_now_ms(), &wait, &failed);
+    if (failed >= 0){
+        wxmetrics_inc(loopMetrics, mRecoveries[failed][0]);
+        wxmetrics_observe(loopMetrics, mRecoveryLatency[failed], (wxloop_now_ms() - since) * 1000);
+    }
+    if (step == WXRECOVER_GIVEUP){
+        wxlog_error("Nothing worked on %s, giving up on it\n", st->name);
+        wxmetrics_inc(loopMetrics, mGiveUps);
+        stationFailed(st);
+        return;
+    }
+    if (step != WXRECOVER_RETRY)
+        wxlog_warn("Trying %s on %s\n", wxrecover_name(step), st->name);
+    queuePoll(st, wait);
+}
+
+// A read worked, which may be the end of some trouble
+void usbWorked(struct stationData *st){
+    long took;
+    int step = wxrecover_ok(&st->recover, wxloop_now_ms(), &took);
+
+    if (step < 0)
+        return;
+    wxmetrics_inc(loopMetrics, mRecoveries[step][1]);
+    wxmetrics_observe(loopMetrics, mRecoveryLatency[step], took * 1000L);
+    wxlog_info("Station %s answering again after %s, %ldms\n", st->name, wxrecover_name(step), took);
+}
+
+void LIBUSB_CALL reportDone(struct libusb_transfer *transfer){
+    struct usbReport *rpt = transfer->user_data;
+    struct stationData *st = rpt->station;
+    unsigned char *data = libusb_control_transfer_get_data(transfer);
+    int actual = transfer->actual_length;
+    int whichOne = rpt->whichOne;
+    int fresh;
+
+    rpt->inFlight = FALSE;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+    wxtrace_end(loopTrace, whichOne == 1 ? "usb report 1" : "usb report 2", rpt->sample, rpt->traceAt);
+    wxmetrics_observe(loopMetrics, mUsbLatency[whichOne-1], wxmetrics_now_us() - rpt->sentAt);
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED){
+        wxmetrics_inc(loopMetrics, mUsbFails[whichOne-1]);
+        wxlog_warn("Read didn't work for report %d on %s, transfer status %d\n", whichOne, st->name, transfer->status);
+        // One that went out before the step being tried says nothing
+        // about whether it worked
+        if (st->recover.step >= 0 && (long long)(rpt->sentAt / 1000) < st->recover.since)
+            return;
+        // It's been pulled out, no use trying it again until it's back
+        usbTrouble(st, transfer->status == LIBUSB_TRANSFER_NO_DEVICE);
+        return;
+    }
+    usbWorked(st);
+    if (capture && wxcapture_write(capture, WXCAPTURE_REPORT(st->index, whichOne), data, actual) < 0)
+        wxlog_error("Couldn't capture report %d\n", whichOne);
+    fresh = processReport(st, whichOne, data, actual, time(NULL), rpt->sample);
+    if (whichOne == 1)
+        queuePoll(st, wxsched_next(&st->sched, rpt->sentAt / 1000, wxloop_now_ms(), fresh));
+}
+
+int getit(struct stationData *st, int whichOne, int noisy){
+    struct usbReport *rpt = &st->reports[whichOne-1];
+    int err;
+
+    // The console hasn't answered the last one yet, don't pile up
+    if (rpt->inFlight)
+        return 0;
+    if (rpt->transfer == NULL){
+        rpt->transfer = libusb_alloc_transfer(0);
+        if (rpt->transfer == NULL)
+            return LIBUSB_ERROR_NO_MEM;
+    }
     // The second parameter is bmRequestType and is a bitfield
     // See http://www.beyondlogic.org/usbnutshell/usb6.shtml
     // for the definitions of the various bits.  With libusb, the
     // #defines for these are at:
     // http://libusb.sourceforge.net/api-1.0/group__misc.html#gga0b0933ae70744726cde11254c39fac91a20eca62c34d2d25be7e1776510184209
-    actual = libusb_control_transfer(weatherStation.handle,
+    libusb_fill_control_setup(rpt->buffer,
                     LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN,
                     //These bytes were stolen with a USB sniffer
                     0x01,0x0100+whichOne,0,
-                    data, 50, 100000);
-    if (actual < 0){
-        fprintf(stderr,"Read didn't work for report %d, %s\n", whichOne, libusb_strerror(actual));
+                    REPORTSZ);
+    libusb_fill_control_transfer(rpt->transfer, st->handle, rpt->buffer,
+                    reportDone, rpt, transferTimeout);
+    rpt->sentAt = wxmetrics_now_us();
+    rpt->sample = ++nextSample;
+    rpt->traceAt = wxtrace_begin();
+    wxmetrics_inc(loopMetrics, mUsbCalls[whichOne-1]);
+    err = libusb_submit_transfer(rpt->transfer);
+    if (err < 0){
+        wxmetrics_inc(loopMetrics, mUsbFails[whichOne-1]);
+        wxlog_warn("Read didn't work for report %d on %s, %s\n", whichOne, st->name, libusb_strerror(err));
+        return err;
     }
-    else {
-        // If you want both of the reports that the station provides,
-        // just allow for it.  Right this second, I've found every thing
-        // I need in report 1.  When I look further at report 2, this will
-        // change
-        fprintf(stderr,"R%d:%d:", whichOne, actual);
-        int i;
-        for(i=0; i<actual; i++){
-            fprintf(stderr,"%02X ",data[i]);
-        }
-        if(1 == whichOne)fprintf(stderr,"\n");
-        if (whichOne == 1)
-            // The actual data starts after the first byte
-            // The first byte is the report number returned by
-            // the usb read.
-            decode(&data[1], actual-1, noisy);
-        if (whichOne == 2) {
-            decode2(data, actual-1, noisy);
+    rpt->inFlight = TRUE;
+    usbService();
+    return 0;
+}
+
+// These get called by the event loop when it's time to do something
+// Report 1 goes out to each station when wxsched says, and the next one
+// is queued when the answer comes back to reportDone().  One that's
+// failed drops off the queue until attachStation() reads it again.
+void pollDue(int id, void *arg){
+    struct stationData *st;
+    long long due, now = wxloop_now_ms();
+    int i, err;
+
+    while ((i = wxsched_peek(&pollQueue, &due)) >= 0 && due <= now){
+        wxsched_pop(&pollQueue);
+        st = &stations[i];
+        if (st->failed || recoverStep(st) < 0)
+            continue;
+        if ((err = getit(st, 1, noisy)) < 0)
+            usbTrouble(st, err == LIBUSB_ERROR_NO_DEVICE);
+    }
+    armPolls();
+}
+// Every station's report 2 goes out at once, the answers come back to
+// reportDone() as they arrive.
+void pollReport(int id, void *arg){
+    int whichOne = (int)(intptr_t)arg;
+
+    int i, err;
+
+    for(i=0; i<nstations; i++)
+        if (!stations[i].failed && stations[i].recover.step < 0 &&
+            (err = getit(&stations[i], whichOne, noisy)) < 0)
+            usbTrouble(&stations[i], err == LIBUSB_ERROR_NO_DEVICE);
+}
+void dbTimer(int id, void *arg){
+    wxsqlite_flush(sqliteDb, 0);
+}
+void archiveTimer(int id, void *arg){
+    int i;
+
+    for(i=0; i<nstations; i++)
+        if (stations[i].archive)
+            wxarchive_flush(stations[i].archive);
+}
+// This simply puts the data out so we can see it, or so whatever is on
+// the other end of stdout can have it.
+void showTimer(int id, void *arg){
+    time_t now = time(NULL);
+    struct stationData *st;
+    uint64_t t;
+    int i;
+
+    for(i=0; i<nstations; i++){
+        st = &stations[i];
+        // Kept for a console that hasn't been plugged in yet
+        if (st->gone && st->lastLength == 0)
+            continue;
+        t = wxtrace_begin();
+        if (quiet)
+            ;
+        else if (!wxchange_due(&st->shown, &st->change, &st->dec.wx, &changePolicy, now))
+            wxmetrics_inc(loopMetrics, mSuppressed[0]);
+        else if (wxsink_write(output, st->index, now, &st->dec.wx) < 0)
+            wxlog_error("Couldn't write to stdout\n");
+        if (st->csv && wxcsv_write(st->csv, now, &st->dec.wx) < 0)
+            wxlog_error("Couldn't write the day's CSV for %s\n", st->name);
+        wxtrace_end(loopTrace, "output", st->sample, t);
+    }
+}
+void csvTimer(int id, void *arg){
+    int i;
+
+    for(i=0; i<nstations; i++)
+        if (stations[i].csv)
+            wxcsv_flush(stations[i].csv);
+}
+void uploadTimer(int id, void *arg){
+    struct wxring_stats stats;
+    struct wxagg_summary agg;
+    time_t now = time(NULL);
+    uint64_t t;
+    int i;
+
+    for(i=0; i<nstations; i++){
+        if (!stations[i].upload || stations[i].failed)
+            continue;
+        if (!wxchange_due(&stations[i].uploaded, &stations[i].change, &stations[i].dec.wx, &changePolicy, now)){
+            wxmetrics_inc(loopMetrics, mSuppressed[1]);
+            continue;
         }
+        t = wxtrace_begin();
+        wxagg_get(&stations[i].agg, now, &agg);
+        if (wxupload_submit(uploader, i, stations[i].sample, &stations[i].dec.wx, &agg) < 0)
+            wxlog_warn("Upload queue full, observation from %s dropped\n", stations[i].name);
+        wxtrace_end(loopTrace, "submit", stations[i].sample, t);
+    }
+    if (noisy){
+        wxupload_get_stats(uploader, &stats);
+        wxlog_info("Upload queue depth %u (max %u), %lu queued, %lu dropped\n",
+            stats.depth, stats.highWater, stats.pushed, stats.dropped);
     }
-    return actual;
 }
-// I do several things here that aren't strictly necessary.  As I learned about
-// libusb, I tried things and also used various techniques to learn about the
-// weatherstation's implementation.  I left a lot of it in here in case I needed to
-// use it later.  Someone may find it useful to hack into some other device.
-int main(int argc, char **argv)
-{
-    char *usage = {"usage: %s -u -n\n"};
-    int libusbDebug = 1; //This will turn on the DEBUG for libusb
-    int noisy = 1;  //This will print the packets as they come in
-    int quiet = 1;
-    libusb_device **devs;
-    int r, err, c;
-    ssize_t cnt;
-    struct stationWU wu;
+// A server error or no answer at all is worth trying again later.  If the
+// site didn't like what we sent, sending it again won't help.
+int uploadFailed(int rc, long status){
+    return rc != 0 || status >= 500;
+}
 
-    memset(&weatherStation, '\0', sizeof(struct stationData));
-    memset(&wu, '\0', sizeof(struct stationWU));
-    memset(&weatherData, '\0', sizeof(struct weatherData));
-    weatherData.rainRaw = 0; //first starting up
-    strlcpy(wu.stationID, STATIONID, strlen(STATIONID)+1);
-    //safestrlcpy(wu.stationID, STATIONID, strlen(STATIONID)+1, WUNDERSTRSZ);
-    //safestrlcpy(wu.stationPassword, STATIONKEY, strlen(STATIONKEY)+1, WUNDERSTRSZ);
-    strlcpy(wu.stationPassword, STATIONKEY, strlen(STATIONKEY)+1);
+// On the upload thread, so into its own shard
+void countUpload(int target, int rc, long status, long ms){
+    wxmetrics_inc(uploadMetrics, mUploads[target]);
+    if (uploadFailed(rc, status))
+        wxmetrics_inc(uploadMetrics, mUploadFails[target]);
+    wxmetrics_observe(uploadMetrics, mUploadLatency[target], ms * 1000);
+}
 
-    while ((c = getopt (argc, argv, "unqh")) != -1)
-        switch (c){
-            case 'u':
-                libusbDebug = 1;
-                break;
-            case 'n':
-                noisy = 1;
-                break;
-            case 'q':
-                quiet = 1;
-                break;
-            case 'h':
-                fprintf(stderr, usage, argv[0]);
-            case '?':
-                exit(1);
-            default:
-                exit(1);
-       }
-    fprintf (stderr,"libusbDebug = %d, noisy = %d\n", libusbDebug, noisy);
+// The spool sits on the card for anyone to read, so Wunderground URLs go
+// in it without their PASSWORD and get it back when they're replayed.
+void withoutPassword(const char *url, char *buf, size_t size){
+    const char *p = strstr(url, "&PASSWORD="), *end;
 
-    if (signal(SIGINT, sig_handler) == SIG_ERR)
-        fprintf(stderr,"Couldn't set up signal handler\n");
-    err = libusb_init(NULL);
-    if (err < 0){
-        fprintf(stderr,"Couldn't init usblib, %s\n", libusb_strerror(err));
-        exit(1);
+    if (p == NULL){
+        strlcpy(buf, url, size);
+        return;
     }
-    // This is where you can get debug output from libusb.
-    // just set it to LIBUSB_LOG_LEVEL_DEBUG
-    if (libusbDebug)
-        libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
-    else
-        libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
+    end = strchr(p + 1, '&');
+    snprintf(buf, size, "%.*s%s", (int)(p - url), url, end ? end : "");
+}
+// The password is whichever station's has the ID in the URL.  Returns -1
+// if none of them has it any more.  On the upload thread, so only the
+// stations that have been published to it.
+int withPassword(const char *url, char *buf, size_t size){
+    const char *id = strstr(url, "?ID="), *end;
+    int ready = atomic_load_explicit(&stationsReady, memory_order_acquire);
+    size_t len;
+    int i;
+
+    // Not for Wunderground, or spooled before the password was left out
+    if (id == NULL || strstr(url, "&PASSWORD=")){
+        strlcpy(buf, url, size);
+        return 0;
+    }
+    id += 4;
+    end = strchr(id, '&');
+    len = end ? (size_t)(end - id) : strlen(id);
+    for(i=0; i<ready; i++)
+        if (strlen(stations[i].wu.stationID) == len && strncmp(stations[i].wu.stationID, id, len) == 0){
+            snprintf(buf, size, "%.*s&PASSWORD=%s%s", (int)(id + len - url), url,
+                stations[i].wu.stationPassword, id + len);
+            return 0;
+        }
+    return -1;
+}
 
+// Send what's in the spool for the sites in targets, a few at a time,
+// until it's empty, a site fails again, or a live observation shows up.
+void replaySpool(unsigned int targets){
+    struct wxspool_rec recs[REPLAYSLOTS];
+    struct wxspool_stats stats;
+    char url[WXHTTP_URLSZ];
+    int orphan[REPLAYSLOTS];
+    long status, ms;
+    int i, n, rc, sent = 0;
+
+    while (targets && sent < REPLAYBATCH && wxupload_pending(uploader) == 0){
+        n = wxspool_peek(spool, targets, recs, REPLAYSLOTS);
+        if (n == 0)
+            break;
+        for(i=0; i<n; i++){
+            orphan[i] = withPassword(recs[i].url, url, sizeof(url)) < 0;
+            // One that won't queue comes back failed and stays spooled
+            if (!orphan[i] && wxhttp_get(httpClient, UPLOADSITES+i, url) < 0)
+                wxlog_warn("Couldn't queue a spooled %s upload\n", uploadSite[recs[i].target]);
+        }
+        wxhttp_run(httpClient);
+        for(i=0; i<n; i++){
+            // Nothing to sign it with, it can only be turned away
+            if (orphan[i]){
+                wxlog_warn("No station has the ID of a spooled %s upload any more, dropping it\n",
+                    uploadSite[recs[i].target]);
+                wxspool_ack(spool, &recs[i]);
+                continue;
+            }
+            rc = wxhttp_result(httpClient, UPLOADSITES+i, &status, &ms);
+            countUpload(recs[i].target, rc, status, ms);
+            if (uploadFailed(rc, status))
+                targets &= ~(1u << recs[i].target);
+            else {
+                wxspool_ack(spool, &recs[i]);
+                wxmetrics_inc(uploadMetrics, mReplayed);
+            }
+        }
+        sent += n;
+    }
+    if (sent){
+        wxspool_get_stats(spool, &stats);
+        wxlog_info("Spool replayed %d, %lu still waiting, %lu evicted\n",
+            sent, stats.pending, stats.evicted);
+    }
+}
 
-    cnt = libusb_get_device_list(NULL, &devs);
-    if (cnt < 0){
-        fprintf(stderr,"Couldn't get device list, %s\n", libusb_strerror(err));
-        exit(1);
+// and this one runs on the upload thread with its own copy of the data
+// markandgrace.com only knows about the one station, the first.  The
+// station was filled in before its observation was queued, and the ring
+// hands that over along with it; no other station is looked at.
+void uploadObservation(int station, unsigned int sample, const struct weatherData *wx,
+                       const struct wxagg_summary *agg, time_t when, void *arg){
+    struct stationWU *wu = &stations[station].wu;
+    unsigned int working = 0, queued = 1u << UPLOAD_WU;
+    uint64_t t = wxtrace_begin();
+    char urls[UPLOADSITES][WXHTTP_URLSZ], url[WXHTTP_URLSZ];
+    long status, ms;
+    int i, rc;
+
+    if (station == 0)
+        queued |= 1u << UPLOAD_MC;
+    // One that won't queue comes back failed, and what was built for it
+    // is what gets spooled
+    if (wucurl(wx, agg, wu, when, urls[UPLOAD_WU], sizeof(urls[UPLOAD_WU])) < 0)
+        wxlog_error("Couldn't queue the %s upload\n", uploadSite[UPLOAD_WU]);
+    if ((queued & (1u << UPLOAD_MC)) && mccurl(wx, agg, wu, when, urls[UPLOAD_MC], sizeof(urls[UPLOAD_MC])) < 0)
+        wxlog_error("Couldn't queue the %s upload\n", uploadSite[UPLOAD_MC]);
+    wxhttp_run(httpClient);
+    for(i=0; i<UPLOADSITES; i++){
+        if (!(queued & (1u << i)))
+            continue;
+        rc = wxhttp_result(httpClient, i, &status, &ms);
+        wxlog_info("CURL %s retval: %d HTTP %ld in %ldms\n", uploadSite[i], rc, status, ms);
+        countUpload(i, rc, status, ms);
+        if (!uploadFailed(rc, status))
+            working |= 1u << i;
+        else if (spool){
+            withoutPassword(urls[i], url, sizeof(url));
+            if (wxspool_append(spool, i, url) < 0)
+                wxlog_error("Couldn't spool the %s upload, it's lost\n", uploadSite[i]);
+            else
+                wxmetrics_inc(uploadMetrics, mSpooled);
+        }
     }
-    // got get the device; the device handle is saved in weatherStation struct.
-    if (!findDevice(devs)){
-        fprintf(stderr,"Couldn't find the device\n");
-        exit(1);
+    write_line(wx, agg, &stations[station]);
+    wxtrace_end(uploadTrace, "upload", sample, t);
+    // The site is answering again, catch it up
+    t = wxtrace_begin();
+    if (spool)
+        replaySpool(working);
+    wxtrace_end(uploadTrace, "spool replay", sample, t);
+}
+
+// Everything counted is registered here, before the upload thread starts
+void setupMetrics(void){
+    static char frameLabels[WXMSG_TYPES][16];
+    static char stepLabels[WXRECOVER_STEPS][3][48];
+    static const char *reportLabels[2] = {"report=\"1\"", "report=\"2\""};
+    static const char *siteLabels[UPLOADSITES] = {"target=\"wunderground\"", "target=\"markandgrace\""};
+    int i, f;
+
+    for(i=0; i<2; i++)
+        mUsbCalls[i] = wxmetrics_counter(metrics, "wx_usb_transfers_total", reportLabels[i],
+            "Control transfers sent to the consoles");
+    for(i=0; i<2; i++)
+        mUsbFails[i] = wxmetrics_counter(metrics, "wx_usb_transfer_failures_total", reportLabels[i],
+            "Control transfers that couldn't be sent or didn't complete");
+    for(i=0; i<2; i++)
+        mUsbLatency[i] = wxmetrics_histogram(metrics, "wx_usb_transfer_seconds", reportLabels[i],
+            "How long the console took to answer");
+    // The message types wxdecode knows about each get their own, the
+    // rest are lumped together
+    for(i=0; i<WXMSG_TYPES; i++){
+        for(f=0; f<WXF_NFIELDS; f++)
+            if (wxFields[i][f].hiMask || wxFields[i][f].loMask)
+                break;
+        if (f == WXF_NFIELDS)
+            continue;
+        snprintf(frameLabels[i], sizeof(frameLabels[i]), "type=\"%d\"", i);
+        mFrames[i] = wxmetrics_counter(metrics, "wx_frames_decoded_total", frameLabels[i],
+            "Frames decoded, by message type");
     }
-    // Now I've found the weather station and can start to try stuff
-    // So, I'll get the device descriptor
-    struct libusb_device_descriptor deviceDesc;
-    err = libusb_get_device_descriptor(weatherStation.device, &deviceDesc);
-    if (err){
-        fprintf(stderr,"Couldn't get device descriptor, %s\n", libusb_strerror(err));
-        exit(1);
+    mFramesOther = wxmetrics_counter(metrics, "wx_frames_decoded_total", "type=\"other\"", "");
+    mFramesConsole = wxmetrics_counter(metrics, "wx_frames_decoded_total", "type=\"console\"", "");
+    for(i=0; i<WXMSG_TYPES; i++)
+        if (frameLabels[i][0] == '\0')
+            mFrames[i] = mFramesOther;
+    for(i=0; i<UPLOADSITES; i++)
+        mUploads[i] = wxmetrics_counter(metrics, "wx_upload_attempts_total", siteLabels[i],
+            "Uploads tried, live and replayed from the spool");
+    for(i=0; i<UPLOADSITES; i++)
+        mUploadFails[i] = wxmetrics_counter(metrics, "wx_upload_failures_total", siteLabels[i],
+            "Uploads that got no answer or a server error");
+    for(i=0; i<UPLOADSITES; i++)
+        mUploadLatency[i] = wxmetrics_histogram(metrics, "wx_upload_seconds", siteLabels[i],
+            "How long an upload took");
+    mSuppressed[0] = wxmetrics_counter(metrics, "wx_suppressed_total", "consumer=\"stdout\"",
+        "Observations not sent because nothing had changed enough");
+    mSuppressed[1] = wxmetrics_counter(metrics, "wx_suppressed_total", "consumer=\"upload\"", "");
+    mSpooled = wxmetrics_counter(metrics, "wx_spool_appended_total", "",
+        "Failed uploads kept to send later");
+    mReplayed = wxmetrics_counter(metrics, "wx_spool_replayed_total", "",
+        "Spooled uploads that have gone out since");
+    mRepeats = wxmetrics_counter(metrics, "wx_usb_repeats_total", "",
+        "Report 1 reads that brought back the frame we already had");
+    for(i=0; i<WXRECOVER_STEPS; i++){
+        snprintf(stepLabels[i][0], sizeof(stepLabels[i][0]), "step=\"%s\",outcome=\"failed\"", wxrecover_name(i));
+        snprintf(stepLabels[i][1], sizeof(stepLabels[i][1]), "step=\"%s\",outcome=\"ok\"", wxrecover_name(i));
+        snprintf(stepLabels[i][2], sizeof(stepLabels[i][2]), "step=\"%s\"", wxrecover_name(i));
+        mRecoveries[i][0] = wxmetrics_counter(metrics, "wx_usb_recovery_total", stepLabels[i][0],
+            "Steps taken to get a console answering again, by whether the read after worked");
+        mRecoveries[i][1] = wxmetrics_counter(metrics, "wx_usb_recovery_total", stepLabels[i][1], "");
     }
-    fprintf(stderr,"got the device descriptor back\n");
+    for(i=0; i<WXRECOVER_STEPS; i++)
+        mRecoveryLatency[i] = wxmetrics_histogram(metrics, "wx_usb_recovery_seconds", stepLabels[i][2],
+            "From a step being taken to knowing whether it worked");
+    mGiveUps = wxmetrics_counter(metrics, "wx_usb_given_up_total", "",
+        "Consoles that nothing would get answering");
+    mMqttLatency = wxmetrics_histogram(metrics, "wx_mqtt_publish_seconds", "",
+        "From an observation being handed to the MQTT thread to the broker acknowledging each message");
+    loopMetrics = wxmetrics_shard(metrics);
+    uploadMetrics = wxmetrics_shard(metrics);
+    mqttMetrics = wxmetrics_shard(metrics);
+}
 
-    // Open the device and save the handle in the weatherStation struct
-    err = libusb_open(weatherStation.device, &weatherStation.handle);
-    if (err){
-        fprintf(stderr,"Open failed, %s\n", libusb_strerror(err));
-        exit(1);
+// The things that are only worth knowing right when somebody asks
+void metricsGauges(struct wxmetrics_page *page, void *arg){
+    static const char *fieldName[7] = {"wsTime", "wdTime", "tTime", "hTime", "rcTime", "rrTime", "bTime"};
+    struct wxring_stats stats;
+    struct wxlog_stats logStats;
+    struct wxmqtt_stats mqttStats;
+    struct weatherData *wx;
+    char labels[96];
+    time_t now = time(NULL), t[7];
+    int i, f;
+
+    wxupload_get_stats(uploader, &stats);
+    wxmetrics_help(page, "wx_upload_queue_depth", "gauge", "Observations waiting for the upload thread");
+    wxmetrics_sample(page, "wx_upload_queue_depth", "", stats.depth);
+    wxmetrics_help(page, "wx_upload_queue_high_water", "gauge", "Most that have ever been waiting");
+    wxmetrics_sample(page, "wx_upload_queue_high_water", "", stats.highWater);
+    wxmetrics_help(page, "wx_upload_queue_dropped_total", "counter", "Observations dropped with the queue full");
+    wxmetrics_sample(page, "wx_upload_queue_dropped_total", "", stats.dropped);
+    wxlog_get_stats(&logStats);
+    wxmetrics_help(page, "wx_log_messages_total", "counter", "Log messages, by what became of them");
+    wxmetrics_sample(page, "wx_log_messages_total", "outcome=\"logged\"", logStats.logged);
+    wxmetrics_sample(page, "wx_log_messages_total", "outcome=\"dropped\"", logStats.dropped);
+    wxmetrics_sample(page, "wx_log_messages_total", "outcome=\"limited\"", logStats.limited);
+    if (mqtt){
+        wxmqtt_get_stats(mqtt, &mqttStats);
+        wxmqtt_get_queue(mqtt, &stats);
+        wxmetrics_help(page, "wx_mqtt_messages_total", "counter", "MQTT messages, by what became of them");
+        wxmetrics_sample(page, "wx_mqtt_messages_total", "outcome=\"published\"", mqttStats.published);
+        wxmetrics_sample(page, "wx_mqtt_messages_total", "outcome=\"acked\"", mqttStats.acked);
+        wxmetrics_sample(page, "wx_mqtt_messages_total", "outcome=\"resent\"", mqttStats.resent);
+        wxmetrics_help(page, "wx_mqtt_writes_total", "counter", "Batches of messages written to the broker");
+        wxmetrics_sample(page, "wx_mqtt_writes_total", "", mqttStats.writes);
+        wxmetrics_help(page, "wx_mqtt_bytes_total", "counter", "Bytes written to the broker");
+        wxmetrics_sample(page, "wx_mqtt_bytes_total", "", mqttStats.bytes);
+        wxmetrics_help(page, "wx_mqtt_connects_total", "counter", "Times the broker has taken us");
+        wxmetrics_sample(page, "wx_mqtt_connects_total", "", mqttStats.connects);
+        wxmetrics_help(page, "wx_mqtt_connected", "gauge", "1 while the broker has us");
+        wxmetrics_sample(page, "wx_mqtt_connected", "", mqttStats.connected);
+        wxmetrics_help(page, "wx_mqtt_inflight", "gauge", "Messages waiting for the broker to acknowledge them");
+        wxmetrics_sample(page, "wx_mqtt_inflight", "", mqttStats.inflight);
+        wxmetrics_help(page, "wx_mqtt_queue_depth", "gauge", "Observations waiting for the MQTT thread");
+        wxmetrics_sample(page, "wx_mqtt_queue_depth", "", stats.depth);
+        wxmetrics_help(page, "wx_mqtt_queue_dropped_total", "counter", "Observations dropped with the MQTT queue full");
+        wxmetrics_sample(page, "wx_mqtt_queue_dropped_total", "", stats.dropped);
     }
-    fprintf(stderr,"I was able to open it\n");
-    // There's a bug in either the usb library, the linux driver or the
-    // device itself.  I suspect the usb driver, but don't know for sure.
-    // If you plug and unplug the weather station a few times, it will stop
-    // responding to reads.  It also exhibits some strange behaviour to
-    // getting the configuration.  I found out after a couple of days of
-    // experimenting that doing a clear-halt on the device while before it
-    // was opened it would clear the problem.  So, I have one here and a
-    // little further down after it has been opened.
-    fprintf(stderr,"trying clear halt on endpoint %X ... ", 0x81);
-    err = libusb_clear_halt(weatherStation.handle, 0x81);
-    if (err){
-        fprintf(stderr,"clear halt crapped, %s  Bug Detector\n", libusb_strerror(err));;
+
+    wxmetrics_help(page, "wx_station_up", "gauge", "1 if the console is answering");
+    for(i=0; i<nstations; i++){
+        snprintf(labels, sizeof(labels), "station=\"%s\"", stations[i].name);
+        wxmetrics_sample(page, "wx_station_up", labels, !stations[i].failed);
     }
-    else {
-        fprintf(stderr,"OK\n");
+    wxmetrics_help(page, "wx_field_age_seconds", "gauge", "How long since each reading last changed");
+    for(i=0; i<nstations; i++){
+        wx = &stations[i].dec.wx;
+        t[0] = wx->wsTime; t[1] = wx->wdTime; t[2] = wx->tTime; t[3] = wx->hTime;
+        t[4] = wx->rcTime; t[5] = wx->rrTime; t[6] = wx->bTime;
+        for(f=0; f<7; f++){
+            // Never heard from yet
+            if (t[f] == 0)
+                continue;
+            snprintf(labels, sizeof(labels), "station=\"%s\",field=\"%s\"", stations[i].name, fieldName[f]);
+            wxmetrics_sample(page, "wx_field_age_seconds", labels, now - t[f]);
+        }
+    }
+    wxmetrics_help(page, "wx_sensor_period_seconds", "gauge", "How often the sensor head sends, as measured");
+    for(i=0; i<nstations; i++){
+        // Not until we've found it
+        if (stations[i].sched.hi == 0)
+            continue;
+        snprintf(labels, sizeof(labels), "station=\"%s\"", stations[i].name);
+        wxmetrics_sample(page, "wx_sensor_period_seconds", labels, stations[i].sched.period / 1000.0);
     }
+}
 
-    // Now that it's opened, I can free the list of all devices
-    libusb_free_device_list(devs, 1); // Documentation says to get rid of the list
-                                      // Once I have the device I need
-    fprintf(stderr,"Released the device list\n");
-    // Now I have to check to see if the kernal using udev has attached
-    // a driver to the device.  If it has, it has to be detached so I can
-    // use the device.
-    if(libusb_kernel_driver_active(weatherStation.handle, 0) == 1) { //find out if kernel driver is attached
-        fprintf(stderr,"Kernal driver active\n");
-        if(libusb_detach_kernel_driver(weatherStation.handle, 0) == 0) //detach it
-            fprintf(stderr,"Kernel Driver Detached!\n");
+// Hand a played back report to the station it came from, making that
+// station up if we haven't seen it yet.
+void replayReport(struct wxcapture_rec *rec){
+    int index = WXCAPTURE_STATION(rec->report);
+    struct stationData *st;
+
+    while (nstations <= index){
+        st = newStation();
+        if (st == NULL)
+            return;
+        openStationFiles(st);
+        publishStations();
     }
+    processReport(&stations[index], WXCAPTURE_ID(rec->report), rec->data, rec->length, rec->wall, ++nextSample);
+}
 
-    int activeConfig;
-    err =libusb_get_configuration(weatherStation.handle, &activeConfig);
-    if (err){
-        fprintf(stderr,"Can't get current active configuration, %s\n", libusb_strerror(err));;
-        exit(1);
+// Play back the report we're holding, then set the timer for the next one
+// as far out as it was when it was captured.
+void replayNext(int id, void *arg){
+    uint64_t then = replayRec.mono;
+    int rc;
+
+    replayReport(&replayRec);
+    rc = wxcapture_read(replay, &replayRec);
+    if (rc <= 0){
+        wxlog_info("Replay %s\n", rc < 0 ? "stopped, the capture is damaged" : "finished");
+        wxloop_stop(mainLoop);
+        return;
     }
-    fprintf(stderr,"Currently active configuration is %d\n", activeConfig);
+    // A gap of 0 would disarm the timer, so at least a millisecond
+    wxloop_arm_timer(mainLoop, replayTimer,
+        replayRec.mono > then + 1000000 ? (long)((replayRec.mono - then) / 1000000) : 1, 0);
+}
 
-    if(activeConfig != 1){
-        err = libusb_set_configuration(weatherStation.handle, 1);
-        if (err){
-            fprintf(stderr,"Cannot set configuration, %s\n", libusb_strerror(err));;
-            exit(1);
-        }
-    fprintf(stderr,"Just did the set configuration\n");
+// As fast as it will go, and say how fast that was
+void replayAll(void){
+    uint64_t start = wxcapture_now(), took;
+    unsigned long frames = 0;
+    int rc;
+
+    while ((rc = wxcapture_read(replay, &replayRec)) > 0){
+        replayReport(&replayRec);
+        frames++;
     }
+    took = wxcapture_now() - start;
+    if (rc < 0)
+        wxlog_error("Replay stopped, the capture is damaged\n");
+    wxlog_info("Replayed %lu reports in %0.3fs, %0.0f ns/report, %0.0f reports/s\n",
+        frames, took / 1e9, frames ? (double)took / frames : 0.0,
+        took ? frames * 1e9 / took : 0.0);
+}
 
-    err = libusb_claim_interface(weatherStation.handle, 0); //claim interface 0 (the first) of device (mine had jsut 1)
-    if(err) {
-        fprintf(stderr,"Cannot claim interface, %s\n", libusb_strerror(err));
+void openReplay(void){
+    replay = wxcapture_open(replayPath);
+    if (replay == NULL){
+        wxlog_error("Couldn't open capture %s\n", replayPath);
         exit(1);
     }
-    fprintf(stderr,"Claimed Interface\n");
-    fprintf(stderr,"Number of configurations: %d\n",deviceDesc.bNumConfigurations);
+    // There's always at least the one, the others turn up as their
+    // reports do
+    newStation();
+}
+
+// I do several things here that aren't strictly necessary.  As I learned about
+// libusb, I tried things and also used various techniques to learn about the
+// weatherstation's implementation.  I left a lot of it in here in case I needed to
+// use it later.  Someone may find it useful to hack into some other device.
+// None of it is needed to read the console, so it only happens with -v.
+void describeDevice(struct stationData *st)
+{
+    struct libusb_device_descriptor deviceDesc;
     struct libusb_config_descriptor *config;
-    libusb_get_config_descriptor(weatherStation.device, 0, &config);
-    fprintf(stderr,"Number of Interfaces: %d\n",(int)config->bNumInterfaces);
+    int err, activeConfig;
+
+    err = libusb_get_device_descriptor(st->device, &deviceDesc);
+    if (err){
+        wxlog_error("Couldn't get device descriptor, %s\n", libusb_strerror(err));
+        return;
+    }
+    wxlog_info("got the device descriptor back\n");
+    err = libusb_get_configuration(st->handle, &activeConfig);
+    if (err == 0)
+        wxlog_info("Currently active configuration is %d\n", activeConfig);
+    wxlog_info("Number of configurations: %d\n",deviceDesc.bNumConfigurations);
+    err = libusb_get_config_descriptor(st->device, 0, &config);
+    if (err){
+        wxlog_error("Couldn't get config descriptor, %s\n", libusb_strerror(err));
+        return;
+    }
+    wxlog_info("Number of Interfaces: %d\n",(int)config->bNumInterfaces);
     // I know, the device only has one interface, but I wanted this code
     // to serve as a reference for some future hack into some other device,
     // so I put this loop to show the other interfaces that may
@@ -747,37 +1527,360 @@ int main(int argc, char **argv)
     int i, j, k;
     for(i=0; i<(int)config->bNumInterfaces; i++) {
         inter = &config->interface[i];
-        fprintf(stderr,"Number of alternate settings: %d\n", inter->num_altsetting);
+        wxlog_info("Number of alternate settings: %d\n", inter->num_altsetting);
         for(j=0; j < inter->num_altsetting; j++) {
             interdesc = &inter->altsetting[j];
-            fprintf(stderr,"Interface Number: %d\n", (int)interdesc->bInterfaceNumber);
-            fprintf(stderr,"Number of endpoints: %d\n", (int)interdesc->bNumEndpoints);
+            wxlog_info("Interface Number: %d\n", (int)interdesc->bInterfaceNumber);
+            wxlog_info("Number of endpoints: %d\n", (int)interdesc->bNumEndpoints);
             for(k=0; k < (int)interdesc->bNumEndpoints; k++) {
                 epdesc = &interdesc->endpoint[k];
-                fprintf(stderr,"Descriptor Type: %d\n",(int)epdesc->bDescriptorType);
-                fprintf(stderr,"Endpoint Address: 0x%2X\n",(int)epdesc->bEndpointAddress);
+                wxlog_info("Descriptor Type: %d\n",(int)epdesc->bDescriptorType);
+                wxlog_info("Endpoint Address: 0x%2X\n",(int)epdesc->bEndpointAddress);
                 // Below is how to tell which direction the
                 // endpoint is supposed to work.  It's the high order bit
                 // in the endpoint address.  I guess they wanted to hide it.
-                fprintf(stderr," Direction is ");
-                if (((int)epdesc->bEndpointAddress & LIBUSB_ENDPOINT_IN) != 0)
-                    fprintf(stderr," In (device to host)");
-                else
-                    fprintf(stderr," Out (host to device)");
-                fprintf(stderr,"\n");
+                wxlog_info("Direction is %s\n",
+                    ((int)epdesc->bEndpointAddress & LIBUSB_ENDPOINT_IN) != 0 ?
+                    "In (device to host)" : "Out (host to device)");
             }
         }
     }
-    fprintf(stderr,"trying clear halt on endpoint %X ... ", (int)epdesc->bEndpointAddress);
-    err = libusb_clear_halt(weatherStation.handle, (int)epdesc->bEndpointAddress);
+    libusb_free_config_descriptor(config);
+}
+
+// Get one console ready to read.  Returns -1 if it can't be used.
+int openOne(struct stationData *st)
+{
+    int err;
+
+    // Open the device and save the handle in its station
+    err = libusb_open(st->device, &st->handle);
     if (err){
-        fprintf(stderr,"clear halt crapped, %s  SHUCKS\n", libusb_strerror(err));;
-        closeUpAndLeave();
-        exit(1);
+        wxlog_error("Open failed, %s\n", libusb_strerror(err));
+        return -1;
+    }
+    wxlog_info("I was able to open %s\n", st->name);
+    // There's a bug in either the usb library, the linux driver or the
+    // device itself.  I suspect the usb driver, but don't know for sure.
+    // If you plug and unplug the weather station a few times, it will stop
+    // responding to reads.  It also exhibits some strange behaviour to
+    // getting the configuration.  I found out after a couple of days of
+    // experimenting that doing a clear-halt on the device while before it
+    // was opened it would clear the problem.  It used to get a second one
+    // after the interface was claimed; one is enough.
+    err = libusb_clear_halt(st->handle, 0x81);
+    if (err)
+        wxlog_warn("clear halt on endpoint %X crapped, %s  Bug Detector\n", 0x81, libusb_strerror(err));
+
+    // Now I have to check to see if the kernal using udev has attached
+    // a driver to the device.  If it has, it has to be detached so I can
+    // use the device.
+    if(libusb_kernel_driver_active(st->handle, 0) == 1) { //find out if kernel driver is attached
+        wxlog_info("Kernal driver active\n");
+        if(libusb_detach_kernel_driver(st->handle, 0) == 0) //detach it
+            wxlog_info("Kernel Driver Detached!\n");
+    }
+
+    // It comes up in configuration 1 and stays there, so the configuration
+    // only gets looked at when it won't give us the interface.
+    err = libusb_claim_interface(st->handle, 0); //claim interface 0 (the first) of device (mine had jsut 1)
+    if (err) {
+        int activeConfig;
+        if (libusb_get_configuration(st->handle, &activeConfig) == 0 && activeConfig != 1){
+            wxlog_info("Currently active configuration is %d\n", activeConfig);
+            err = libusb_set_configuration(st->handle, 1);
+            if (err){
+                wxlog_error("Cannot set configuration, %s\n", libusb_strerror(err));;
+                return -1;
+            }
+            wxlog_info("Just did the set configuration\n");
+            err = libusb_claim_interface(st->handle, 0);
+        }
+    }
+    if(err) {
+        wxlog_error("Cannot claim interface, %s\n", libusb_strerror(err));
+        return -1;
+    }
+    wxlog_info("Claimed Interface\n");
+    if (diagnostics)
+        describeDevice(st);
+    return 0;
+}
+
+// Let go of a console's handle, whether it's still there or not
+void dropHandle(struct stationData *st)
+{
+    if (st->handle == NULL)
+        return;
+    libusb_release_interface(st->handle, 0);
+    libusb_close(st->handle);
+    st->handle = NULL;
+}
+
+// Look up whatever's plugged in where st's console was and make it st's
+// device, it may not be the libusb_device we had.  Returns -1 if there
+// isn't one there now.
+int findAgain(struct stationData *st)
+{
+    libusb_device **devs, *found = NULL;
+    char name[32];
+    ssize_t i, cnt = libusb_get_device_list(NULL, &devs);
+
+    if (cnt < 0){
+        wxlog_error("Couldn't get device list, %s\n", libusb_strerror((int)cnt));
+        return -1;
+    }
+    for(i=0; i<cnt && found == NULL; i++)
+        if (strcmp(deviceName(devs[i], name, sizeof(name)), st->name) == 0 && isConsole(devs[i]))
+            found = libusb_ref_device(devs[i]);
+    libusb_free_device_list(devs, 1);
+    if (found == NULL){
+        wxlog_warn("Station %s isn't plugged in any more\n", st->name);
+        return -1;
+    }
+    if (st->device)
+        libusb_unref_device(st->device);
+    st->device = found;
+    return 0;
+}
+
+// Bring a console that was lost back into service, and get its weather
+// right away instead of waiting for the next poll.  Returns -1, with it
+// still failed, if it won't open or won't take the read.
+int attachStation(struct stationData *st)
+{
+    if (openOne(st) < 0){
+        dropHandle(st);
+        return -1;
+    }
+    wxrecover_init(&st->recover, st->recover.seed);
+    // Left failed, hotplugWork() has another go in HOTPLUGRETRY ms
+    if (getit(st, 1, noisy) < 0)
+        return -1;
+    st->failed = FALSE;
+    wxlog_info("Station %s is reading again, %lldms after it stopped\n",
+        st->name, wxloop_now_ms() - st->lostAt);
+    return 0;
+}
+
+// Take the step up the ladder that's waiting, if there is one, before
+// the next read.  Returns -1 if there's to be no read this time.
+int recoverStep(struct stationData *st)
+{
+    int step = st->recover.pending;
+    int err = 0;
+
+    if (step == WXRECOVER_RETRY)
+        return 0;
+    // The handle can't be touched while a read is still out on it
+    if (st->reports[0].inFlight || st->reports[1].inFlight){
+        if (st->reports[0].inFlight)
+            libusb_cancel_transfer(st->reports[0].transfer);
+        if (st->reports[1].inFlight)
+            libusb_cancel_transfer(st->reports[1].transfer);
+        queuePoll(st, 10);
+        return -1;
+    }
+    wxrecover_take(&st->recover);
+    switch (step){
+        case WXRECOVER_CLEARHALT:
+            err = libusb_clear_halt(st->handle, 0x81);
+            break;
+        case WXRECOVER_RESET:
+            // If it has to come back as a new device to be reset, the
+            // handle's dead: libusb says NOT_FOUND here, or the next read
+            // gets NO_DEVICE, and usbTrouble() goes straight to reopen.
+            err = libusb_reset_device(st->handle);
+            if (err == LIBUSB_ERROR_NOT_FOUND){
+                reopenNow(st);
+                return -1;
+            }
+            break;
+        case WXRECOVER_REOPEN:
+            dropHandle(st);
+            // After a reset it may be a new device where the old one was
+            if (findAgain(st) < 0 || openOne(st) < 0){
+                dropHandle(st);
+                usbTrouble(st, FALSE);
+                return -1;
+            }
+            break;
+    }
+    if (err)
+        wxlog_warn("Couldn't %s %s, %s\n", wxrecover_name(step), st->name, libusb_strerror(err));
+    return 0;
+}
+
+// libusb calls this from inside usbService() when one of ours comes or
+// goes.  Just note it, hotplugWork() does the work.
+int LIBUSB_CALL hotplugEvent(libusb_context *ctx, libusb_device *dev,
+                             libusb_hotplug_event event, void *arg)
+{
+    int i;
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED){
+        if (narrived < MAXSTATIONS)
+            arrived[narrived++] = libusb_ref_device(dev);
     }
     else {
-        fprintf(stderr,"OK\n");
+        // In and out again before we got to it
+        for(i=0; i<narrived; i++)
+            if (arrived[i] == dev){
+                libusb_unref_device(dev);
+                arrived[i--] = arrived[--narrived];
+            }
+        for(i=0; i<nstations; i++)
+            if (stations[i].device == dev){
+                wxlog_warn("Station %s unplugged, waiting for it to come back\n", stations[i].name);
+                if (!stations[i].failed)
+                    stations[i].lostAt = wxloop_now_ms();
+                stations[i].failed = TRUE;
+                stations[i].gone = TRUE;
+            }
+    }
+    wxloop_arm_timer(mainLoop, hotplugTimer, 1, 0);
+    return 0;
+}
+
+// Sort out the consoles that came, went or stopped answering.  One that
+// was plugged back in gets its old station back, with its weather,
+// files and uploads just as they were; one we haven't seen before gets
+// a new station.  One that stopped answering but is still plugged in is
+// closed and opened again.
+void hotplugWork(int id, void *arg)
+{
+    struct stationData *st;
+    char name[32];
+    long wait = 0;
+    int i;
+
+    for(i=0; i<narrived; i++){
+        deviceName(arrived[i], name, sizeof(name));
+        st = stationNamed(name);
+        if (st == NULL){
+            st = newStation();
+            if (st == NULL){
+                wxlog_warn("More than %d stations, ignoring the one at %s\n", MAXSTATIONS, name);
+                libusb_unref_device(arrived[i]);
+                continue;
+            }
+            strlcpy(st->name, name, sizeof(st->name));
+            wxlog_info("Found a new one at %s\n", st->name);
+            loadCredentials(st);
+            openStationFiles(st);
+            publishStations();
+            saveDevices();
+            st->failed = TRUE;
+            st->lostAt = wxloop_now_ms();
+        }
+        else
+            wxlog_info("Station %s plugged back in\n", st->name);
+        if (st->device)
+            libusb_unref_device(st->device);
+        st->device = arrived[i];
+        st->gone = FALSE;
+    }
+    narrived = 0;
+
+    for(i=0; i<nstations; i++){
+        st = &stations[i];
+        if (!st->failed)
+            continue;
+        // The handle can't go while a read is still out on it
+        if (st->reports[0].inFlight || st->reports[1].inFlight){
+            if (st->reports[0].inFlight)
+                libusb_cancel_transfer(st->reports[0].transfer);
+            if (st->reports[1].inFlight)
+                libusb_cancel_transfer(st->reports[1].transfer);
+            wait = 10;
+            continue;
+        }
+        dropHandle(st);
+        if (st->gone){
+            if (st->device){
+                libusb_unref_device(st->device);
+                st->device = NULL;
+            }
+            continue;
+        }
+        if (st->device && attachStation(st) < 0 && wait == 0)
+            wait = HOTPLUGRETRY;
+    }
+    if (wait)
+        wxloop_arm_timer(mainLoop, hotplugTimer, wait, 0);
+}
+
+void openStations(int libusbDebug)
+{
+    libusb_device **devs;
+    int err, i, n;
+    ssize_t cnt;
+
+    err = libusb_init(NULL);
+    if (err < 0){
+        wxlog_error("Couldn't init usblib, %s\n", libusb_strerror(err));
+        exit(1);
     }
+    // This is where you can get debug output from libusb.
+    // just set it to LIBUSB_LOG_LEVEL_DEBUG
+    if (libusbDebug)
+        libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+    else
+        libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
+
+
+    cnt = libusb_get_device_list(NULL, &devs);
+    if (cnt < 0){
+        wxlog_error("Couldn't get device list, %s\n", libusb_strerror(err));
+        exit(1);
+    }
+    usbStarted = TRUE;
+    // With hotplug we can start with none and wait for them to show up
+    hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+    // go get the devices; each one gets a station
+    if (!findDevices(devs) && !hotplug){
+        wxlog_error("Couldn't find the device\n");
+        exit(1);
+    }
+    // Any that won't open keep their station and its number, they're
+    // only marked failed, and hotplug tries them again
+    for(i=0, n=0; i<nstations; i++){
+        if (stations[i].gone)
+            continue;
+        if (openOne(&stations[i]) < 0){
+            wxlog_warn("Couldn't open the station at %s\n", stations[i].name);
+            dropHandle(&stations[i]);
+            stations[i].failed = TRUE;
+            stations[i].lostAt = wxloop_now_ms();
+            continue;
+        }
+        n++;
+    }
+    if (hotplug){
+        hotplugTimer = wxloop_add_timer(mainLoop, hotplugWork, NULL);
+        err = libusb_hotplug_register_callback(NULL,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                0, VENDOR, PRODUCT, LIBUSB_HOTPLUG_MATCH_ANY,
+                hotplugEvent, NULL, &hotplugHandle);
+        if (hotplugTimer < 0 || err != LIBUSB_SUCCESS){
+            wxlog_warn("Couldn't watch for consoles coming and going, %s\n", libusb_strerror(err));
+            hotplug = FALSE;
+        }
+        else if (n < nstations)
+            wxloop_arm_timer(mainLoop, hotplugTimer, HOTPLUGRETRY, 0);
+    }
+    if (n == 0){
+        if (!hotplug){
+            wxlog_error("Couldn't open any of them\n");
+            exit(1);
+        }
+        wxlog_info("Waiting for a console to be plugged in\n");
+    }
+    saveDevices();
+    // Now that they're opened, I can free the list of all devices
+    libusb_free_device_list(devs, 1); // Documentation says to get rid of the list
+                                      // Once I have the devices I need
+    wxlog_info("Released the device list\n");
 /*
     if (daemonize) {
         devnull = open(_PATH_DEVNULL, O_RDWR, 0);
@@ -800,33 +1903,300 @@ int main(int argc, char **argv)
     // So, for the weather station we now know it has one endpoint and it is set to
     // send data to the host.  Now we can experiment with that.
     //
-    // I don't want to just hang up and read the reports as fast as I can, so
-    // I'll space them out a bit.  It's weather, and it doesn't change very fast.
-    int tickcounter= 0;
-    while(1){
-        int rc;
-        sleep(1);
-        if(tickcounter++ % timeint1 == 0){
-            rc = getit(1, noisy);
-            if(rc < 0){
-                closeUpAndLeave();
+    // libusb does its work through file descriptors; put them on the loop
+    // along with any it adds later.
+    const struct libusb_pollfd **pollfds = libusb_get_pollfds(NULL);
+    if (pollfds){
+        for(i=0; pollfds[i] != NULL; i++)
+            usbFdAdded(pollfds[i]->fd, pollfds[i]->events, NULL);
+        libusb_free_pollfds(pollfds);
+    }
+    libusb_set_pollfd_notifiers(NULL, usbFdAdded, usbFdRemoved, NULL);
+    if (!libusb_pollfds_handle_timeouts(NULL))
+        usbTimer = wxloop_add_timer(mainLoop, usbTimeout, NULL);
+    openedAt = wxloop_now_ms();
+}
+
+int main(int argc, char **argv)
+{
+    char *usage = {"usage: %s -u -n -q -v -L error|warn|info|debug -P devicecache -M metricsport -T tracefile -m shmname -B mqtt://host/prefix -Q queryport -A altitude -t usbtimeout -H heartbeat -E deadbands -s spooldir -d database -a archive -c capture -p capture -F -o json|csv|bin -b batch -D csvdir -S never|day|flush -W credentials\n"};
+    int libusbDebug = 1; //This will turn on the DEBUG for libusb
+    int r, c, i;
+
+    startedAt = wxloop_now_ms();
+    wxchange_policy_init(&changePolicy);
+    while ((c = getopt (argc, argv, "unqvL:P:M:T:m:B:Q:A:t:H:E:s:d:a:c:p:Fo:b:D:S:W:h")) != -1)
+        switch (c){
+            case 'u':
+                libusbDebug = 1;
+                break;
+            case 'n':
+                noisy = 1;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'v':
+                diagnostics = TRUE;
+                break;
+            case 'L':
+                wxlog_level = wxlog_parse_level(optarg);
+                if (wxlog_level < 0){
+                    wxlog_level = WXLOG_DEBUG;
+                    wxlog_error("Log level is error, warn, info or debug, not %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                deviceCache = optarg;
+                break;
+            case 'M':
+                metricsPort = atoi(optarg);
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            case 'm':
+                sharedName = optarg;
+                break;
+            case 'B':
+                if (wxmqtt_parse(optarg, &mqttOptions) < 0){
+                    wxlog_error("The MQTT broker is mqtt://[user[:password]@]host[:port][/prefix][?window=N&linger=ms&keepalive=s&id=name]\n");
+                    exit(1);
+                }
+                useMqtt = TRUE;
+                break;
+            case 'Q':
+                queryPort = atoi(optarg);
+                break;
+            case 'A':
+                stationAltitude = atof(optarg);
+                break;
+            case 't':
+                transferTimeout = atoi(optarg);
+                if (transferTimeout <= 0)
+                    transferTimeout = USBTIMEOUT;
+                break;
+            case 'H':
+                changePolicy.heartbeat = atol(optarg);
+                break;
+            case 'E':
+                if (wxchange_policy_parse(&changePolicy, optarg) < 0){
+                    wxlog_error("Deadbands are name=value,... with names windSpeed, windDirection, temperature, humidity, rainCounter, rainRaw and barometer, not %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                spoolDir = optarg;
+                break;
+            case 'd':
+                dbPath = optarg;
+                break;
+            case 'a':
+                archivePath = optarg;
+                break;
+            case 'c':
+                capturePath = optarg;
+                break;
+            case 'p':
+                replayPath = optarg;
+                break;
+            case 'F':
+                replayFast = TRUE;
+                break;
+            case 'o':
+                outputFormat = wxsink_format_by_name(optarg);
+                if (outputFormat < 0){
+                    wxlog_error("Output is json, csv or bin, not %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                outputBatch = atoi(optarg);
+                break;
+            case 'D':
+                csvDir = optarg;
+                break;
+            case 'S':
+                csvSync = wxcsv_sync_by_name(optarg);
+                if (csvSync < 0){
+                    wxlog_error("Sync is never, day or flush, not %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                credentialsPath = optarg;
+                break;
+            case 'h':
+                fprintf(stderr, usage, argv[0]);
+            case '?':
                 exit(1);
-            }
-        }
-        if(tickcounter % timeint2 == 0){
-            rc = getit(2, noisy);
-            if(rc < 0){
-                closeUpAndLeave();
+            default:
                 exit(1);
+       }
+    // From here on the log thread does the writing
+    wxlog_secret(STATIONKEY);
+    if (wxlog_start(STDERR_FILENO) == 0)
+        atexit(wxlog_stop);
+    else
+        wxlog_warn("Couldn't start the log thread, writing the log as it comes\n");
+    wxlog_info("libusbDebug = %d, noisy = %d\n", libusbDebug, noisy);
+
+    mainLoop = wxloop_new();
+    if (mainLoop == NULL){
+        wxlog_error("Couldn't set up the event loop\n");
+        exit(1);
+    }
+    if (wxloop_add_signal(mainLoop, SIGINT, sig_handler, NULL) < 0 ||
+        wxloop_add_signal(mainLoop, SIGTERM, sig_handler, NULL) < 0)
+        wxlog_error("Couldn't set up signal handler\n");
+    if (tracePath){
+        loopTrace = wxtrace_ring("acquisition");
+        uploadTrace = wxtrace_ring("upload");
+        wxtrace_enabled = TRUE;
+        if (wxloop_add_signal(mainLoop, SIGUSR1, traceSignal, NULL) < 0)
+            wxlog_error("Couldn't set up SIGUSR1, the trace only gets written at the end\n");
+    }
+    if (replayPath == NULL)
+        openStations(libusbDebug);
+    else
+        openReplay();
+
+    // The signals are already blocked by now, so the upload thread won't
+    // go stealing them from the event loop.
+    spool = wxspool_open(spoolDir, SPOOLSEGMENTS);
+    if (spool == NULL)
+        wxlog_error("Couldn't open spool %s, failed uploads won't be kept\n", spoolDir);
+    httpClient = wxhttp_new(UPLOADSITES + REPLAYSLOTS);
+    if (httpClient == NULL){
+        wxlog_error("Couldn't set up curl\n");
+        closeUpAndLeave();
+        exit(1);
+    }
+    for(i=0; i<nstations; i++){
+        loadCredentials(&stations[i]);
+        openStationFiles(&stations[i]);
+    }
+    publishStations();
+    if (metricsPort){
+        metrics = wxmetrics_new();
+        if (metrics)
+            setupMetrics();
+        if (metrics == NULL || wxmetrics_serve(metrics, mainLoop, metricsPort, metricsGauges, NULL) < 0)
+            wxlog_error("Couldn't serve metrics on port %d, going on without them\n", metricsPort);
+    }
+    if (queryPort){
+        history = wxhistory_new(HISTORYSIZE);
+        if (history)
+            query = wxquery_start(history, queryPort);
+        if (query == NULL)
+            wxlog_error("Couldn't answer queries on port %d, going on without them\n", queryPort);
+    }
+    if (sharedName){
+        char name[NAME_MAX];
+        // shm_open() wants it to start with a /
+        snprintf(name, sizeof(name), "%s%s", sharedName[0] == '/' ? "" : "/", sharedName);
+        shared = wxshm_create(name);
+    }
+    if (useMqtt){
+        wxlog_secret(mqttOptions.password);
+        mqttOptions.shard = mqttMetrics;
+        mqttOptions.latency = mMqttLatency;
+        mqtt = wxmqtt_start(&mqttOptions, MQTTDEPTH);
+        if (mqtt == NULL)
+            wxlog_error("Couldn't start the MQTT thread, going on without it\n");
+    }
+    // Room for every station's observation, a few times over, and with
+    // hotplug for every one that might turn up later
+    uploader = wxupload_start(UPLOADDEPTH * (hotplug ? MAXSTATIONS : nstations), uploadObservation, NULL);
+    if (uploader == NULL){
+        wxlog_error("Couldn't start the upload thread\n");
+        closeUpAndLeave();
+        exit(1);
+    }
+
+
+    output = wxsink_open(STDOUT_FILENO, outputFormat, outputBatch);
+    if (output == NULL){
+        wxlog_error("Couldn't set up the output\n");
+        closeUpAndLeave();
+        exit(1);
+    }
+
+    // I don't want to just hang up and read the reports as fast as I can, so
+    // I'll space them out a bit.  It's weather, and it doesn't change very fast.
+    wxsched_heap_init(&pollQueue);
+    int t1 = pollTimer = wxloop_add_timer(mainLoop, pollDue, NULL);
+    int t2 = wxloop_add_timer(mainLoop, pollReport, (void *)(intptr_t)2);
+    int t3 = wxloop_add_timer(mainLoop, showTimer, NULL);
+    int t4 = wxloop_add_timer(mainLoop, uploadTimer, NULL);
+    if (t1 < 0 || t2 < 0 || t3 < 0 || t4 < 0){
+        wxlog_error("Couldn't set up the timers\n");
+        closeUpAndLeave();
+        exit(1);
+    }
+    if (!quiet || csvDir)
+        wxloop_arm_timer(mainLoop, t3, timeint3*1000L, timeint3*1000L);
+    // Played back data doesn't get uploaded, the sites already have it
+    if (replayPath == NULL){
+        // The first read goes out as soon as the loop starts
+        for(i=0; i<nstations; i++)
+            queuePoll(&stations[i], 1);
+        wxloop_arm_timer(mainLoop, t2, timeint2*1000L, timeint2*1000L);
+        wxloop_arm_timer(mainLoop, t4, timeint4*1000L, timeint4*1000L);
+    }
+    if (capturePath){
+        capture = wxcapture_create(capturePath);
+        if (capture == NULL)
+            wxlog_warn("Couldn't open capture %s, going on without it\n", capturePath);
+    }
+    if (dbPath){
+        sqliteDb = wxsqlite_open(dbPath, DBBATCHROWS, DBBATCHSECS);
+        if (sqliteDb == NULL)
+            wxlog_warn("Going on without the database\n");
+        else if ((r = wxloop_add_timer(mainLoop, dbTimer, NULL)) >= 0)
+            wxloop_arm_timer(mainLoop, r, DBBATCHSECS*1000L, DBBATCHSECS*1000L);
+    }
+    if (csvDir && (r = wxloop_add_timer(mainLoop, csvTimer, NULL)) >= 0)
+        wxloop_arm_timer(mainLoop, r, CSVFLUSHSECS*1000L, CSVFLUSHSECS*1000L);
+    if (archivePath && (r = wxloop_add_timer(mainLoop, archiveTimer, NULL)) >= 0)
+        wxloop_arm_timer(mainLoop, r, ARCHIVEFLUSHSECS*1000L, ARCHIVEFLUSHSECS*1000L);
+
+    if (replayFast)
+        replayAll();
+    else {
+        if (replayPath){
+            replayTimer = wxloop_add_timer(mainLoop, replayNext, NULL);
+            if (wxcapture_read(replay, &replayRec) > 0)
+                wxloop_arm_timer(mainLoop, replayTimer, 1, 0);
+            else {
+                wxlog_error("Nothing in capture %s\n", replayPath);
+                replayTimer = -1;
             }
         }
-        if ((tickcounter % timeint3 == 0) & !quiet){
-            showit();
-        }
-        if (tickcounter % timeint4 == 0){
-            wucurl(&weatherData, &wu);
-            mccurl(&weatherData, &wu);
-            write_line(&weatherData, &wu);
-        }
+        if (replayPath == NULL || replayTimer >= 0)
+            wxloop_run(mainLoop);
+    }
+
+    closeUpAndLeave();
+    wxupload_stop(uploader);
+    wxhttp_free(httpClient);
+    wxspool_close(spool);
+    wxsqlite_close(sqliteDb);
+    wxcapture_close(capture);
+    wxcapture_close(replay);
+    wxsink_close(output);
+    wxmetrics_free(metrics);
+    wxquery_stop(query);
+    wxhistory_free(history);
+    wxshm_close(shared);
+    wxmqtt_stop(mqtt);
+    if (tracePath)
+        traceSignal(SIGUSR1, NULL);
+    for(i=0; i<nstations; i++){
+        wxarchive_close(stations[i].archive);
+        wxcsv_close(stations[i].csv);
     }
+    wxloop_free(mainLoop);
+    exit(usbFailed ? 1 : 0);
 }
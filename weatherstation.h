@@ -0,0 +1,44 @@
+/*
+    Things the weatherstation modules share.  weatherstation.c owns the
+    live copy of the data; everybody else gets handed a pointer or a copy.
+*/
+#ifndef WEATHERSTATION_H
+#define WEATHERSTATION_H
+
+#include <time.h>
+
+#define TRUE    1
+#define FALSE   0
+
+// Most consoles one daemon reads, and so the most station numbers
+// anybody will be handed, 0 to MAXSTATIONS-1
+#define MAXSTATIONS 32
+
+#define WUNDERSTRSZ 64
+struct stationWU
+{
+    // my PWS ID and password
+    char stationID[WUNDERSTRSZ];
+    char stationPassword[WUNDERSTRSZ];
+};
+
+
+// These are the sensors the the 5 in 1 weather head provides
+struct weatherData {
+    float   windSpeed;
+    time_t  wsTime;
+    int     windDirection;
+    time_t  wdTime;
+    float   temperature;
+    time_t  tTime;
+    int     humidity;
+    time_t  hTime;
+    int     rainCounter;
+    time_t  rcTime;
+    int     rainRaw;
+    time_t  rrTime;
+    float   barometer;
+    time_t  bTime;
+};
+
+#endif
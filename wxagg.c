@@ -0,0 +1,190 @@
+/*
+    Rolling aggregates, see wxagg.h.
+*/
+#include <string.h>
+
+#include "wxagg.h"
+
+// The console's rain count is 7 bits and wraps.  Between two reports,
+// any more than this is the console having been reset, not rain.
+#define RAINWRAP    128
+#define RAINJUMP    64
+
+static void ringInit(struct wxagg_ring *r, int width, int n)
+{
+    memset(r, 0, sizeof(*r));
+    r->width = width;
+    r->n = n;
+}
+
+// Move the newest bucket up to epoch, emptying the ones in between
+static void ringAdvance(struct wxagg_ring *r, long epoch)
+{
+    long e;
+    int slot;
+
+    if (epoch <= r->epoch)
+        return;
+    if (epoch - r->epoch >= r->n) {
+        memset(r->sum, 0, sizeof(r->sum));
+        memset(r->num, 0, sizeof(r->num));
+        r->total = 0;
+        r->count = 0;
+    } else {
+        for (e = r->epoch + 1; e <= epoch; e++) {
+            slot = e % r->n;
+            r->total -= r->sum[slot];
+            r->count -= r->num[slot];
+            r->sum[slot] = 0;
+            r->num[slot] = 0;
+        }
+        // Whatever rounding crept in goes with the last of it
+        if (r->count == 0)
+            r->total = 0;
+    }
+    r->epoch = epoch;
+}
+
+static void ringAdd(struct wxagg_ring *r, time_t when, double v)
+{
+    long e = when / r->width;
+    int slot;
+
+    if (e <= r->epoch - r->n)
+        return;
+    ringAdvance(r, e);
+    slot = e % r->n;
+    r->sum[slot] += v;
+    r->num[slot]++;
+    r->total += v;
+    r->count++;
+}
+
+static void gustExpire(struct wxagg *agg, time_t now)
+{
+    while (agg->gustLen && agg->gust[agg->gustHead].when <= now - WXAGG_GUSTSECS) {
+        agg->gustHead = (agg->gustHead + 1) % WXAGG_GUSTMAX;
+        agg->gustLen--;
+    }
+}
+
+static void gustAdd(struct wxagg *agg, time_t when, float speed)
+{
+    struct wxagg_gust *g;
+
+    gustExpire(agg, when);
+    while (agg->gustLen &&
+           agg->gust[(agg->gustHead + agg->gustLen - 1) % WXAGG_GUSTMAX].speed <= speed)
+        agg->gustLen--;
+    // Only when it's dying down ever so slowly, the oldest matters least
+    if (agg->gustLen == WXAGG_GUSTMAX) {
+        agg->gustHead = (agg->gustHead + 1) % WXAGG_GUSTMAX;
+        agg->gustLen--;
+    }
+    g = &agg->gust[(agg->gustHead + agg->gustLen) % WXAGG_GUSTMAX];
+    g->when = when;
+    g->speed = speed;
+    agg->gustLen++;
+}
+
+// Start the day's totals over if now is a different day
+static void checkDay(struct wxagg *agg, time_t now)
+{
+    struct tm tm;
+    int day;
+
+    localtime_r(&now, &tm);
+    day = tm.tm_year * 1000 + tm.tm_yday;
+    if (day == agg->day)
+        return;
+    agg->day = day;
+    agg->rainDay = 0;
+    agg->valid &= ~WXAGG_TEMP;
+}
+
+void wxagg_init(struct wxagg *agg)
+{
+    memset(agg, 0, sizeof(*agg));
+    ringInit(&agg->wind, WXAGG_WINDBUCKET, WXAGG_WINDSECS / WXAGG_WINDBUCKET);
+    ringInit(&agg->rain, WXAGG_RAINBUCKET, WXAGG_RAINSECS / WXAGG_RAINBUCKET);
+    agg->lastCount = -1;
+}
+
+void wxagg_update(struct wxagg *agg, const struct weatherData *wx, time_t now)
+{
+    int count, delta;
+
+    checkDay(agg, now);
+
+    if (wx->wsTime && wx->wsTime != agg->wsSeen) {
+        agg->wsSeen = wx->wsTime;
+        ringAdd(&agg->wind, wx->wsTime, wx->windSpeed);
+        gustAdd(agg, wx->wsTime, wx->windSpeed);
+        agg->valid |= WXAGG_WIND | WXAGG_GUST;
+    }
+
+    if (wx->tTime && wx->tTime != agg->tSeen) {
+        agg->tSeen = wx->tTime;
+        if (!(agg->valid & WXAGG_TEMP) || wx->temperature < agg->tempMin) {
+            agg->tempMin = wx->temperature;
+            agg->tempMinTime = wx->tTime;
+        }
+        if (!(agg->valid & WXAGG_TEMP) || wx->temperature > agg->tempMax) {
+            agg->tempMax = wx->temperature;
+            agg->tempMaxTime = wx->tTime;
+        }
+        agg->valid |= WXAGG_TEMP;
+    }
+
+    // The decoder keeps the count at the start of the day in rainRaw and
+    // what's fallen since in rainCounter, so the console's count is both
+    if (wx->rcTime && wx->rcTime != agg->rcSeen) {
+        agg->rcSeen = wx->rcTime;
+        count = (wx->rainRaw + wx->rainCounter) % RAINWRAP;
+        if (agg->lastCount >= 0) {
+            delta = (count - agg->lastCount + RAINWRAP) % RAINWRAP;
+            if (delta > RAINJUMP)
+                delta = 0;
+            if (delta) {
+                ringAdd(&agg->rain, wx->rcTime, delta);
+                agg->rainDay += delta;
+            }
+        }
+        agg->lastCount = count;
+        agg->valid |= WXAGG_RAIN;
+    }
+}
+
+void wxagg_get(struct wxagg *agg, time_t now, struct wxagg_summary *sum)
+{
+    int head;
+
+    memset(sum, 0, sizeof(*sum));
+    checkDay(agg, now);
+    ringAdvance(&agg->wind, now / agg->wind.width);
+    ringAdvance(&agg->rain, now / agg->rain.width);
+    gustExpire(agg, now);
+
+    if ((agg->valid & WXAGG_WIND) && agg->wind.count) {
+        sum->windAvg = agg->wind.total / agg->wind.count;
+        sum->valid |= WXAGG_WIND;
+    }
+    if ((agg->valid & WXAGG_GUST) && agg->gustLen) {
+        head = agg->gustHead;
+        sum->gust = agg->gust[head].speed;
+        sum->gustTime = agg->gust[head].when;
+        sum->valid |= WXAGG_GUST;
+    }
+    if (agg->valid & WXAGG_RAIN) {
+        sum->rainHour = agg->rain.total * 0.01;
+        sum->rainDay = agg->rainDay * 0.01;
+        sum->valid |= WXAGG_RAIN;
+    }
+    if (agg->valid & WXAGG_TEMP) {
+        sum->tempMin = agg->tempMin;
+        sum->tempMax = agg->tempMax;
+        sum->tempMinTime = agg->tempMinTime;
+        sum->tempMaxTime = agg->tempMaxTime;
+        sum->valid |= WXAGG_TEMP;
+    }
+}
@@ -0,0 +1,88 @@
+/*
+    Rolling aggregates for one station: the 2 minute average wind, the
+    10 minute gust, rain in the last hour and since midnight, and the
+    day's high and low temperature.
+
+    Nothing is kept but what the windows need, and every report costs
+    the same no matter how long they are.  The averages and sums are
+    rings of fixed size buckets with a running total, so a bucket
+    falling out of the window is one subtraction.  The gust is a deque
+    of readings that only ever go down from front to back: a new one
+    throws out every smaller one behind it, since none of those can be
+    the biggest again, and the front is the gust.
+
+    A reading only counts once, when its xTime moves, so calling
+    wxagg_update() after every report, both kinds, is fine.  Rain is
+    worked out from how much the console's running count went up; a
+    count that goes backwards is the console being reset and counts
+    as nothing.  The day is the local day.
+*/
+#ifndef WXAGG_H
+#define WXAGG_H
+
+#include <time.h>
+#include "weatherstation.h"
+
+#define WXAGG_WINDSECS      120     // average wind over this
+#define WXAGG_WINDBUCKET    10
+#define WXAGG_GUSTSECS      600     // gust over this
+#define WXAGG_GUSTMAX       128     // readings the gust deque can hold
+#define WXAGG_RAINSECS      3600    // rain rate over this
+#define WXAGG_RAINBUCKET    60
+
+#define WXAGG_MAXBUCKETS    60
+
+// Which parts of a summary there's data for
+#define WXAGG_WIND  0x01
+#define WXAGG_GUST  0x02
+#define WXAGG_RAIN  0x04
+#define WXAGG_TEMP  0x08
+
+// Buckets of width seconds, n of them, and the total of what's in them
+struct wxagg_ring {
+    int     width;
+    int     n;
+    long    epoch;                  // the newest bucket, in widths since 1970
+    double  total;
+    long    count;
+    double  sum[WXAGG_MAXBUCKETS];
+    int     num[WXAGG_MAXBUCKETS];
+};
+
+struct wxagg_gust {
+    time_t  when;
+    float   speed;
+};
+
+struct wxagg {
+    struct wxagg_ring   wind;
+    struct wxagg_ring   rain;       // hundredths of an inch
+    struct wxagg_gust   gust[WXAGG_GUSTMAX];
+    int                 gustHead;   // oldest
+    int                 gustLen;
+    int                 day;        // year * 1000 + day of the year
+    long                rainDay;    // hundredths
+    int                 lastCount;  // the console's rain count, -1 before the first
+    float               tempMin, tempMax;
+    time_t              tempMinTime, tempMaxTime;
+    unsigned int        valid;
+    time_t              wsSeen, tSeen, rcSeen;
+};
+
+struct wxagg_summary {
+    unsigned int    valid;          // WXAGG_*
+    float           windAvg;        // same units as windSpeed
+    float           gust;
+    time_t          gustTime;
+    float           rainHour;       // inches
+    float           rainDay;
+    float           tempMin, tempMax;
+    time_t          tempMinTime, tempMaxTime;
+};
+
+void wxagg_init(struct wxagg *agg);
+// After every report, with the time of the report
+void wxagg_update(struct wxagg *agg, const struct weatherData *wx, time_t now);
+void wxagg_get(struct wxagg *agg, time_t now, struct wxagg_summary *sum);
+
+#endif
@@ -0,0 +1,512 @@
+/*
+    Columnar archive, see wxarchive.h.
+
+    A block on disk is a header followed by the column bit streams, one
+    after the other, each starting on an 8 byte boundary:
+
+        uint32  magic
+        uint32  bytes of column data following the header
+        uint32  sample count
+        uint32  offset of each column from the end of the header
+        int64   first and last time
+
+    Bits are written most significant first.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wxarchive.h"
+#include "wxlog.h"
+
+#define BLOCKMAGIC  0x4b4c4257  // "WBLK"
+
+enum { C_TIME, C_WINDSPEED, C_WINDDIR, C_TEMP, C_HUMIDITY, C_RAINCOUNT, C_RAINRAW, C_BARO, NCOLS };
+
+struct blockhdr {
+    uint32_t    magic;
+    uint32_t    bytes;
+    uint32_t    count;
+    uint32_t    col[NCOLS];
+    uint32_t    pad;
+    int64_t     minTime;
+    int64_t     maxTime;
+};
+
+// Worst case is the time column, 4 + 64 bits a sample
+#define COLBYTES    (WXARCHIVE_BLOCKSAMPLES * 9 + 16)
+
+struct bitw {
+    uint8_t *   buf;
+    size_t      bytes;      // full bytes written
+    uint64_t    acc;        // bits not written yet, right justified
+    int         nacc;
+};
+
+struct bitr {
+    const uint8_t * buf;
+    const uint8_t * end;
+    uint64_t        acc;    // bits not used yet, left justified
+    int             nacc;
+};
+
+static void putBits(struct bitw *w, uint64_t v, int n)
+{
+    // Split up the big ones so acc never overflows
+    if (n > 32) {
+        putBits(w, v >> 32, n - 32);
+        v &= 0xffffffffu;
+        n = 32;
+    }
+    w->acc = (w->acc << n) | (v & ((1ull << n) - 1));
+    w->nacc += n;
+    while (w->nacc >= 8) {
+        w->nacc -= 8;
+        w->buf[w->bytes++] = (uint8_t)(w->acc >> w->nacc);
+    }
+}
+
+static void endBits(struct bitw *w)
+{
+    if (w->nacc)
+        w->buf[w->bytes++] = (uint8_t)(w->acc << (8 - w->nacc));
+    w->nacc = 0;
+    while (w->bytes & 7)
+        w->buf[w->bytes++] = 0;
+}
+
+static uint64_t getBits(struct bitr *r, int n)
+{
+    uint64_t v;
+
+    if (n > 32) {
+        v = getBits(r, n - 32) << 32;
+        return v | getBits(r, 32);
+    }
+    while (r->nacc < n) {
+        uint64_t b = r->buf < r->end ? *r->buf++ : 0;
+        r->acc |= b << (56 - r->nacc);
+        r->nacc += 8;
+    }
+    v = r->acc >> (64 - n);
+    r->acc <<= n;
+    r->nacc -= n;
+    return v;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static uint32_t floatBits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static float bitsFloat(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static void putTimes(struct bitw *w, const int64_t *t, int n)
+{
+    int64_t delta = 0, dod;
+    uint64_t z;
+    int i;
+
+    putBits(w, (uint64_t)t[0], 64);
+    for (i = 1; i < n; i++) {
+        dod = (t[i] - t[i-1]) - delta;
+        delta = t[i] - t[i-1];
+        z = zigzag(dod);
+        if (z == 0)
+            putBits(w, 0, 1);
+        else if (z < (1 << 7))
+            putBits(w, (0x2 << 7) | z, 2 + 7);
+        else if (z < (1 << 9))
+            putBits(w, (0x6 << 9) | z, 3 + 9);
+        else if (z < (1 << 12))
+            putBits(w, (0xe << 12) | z, 4 + 12);
+        else {
+            putBits(w, 0xf, 4);
+            putBits(w, z, 64);
+        }
+    }
+}
+
+static void getTimes(struct bitr *r, int64_t *t, int n)
+{
+    int64_t delta = 0;
+    uint64_t z;
+    int i;
+
+    t[0] = (int64_t)getBits(r, 64);
+    for (i = 1; i < n; i++) {
+        if (getBits(r, 1) == 0)
+            z = 0;
+        else if (getBits(r, 1) == 0)
+            z = getBits(r, 7);
+        else if (getBits(r, 1) == 0)
+            z = getBits(r, 9);
+        else if (getBits(r, 1) == 0)
+            z = getBits(r, 12);
+        else
+            z = getBits(r, 64);
+        delta += unzigzag(z);
+        t[i] = t[i-1] + delta;
+    }
+}
+
+static void putFloats(struct bitw *w, const float *f, int n)
+{
+    uint32_t prev = floatBits(f[0]), cur, x;
+    int lead, trail, prevLead = -1, prevTrail = 0, len, i;
+
+    putBits(w, prev, 32);
+    for (i = 1; i < n; i++) {
+        cur = floatBits(f[i]);
+        x = cur ^ prev;
+        prev = cur;
+        if (x == 0) {
+            putBits(w, 0, 1);
+            continue;
+        }
+        lead = __builtin_clz(x);
+        trail = __builtin_ctz(x);
+        if (lead > 31)
+            lead = 31;
+        if (prevLead >= 0 && lead >= prevLead && trail >= prevTrail) {
+            // Fits in the same window as last time
+            putBits(w, 0x2, 2);
+            putBits(w, x >> prevTrail, 32 - prevLead - prevTrail);
+        }
+        else {
+            len = 32 - lead - trail;
+            putBits(w, 0x3, 2);
+            putBits(w, lead, 5);
+            putBits(w, len - 1, 5);
+            putBits(w, x >> trail, len);
+            prevLead = lead;
+            prevTrail = trail;
+        }
+    }
+}
+
+static void getFloats(struct bitr *r, float *f, int n)
+{
+    uint32_t prev = (uint32_t)getBits(r, 32), x;
+    int lead = 0, trail = 0, len, i;
+
+    f[0] = bitsFloat(prev);
+    for (i = 1; i < n; i++) {
+        if (getBits(r, 1) == 0) {
+            f[i] = bitsFloat(prev);
+            continue;
+        }
+        if (getBits(r, 1) == 1) {
+            lead = (int)getBits(r, 5);
+            len = (int)getBits(r, 5) + 1;
+            trail = 32 - lead - len;
+        }
+        else
+            len = 32 - lead - trail;
+        x = (uint32_t)getBits(r, len) << trail;
+        prev ^= x;
+        f[i] = bitsFloat(prev);
+    }
+}
+
+static void putPacked(struct bitw *w, const int *v, int n, int bits)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        putBits(w, (uint64_t)v[i], bits);
+}
+
+static void getPacked(struct bitr *r, int *v, int n, int bits)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        v[i] = (int)getBits(r, bits);
+}
+
+// The rain counter sits still for days at a time
+static void putSticky(struct bitw *w, const int *v, int n)
+{
+    int i;
+
+    putBits(w, (uint32_t)v[0], 32);
+    for (i = 1; i < n; i++) {
+        if (v[i] == v[i-1])
+            putBits(w, 0, 1);
+        else {
+            putBits(w, 1, 1);
+            putBits(w, (uint32_t)v[i], 32);
+        }
+    }
+}
+
+static void getSticky(struct bitr *r, int *v, int n)
+{
+    int i;
+
+    v[0] = (int)(uint32_t)getBits(r, 32);
+    for (i = 1; i < n; i++)
+        v[i] = getBits(r, 1) ? (int)(uint32_t)getBits(r, 32) : v[i-1];
+}
+
+// Whether the block at off in a file of size bytes is whole
+static int goodBlock(const struct blockhdr *hdr, size_t off, size_t size)
+{
+    return hdr->magic == BLOCKMAGIC && hdr->count > 0 &&
+        hdr->count <= WXARCHIVE_BLOCKSAMPLES &&
+        off + sizeof(struct blockhdr) + hdr->bytes <= size;
+}
+
+/*
+    Writing
+*/
+struct wxarchive {
+    int                     fd;
+    struct wxarchive_block  pending;
+    uint8_t *               out;    // header plus NCOLS columns
+};
+
+// A crash part way through a write leaves half a block at the end, and
+// everything appended after it would be lost to the reader.  Walk the
+// headers and cut the file back to the last whole block.
+static void trimPartial(int fd)
+{
+    struct blockhdr hdr;
+    struct stat st;
+    size_t off = 0;
+
+    if (fstat(fd, &st) < 0)
+        return;
+    while (off + sizeof(hdr) <= (size_t)st.st_size) {
+        if (pread(fd, &hdr, sizeof(hdr), off) != sizeof(hdr) ||
+            !goodBlock(&hdr, off, st.st_size))
+            break;
+        off += sizeof(hdr) + hdr.bytes;
+    }
+    if (off == (size_t)st.st_size)
+        return;
+    wxlog_warn("archive: dropping %lu bytes of half written block at %lu\n",
+        (unsigned long)(st.st_size - off), (unsigned long)off);
+    if (ftruncate(fd, off) < 0)
+        wxlog_error("archive: couldn't trim the last block, %s\n", strerror(errno));
+}
+
+struct wxarchive *wxarchive_open(const char *path)
+{
+    struct wxarchive *ar = calloc(1, sizeof(struct wxarchive));
+
+    if (ar == NULL)
+        return NULL;
+    ar->out = malloc(sizeof(struct blockhdr) + NCOLS * COLBYTES);
+    ar->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (ar->out == NULL || ar->fd < 0) {
+        if (ar->fd >= 0)
+            close(ar->fd);
+        free(ar->out);
+        free(ar);
+        return NULL;
+    }
+    trimPartial(ar->fd);
+    return ar;
+}
+
+void wxarchive_close(struct wxarchive *ar)
+{
+    if (ar == NULL)
+        return;
+    wxarchive_flush(ar);
+    close(ar->fd);
+    free(ar->out);
+    free(ar);
+}
+
+int wxarchive_append(struct wxarchive *ar, time_t when, const struct weatherData *wx)
+{
+    struct wxarchive_block *b = &ar->pending;
+    int i;
+
+    // Still full from a write that failed, have another go at it, and if
+    // that fails too there's nowhere to put this one
+    if (b->count == WXARCHIVE_BLOCKSAMPLES && wxarchive_flush(ar) < 0)
+        return -1;
+    i = b->count++;
+    b->time[i] = when;
+    b->windSpeed[i] = wx->windSpeed;
+    b->windDirection[i] = wx->windDirection & 0x0f;
+    b->temperature[i] = wx->temperature;
+    b->humidity[i] = wx->humidity & 0x7f;
+    b->rainCounter[i] = wx->rainCounter;
+    b->rainRaw[i] = wx->rainRaw & 0x7f;
+    b->barometer[i] = wx->barometer;
+    if (b->count == WXARCHIVE_BLOCKSAMPLES)
+        return wxarchive_flush(ar);
+    return 0;
+}
+
+int wxarchive_flush(struct wxarchive *ar)
+{
+    struct wxarchive_block *b = &ar->pending;
+    struct blockhdr *hdr = (struct blockhdr *)ar->out;
+    struct bitw w;
+    size_t total;
+    ssize_t put;
+    off_t start;
+    int c, i;
+
+    if (b->count == 0)
+        return 0;
+    memset(hdr, 0, sizeof(*hdr));
+    memset(&w, 0, sizeof(w));
+    w.buf = ar->out + sizeof(struct blockhdr);
+    hdr->magic = BLOCKMAGIC;
+    hdr->count = b->count;
+    hdr->minTime = hdr->maxTime = b->time[0];
+    for (i = 1; i < b->count; i++) {
+        if (b->time[i] < hdr->minTime) hdr->minTime = b->time[i];
+        if (b->time[i] > hdr->maxTime) hdr->maxTime = b->time[i];
+    }
+    for (c = 0; c < NCOLS; c++) {
+        hdr->col[c] = w.bytes;
+        switch (c) {
+        case C_TIME:      putTimes(&w, b->time, b->count); break;
+        case C_WINDSPEED: putFloats(&w, b->windSpeed, b->count); break;
+        case C_WINDDIR:   putPacked(&w, b->windDirection, b->count, 4); break;
+        case C_TEMP:      putFloats(&w, b->temperature, b->count); break;
+        case C_HUMIDITY:  putPacked(&w, b->humidity, b->count, 7); break;
+        case C_RAINCOUNT: putSticky(&w, b->rainCounter, b->count); break;
+        case C_RAINRAW:   putPacked(&w, b->rainRaw, b->count, 7); break;
+        case C_BARO:      putFloats(&w, b->barometer, b->count); break;
+        }
+        endBits(&w);
+    }
+    hdr->bytes = w.bytes;
+    total = sizeof(struct blockhdr) + w.bytes;
+    // Where it starts, so half a block can be taken back off again
+    start = lseek(ar->fd, 0, SEEK_END);
+    if (start < 0) {
+        wxlog_error("archive: couldn't find the end, %s\n", strerror(errno));
+        return -1;
+    }
+    put = write(ar->fd, ar->out, total);
+    if (put != (ssize_t)total) {
+        wxlog_error("archive: couldn't write a block, %s\n",
+            put < 0 ? strerror(errno) : "short write");
+        // Left there, half a block would stop the reader and trimPartial()
+        // at it, losing every block after.  Keep the samples for next time.
+        if (put > 0 && ftruncate(ar->fd, start) < 0)
+            wxlog_error("archive: couldn't take back half a block, %s\n", strerror(errno));
+        return -1;
+    }
+    b->count = 0;
+    return 0;
+}
+
+/*
+    Reading
+*/
+struct wxarchive_view {
+    const uint8_t * map;
+    size_t          size;
+    struct wxarchive_block block;
+};
+
+struct wxarchive_view *wxarchive_map(const char *path)
+{
+    struct wxarchive_view *view;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+    view = calloc(1, sizeof(struct wxarchive_view));
+    if (view == NULL || fstat(fd, &st) < 0)
+        goto fail;
+    view->size = st.st_size;
+    if (view->size) {
+        view->map = mmap(NULL, view->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (view->map == MAP_FAILED)
+            goto fail;
+        madvise((void *)view->map, view->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return view;
+
+fail:
+    close(fd);
+    free(view);
+    return NULL;
+}
+
+void wxarchive_unmap(struct wxarchive_view *view)
+{
+    if (view == NULL)
+        return;
+    if (view->size)
+        munmap((void *)view->map, view->size);
+    free(view);
+}
+
+int wxarchive_scan(struct wxarchive_view *view, int64_t from, int64_t to, wxarchive_fn fn, void *arg)
+{
+    struct wxarchive_block *b = &view->block;
+    const struct blockhdr *hdr;
+    const uint8_t *cols;
+    size_t off = 0;
+    struct bitr r;
+    int c, n, blocks = 0;
+
+    while (off + sizeof(struct blockhdr) <= view->size) {
+        hdr = (const struct blockhdr *)(view->map + off);
+        if (!goodBlock(hdr, off, view->size)) {
+            if (off + sizeof(struct blockhdr) + hdr->bytes > view->size)
+                wxlog_warn("archive: short block at %lu, stopping\n", (unsigned long)off);
+            break;
+        }
+        cols = view->map + off + sizeof(struct blockhdr);
+        off += sizeof(struct blockhdr) + hdr->bytes;
+        if (hdr->maxTime < from || hdr->minTime > to)
+            continue;
+
+        n = b->count = hdr->count;
+        for (c = 0; c < NCOLS; c++) {
+            r.buf = cols + hdr->col[c];
+            r.end = cols + hdr->bytes;
+            r.acc = 0;
+            r.nacc = 0;
+            switch (c) {
+            case C_TIME:      getTimes(&r, b->time, n); break;
+            case C_WINDSPEED: getFloats(&r, b->windSpeed, n); break;
+            case C_WINDDIR:   getPacked(&r, b->windDirection, n, 4); break;
+            case C_TEMP:      getFloats(&r, b->temperature, n); break;
+            case C_HUMIDITY:  getPacked(&r, b->humidity, n, 7); break;
+            case C_RAINCOUNT: getSticky(&r, b->rainCounter, n); break;
+            case C_RAINRAW:   getPacked(&r, b->rainRaw, n, 7); break;
+            case C_BARO:      getFloats(&r, b->barometer, n); break;
+            }
+        }
+        fn(b, arg);
+        blocks++;
+    }
+    return blocks;
+}
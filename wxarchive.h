@@ -0,0 +1,74 @@
+/*
+    Compressed columnar archive of every frame we decode.
+
+    The file is a string of self contained blocks, each holding up to
+    WXARCHIVE_BLOCKSAMPLES samples.  Inside a block every field is its
+    own bit stream, so a scan only touches the columns it asks for:
+
+        time            delta of delta, mostly one bit per sample
+        windSpeed,
+        temperature,
+        barometer       XOR against the previous value (Gorilla style)
+        windDirection   4 bits
+        humidity,
+        rainRaw         7 bits each
+        rainCounter     one bit when it didn't change
+
+    Each block header carries the first and last time in the block so a
+    range scan skips whole blocks without decoding them.  Blocks are only
+    ever appended; a block cut short by a crash fails its length check,
+    the reader stops there, and the writer cuts it off when it next opens
+    the file.
+
+    The reader maps the whole file and decodes blocks straight out of
+    memory into plain arrays.  Nothing is parsed.
+*/
+#ifndef WXARCHIVE_H
+#define WXARCHIVE_H
+
+#include <stdint.h>
+#include "weatherstation.h"
+
+#define WXARCHIVE_BLOCKSAMPLES  1024
+
+// One decoded block, structure of arrays
+struct wxarchive_block {
+    int     count;
+    int64_t time[WXARCHIVE_BLOCKSAMPLES];
+    float   windSpeed[WXARCHIVE_BLOCKSAMPLES];
+    int     windDirection[WXARCHIVE_BLOCKSAMPLES];
+    float   temperature[WXARCHIVE_BLOCKSAMPLES];
+    int     humidity[WXARCHIVE_BLOCKSAMPLES];
+    int     rainCounter[WXARCHIVE_BLOCKSAMPLES];
+    int     rainRaw[WXARCHIVE_BLOCKSAMPLES];
+    float   barometer[WXARCHIVE_BLOCKSAMPLES];
+};
+
+// Writing.  Samples collect in memory until a block is full or it is
+// flushed, then the block is compressed and appended to the file.
+struct wxarchive;
+
+struct wxarchive *wxarchive_open(const char *path);
+// Flushes what's waiting before closing.
+void wxarchive_close(struct wxarchive *ar);
+// Returns 0, or -1 if a full block couldn't be written.  The block is
+// kept and tried again on the next append or flush; while it still can't
+// be written, new samples are dropped.
+int wxarchive_append(struct wxarchive *ar, time_t when, const struct weatherData *wx);
+// Write out whatever is waiting as a short block.  Nothing is lost if it
+// fails, it's all still waiting.
+int wxarchive_flush(struct wxarchive *ar);
+
+// Reading.
+struct wxarchive_view;
+
+typedef void (*wxarchive_fn)(const struct wxarchive_block *blk, void *arg);
+
+struct wxarchive_view *wxarchive_map(const char *path);
+void wxarchive_unmap(struct wxarchive_view *view);
+// Decode every block with samples between from and to (inclusive) and
+// hand it to fn.  The block can hold samples either side of the range,
+// check time[].  Returns the number of blocks handed over.
+int wxarchive_scan(struct wxarchive_view *view, int64_t from, int64_t to, wxarchive_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,520 @@
+/*
+    Microbenchmarks for the frame decoders, run by "make bench".
+
+    Every decoder is run over the same set of frames, a million synthetic
+    ones by default or the reports out of a capture file (-p) repeated as
+    many times as it takes.  For each one we report how long a frame
+    took, how many frames a second that comes to, and how many heap
+    allocations and read/write system calls each frame cost.  stderr is
+    pointed at /dev/null first, so the decoders' chatter is still paid
+    for but doesn't flood the terminal.  It goes through the log thread
+    the way it does in the daemon, rate limit and all.
+
+    -w file saves the results as a baseline, -b file compares against
+    one and exits 1 if anything got half again slower or
+    started allocating or making system calls it didn't before.  The
+    numbers only mean something against a baseline from the same box.
+
+    Allocations are counted on glibc only, system calls only where there
+    is a /proc/self/io; anywhere else those columns read n/a.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "weatherstation.h"
+#include "wxdecode.h"
+#include "wxderive.h"
+#include "wxcapture.h"
+#include "wxsink.h"
+#include "wxlog.h"
+#include "wxtrace.h"
+
+#define R1SIZE  10
+#define R2SIZE  25
+#define MAXBENCH 24
+
+// Where is the ceiling for "slower" when checking against a baseline
+#define SLOWER  1.5
+// Timed runs of each benchmark, the fastest one counts
+#define PASSES  3
+
+/*
+    Counting allocations.  Our malloc and friends stand in front of
+    glibc's, for calls from inside libc too.
+*/
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long allocs;
+void *malloc(size_t size) { allocs++; return __libc_malloc(size); }
+void *calloc(size_t n, size_t size) { allocs++; return __libc_calloc(n, size); }
+void *realloc(void *ptr, size_t size) { allocs++; return __libc_realloc(ptr, size); }
+static long allocCount(void) { return (long)allocs; }
+#else
+static long allocCount(void) { return -1; }
+#endif
+
+// read and write system calls so far, from /proc/self/io
+static long syscallCount(void)
+{
+    char line[128];
+    long n = 0, v;
+    FILE *fp = fopen("/proc/self/io", "r");
+
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "syscr: %ld", &v) == 1 || sscanf(line, "syscw: %ld", &v) == 1)
+            n += v;
+    fclose(fp);
+    return n;
+}
+
+static long long nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+    The frames.  r1 holds report 1 without its report id byte, the way
+    decode() gets it; r2 holds report 2 whole, the way decode2() does.
+*/
+static unsigned char (*r1)[R1SIZE];
+static unsigned char (*r2)[R2SIZE];
+static long nframes;
+static volatile float sinkf;
+static volatile int sinki;
+static struct wxdecoder dec;
+
+static unsigned int lcg = 12345;
+static unsigned char rnd(void)
+{
+    lcg = lcg * 1103515245 + 12345;
+    return (unsigned char)(lcg >> 16);
+}
+
+static void makeR1(void)
+{
+    long i;
+
+    for (i = 0; i < nframes; i++) {
+        // The head alternates between its two message types
+        r1[i][0] = 0xc0;
+        r1[i][1] = 0x12;
+        r1[i][2] = 0x70 | (i & 1 ? 8 : 1);
+        r1[i][3] = rnd() & 0x1f;
+        r1[i][4] = rnd() & 0x7f;
+        r1[i][5] = rnd() & 0x7f;
+        r1[i][6] = rnd() & 0x7f;
+        r1[i][7] = 0;
+        r1[i][8] = 0xff;
+    }
+}
+
+static void makeR2(void)
+{
+    long i;
+
+    for (i = 0; i < nframes; i++) {
+        memset(r2[i], 0, R2SIZE);
+        r2[i][0] = 2;
+        r2[i][21] = 0x1a;
+        r2[i][22] = rnd();
+        r2[i][23] = 0x6e;
+        r2[i][24] = rnd();
+    }
+}
+
+// Fill the frames from a capture, over and over if it's short
+static int loadCapture(const char *path)
+{
+    struct wxcapture *cap;
+    struct wxcapture_rec rec;
+    long n1 = 0, n2 = 0, got;
+
+    while (n1 < nframes || n2 < nframes) {
+        cap = wxcapture_open(path);
+        if (cap == NULL)
+            return -1;
+        got = 0;
+        while (wxcapture_read(cap, &rec) > 0) {
+            if (WXCAPTURE_ID(rec.report) == 1 && rec.length > 1 && n1 < nframes) {
+                memset(r1[n1], 0, R1SIZE);
+                memcpy(r1[n1++], rec.data + 1, rec.length - 1 < R1SIZE ? rec.length - 1 : R1SIZE);
+                got++;
+            }
+            if (WXCAPTURE_ID(rec.report) == 2 && n2 < nframes) {
+                memset(r2[n2], 0, R2SIZE);
+                memcpy(r2[n2++], rec.data, rec.length < R2SIZE ? rec.length : R2SIZE);
+                got++;
+            }
+        }
+        wxcapture_close(cap);
+        if (got == 0) {
+            fprintf(stdout, "%s has no reports in it\n", path);
+            return -1;
+        }
+        // Only one kind of report in there, make up the other kind
+        if (n1 == 0) {
+            makeR1();
+            n1 = nframes;
+        }
+        if (n2 == 0) {
+            makeR2();
+            n2 = nframes;
+        }
+    }
+    return 0;
+}
+
+/*
+    The benchmarks, one frame per call
+*/
+static void bWindSpeed(long i)      { sinkf = getWindSpeed(r1[i]); }
+static void bWindDirection(long i)  { sinki = getWindDirection(r1[i]); }
+static void bTemp(long i)           { sinkf = getTemp(r1[i]); }
+static void bHumidity(long i)       { sinki = getHumidity(r1[i]); }
+static void bRainCount(long i)
+{
+    frameTime = 1700000000 + i * 18;
+    sinki = getRainCount(&dec, r1[i], 0);
+}
+static void bBaroPress(long i)      { sinkf = getBaroPress(r2[i], 0); }
+static void bDecode(long i)
+{
+    frameTime = 1700000000 + i * 18;
+    decode(&dec, r1[i], R1SIZE, 0);
+}
+static void bDecodeNoisy(long i)
+{
+    frameTime = 1700000000 + i * 18;
+    decode(&dec, r1[i], R1SIZE, 1);
+}
+static void bDecode2(long i)
+{
+    frameTime = 1700000000 + i * 18;
+    decode2(&dec, r2[i], R2SIZE - 1, 0);
+}
+
+/*
+    The batch decoder goes BATCH frames at a time; the call that lands on
+    the start of a batch does the whole batch and the rest are free, so
+    ns/frame still comes out right.
+*/
+#define BATCH   1024
+static float batchOut[WXF_NFIELDS][BATCH];
+static unsigned char batchType[BATCH];
+static void bDecodeBatch(long i)
+{
+    struct wxdecode_soa soa;
+    int f;
+
+    if (i % BATCH)
+        return;
+    soa.type = batchType;
+    for (f = 0; f < WXF_NFIELDS; f++)
+        soa.field[f] = batchOut[f];
+    wxdecode_batch(r1[i], R1SIZE, nframes - i < BATCH ? nframes - i : BATCH, &soa);
+    sinkf = batchOut[WXF_TEMP][0];
+}
+
+/*
+    Derived quantities, one sample at a time the way the live path does
+    them and BATCH at a time over arrays the way history gets done over.
+    Both work out all four.
+*/
+static float deriveTemp[BATCH], deriveWind[BATCH];
+static int deriveHumidity[BATCH];
+static float deriveOut[4][BATCH];
+static void deriveSample(long i, int j)
+{
+    deriveTemp[j] = getTemp(r1[i]);
+    deriveHumidity[j] = getHumidity(r1[i]);
+    deriveWind[j] = getWindSpeed(r1[i]);
+}
+static void bDeriveScalar(long i)
+{
+    deriveSample(i, 0);
+    sinkf = wxderive_dewpoint(deriveTemp[0], deriveHumidity[0]) +
+            wxderive_heatindex(deriveTemp[0], deriveHumidity[0]) +
+            wxderive_windchill(deriveTemp[0], deriveWind[0]) +
+            wxderive_apparent(deriveTemp[0], deriveHumidity[0], deriveWind[0]);
+}
+// The inputs are filled in before the clock starts, see main()
+static void bDeriveBatch(long i)
+{
+    struct wxderive_soa soa = {deriveOut[0], deriveOut[1], deriveOut[2], deriveOut[3]};
+
+    if (i % BATCH)
+        return;
+    wxderive_batch(deriveTemp, deriveHumidity, deriveWind, nframes - i < BATCH ? nframes - i : BATCH, &soa);
+    sinkf = deriveOut[0][0];
+}
+
+/*
+    The output formats, through a sink batching 64 records to /dev/null,
+    so the writev() is in there too.  printf-json is the old showit()
+    for comparison.
+*/
+#define SINKBATCH   64
+static struct wxsink *sinks[3];
+static FILE *devnull;
+// A different sample each time, without paying for decode()
+static void sinkSample(long i)
+{
+    frameTime = 1700000000 + i * 18;
+    dec.wx.windSpeed = getWindSpeed(r1[i]);
+    dec.wx.windDirection = getWindDirection(r1[i]);
+    dec.wx.temperature = getTemp(r1[i]);
+    dec.wx.humidity = getHumidity(r1[i]);
+    dec.wx.wsTime = dec.wx.wdTime = dec.wx.tTime = dec.wx.hTime = frameTime;
+}
+static void bSinkJson(long i) { sinkSample(i); wxsink_write(sinks[WXSINK_JSON], 0, frameTime, &dec.wx); }
+static void bSinkCsv(long i)  { sinkSample(i); wxsink_write(sinks[WXSINK_CSV], 0, frameTime, &dec.wx); }
+static void bSinkBin(long i)  { sinkSample(i); wxsink_write(sinks[WXSINK_BIN], 0, frameTime, &dec.wx); }
+static void bPrintfJson(long i)
+{
+    sinkSample(i);
+    fprintf(devnull, "{\"windSpeed\":{\"WS\":\"%0.1f\",\"t\":\"%ld\"},"
+                    "\"windDirection\":{\"WDS\":\"%s\",\"t\":\"%ld\"},"
+                    "\"windDirection\":{\"WDD\":\"%s\",\"t\":\"%ld\"},"
+                    "\"windDirRaw\":{\"WDR\":\"%d\",\"t\":\"%ld\"},"
+                    "\"temperature\":{\"T\":\"%0.1f\",\"t\":\"%ld\"},"
+                    "\"humidity\":{\"H\":\"%d\",\"t\":\"%ld\"},"
+                    "\"rainCounter\":{\"RC\":\"%d\",\"t\":\"%ld\"},"
+                    "\"rainRaw\":{\"RR\":\"%d\",\"t\":\"%ld\"},"
+                    "\"Barometer\":{\"BP\":\"%0.1f\",\"t\":\"%ld\"}"
+                    "}\n",
+            dec.wx.windSpeed, dec.wx.wsTime,
+            Direction[dec.wx.windDirection],dec.wx.wdTime,
+            DirectionNum[dec.wx.windDirection],dec.wx.wdTime,
+            dec.wx.windDirection,dec.wx.wdTime,
+            dec.wx.temperature, dec.wx.tTime,
+            (int)dec.wx.humidity, dec.wx.hTime,
+            dec.wx.rainCounter, dec.wx.rcTime,
+            dec.wx.rainRaw, dec.wx.rrTime,
+            dec.wx.barometer, dec.wx.bTime
+        );
+    fflush(devnull);
+}
+
+// A span around next to nothing, what tracing adds to a stage
+static struct wxtrace_ring *ring;
+static void bTraceOff(long i)
+{
+    uint64_t t = wxtrace_begin();
+    sinki = i;
+    wxtrace_end(ring, "bench", i, t);
+}
+static void bTraceOn(long i)
+{
+    wxtrace_enabled = 1;
+    bTraceOff(i);
+    wxtrace_enabled = 0;
+}
+
+struct bench {
+    const char *name;
+    void (*fn)(long i);
+};
+
+static struct bench benches[] = {
+    {"getWindSpeed",     bWindSpeed},
+    {"getWindDirection", bWindDirection},
+    {"getTemp",          bTemp},
+    {"getHumidity",      bHumidity},
+    {"getRainCount",     bRainCount},
+    {"getBaroPress",     bBaroPress},
+    {"decode",           bDecode},
+    {"decode-noisy",     bDecodeNoisy},
+    {"decode2",          bDecode2},
+    {"decode-batch",     bDecodeBatch},
+    {"derive-scalar",    bDeriveScalar},
+    {"derive-batch",     bDeriveBatch},
+    {"printf-json",      bPrintfJson},
+    {"sink-json",        bSinkJson},
+    {"sink-csv",         bSinkCsv},
+    {"sink-bin",         bSinkBin},
+    {"trace-off",        bTraceOff},
+    {"trace-on",         bTraceOn},
+    {NULL, NULL}
+};
+
+struct result {
+    const char *name;
+    double  ns;
+    double  allocs;     // < 0 when we can't tell
+    double  syscalls;
+};
+
+static void run(struct bench *b, struct result *res)
+{
+    long long start, took;
+    long a0, a1, s0, s1, overhead, i;
+    int pass;
+
+    // What it costs just to ask, so it can come off the total
+    s0 = syscallCount();
+    s1 = syscallCount();
+    overhead = s1 - s0;
+
+    // One pass to get the cache warm and any one time setup out of the way
+    for (i = 0; i < nframes && i < 1000; i++)
+        b->fn(i);
+
+    s0 = syscallCount();
+    a0 = allocCount();
+    start = nowNs();
+    for (i = 0; i < nframes; i++)
+        b->fn(i);
+    took = nowNs() - start;
+    a1 = allocCount();
+    s1 = syscallCount();
+
+    // Best of a few, whatever else the box is doing only ever adds time
+    for (pass = 1; pass < PASSES; pass++) {
+        start = nowNs();
+        for (i = 0; i < nframes; i++)
+            b->fn(i);
+        start = nowNs() - start;
+        if (start < took)
+            took = start;
+    }
+
+    res->name = b->name;
+    res->ns = (double)took / nframes;
+    res->allocs = a0 < 0 ? -1 : (double)(a1 - a0) / nframes;
+    res->syscalls = s0 < 0 ? -1 : (double)(s1 - s0 - overhead) / nframes;
+}
+
+static void show(FILE *fp, double v)
+{
+    if (v < 0)
+        fprintf(fp, " %12s", "n/a");
+    else
+        fprintf(fp, " %12.3f", v);
+}
+
+// Returns how many benchmarks got worse
+static int compare(const char *path, struct result *res, int n)
+{
+    char name[64];
+    double ns, allocs, syscalls;
+    int i, worse = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        fprintf(stdout, "No baseline in %s, make one with \"make bench-baseline\"\n", path);
+        return 0;
+    }
+    fprintf(stdout, "\nAgainst %s:\n", path);
+    while (fscanf(fp, "%63s %lf %lf %lf", name, &ns, &allocs, &syscalls) == 4) {
+        for (i = 0; i < n; i++) {
+            if (strcmp(name, res[i].name) != 0)
+                continue;
+            int slow = res[i].ns > ns * SLOWER + 1.0;
+            int more = (allocs >= 0 && res[i].allocs > allocs + 0.001) ||
+                       (syscalls >= 0 && res[i].syscalls > syscalls + 0.001);
+            fprintf(stdout, "%-18s %8.1f ns -> %8.1f ns  %+6.1f%%%s%s\n",
+                name, ns, res[i].ns, ns > 0 ? (res[i].ns - ns) * 100.0 / ns : 0.0,
+                slow ? "  SLOWER" : "", more ? "  MORE ALLOCS/SYSCALLS" : "");
+            worse += slow || more;
+        }
+    }
+    fclose(fp);
+    return worse;
+}
+
+int main(int argc, char **argv)
+{
+    char *usage = {"usage: %s [-n frames] [-p capture] [-b baseline] [-w baseline]\n"};
+    char *capturePath = NULL, *baseline = NULL, *save = NULL;
+    struct result res[MAXBENCH];
+    int c, i, n;
+    FILE *fp;
+
+    nframes = 1000000;
+    while ((c = getopt(argc, argv, "n:p:b:w:h")) != -1)
+        switch (c) {
+            case 'n':
+                nframes = atol(optarg);
+                break;
+            case 'p':
+                capturePath = optarg;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 'w':
+                save = optarg;
+                break;
+            default:
+                fprintf(stderr, usage, argv[0]);
+                exit(1);
+        }
+    if (nframes < 1)
+        nframes = 1;
+    r1 = calloc(nframes, R1SIZE);
+    r2 = calloc(nframes, R2SIZE);
+    if (r1 == NULL || r2 == NULL) {
+        fprintf(stderr, "Not enough memory for %ld frames\n", nframes);
+        exit(1);
+    }
+    if (capturePath) {
+        if (loadCapture(capturePath) < 0)
+            exit(1);
+    }
+    else {
+        makeR1();
+        makeR2();
+    }
+
+    // The decoders write to stderr, that's part of what we're measuring,
+    // but nobody needs to see it.
+    if (freopen("/dev/null", "w", stderr) == NULL)
+        exit(1);
+    // and it has to be unbuffered, like the real one
+    setvbuf(stderr, NULL, _IONBF, 0);
+    if (wxlog_start(fileno(stderr)) < 0)
+        exit(1);
+    devnull = fopen("/dev/null", "w");
+    for (i = 0; i < 3; i++)
+        sinks[i] = devnull ? wxsink_open(fileno(devnull), i, SINKBATCH) : NULL;
+    if (sinks[0] == NULL || sinks[1] == NULL || sinks[2] == NULL)
+        exit(1);
+    ring = wxtrace_ring("bench");
+    for (i = 0; i < BATCH; i++)
+        deriveSample(i % nframes, i);
+
+    fprintf(stdout, "%ld %s frames\n\n", nframes, capturePath ? "captured" : "synthetic");
+    fprintf(stdout, "%-18s %12s %12s %12s %12s\n", "", "ns/frame", "frames/s", "allocs/frame", "syscalls/frame");
+    for (n = 0; benches[n].name; n++) {
+        run(&benches[n], &res[n]);
+        fprintf(stdout, "%-18s %12.1f %12.0f", res[n].name, res[n].ns, res[n].ns > 0 ? 1e9 / res[n].ns : 0.0);
+        show(stdout, res[n].allocs);
+        show(stdout, res[n].syscalls);
+        fprintf(stdout, "\n");
+        fflush(stdout);
+    }
+
+    if (save) {
+        fp = fopen(save, "w");
+        if (fp == NULL) {
+            perror(save);
+            exit(1);
+        }
+        for (i = 0; i < n; i++)
+            fprintf(fp, "%s %.3f %.3f %.3f\n", res[i].name, res[i].ns, res[i].allocs, res[i].syscalls);
+        fclose(fp);
+        fprintf(stdout, "\nBaseline saved in %s\n", save);
+    }
+    if (baseline && compare(baseline, res, n))
+        exit(1);
+    exit(0);
+}
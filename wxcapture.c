@@ -0,0 +1,113 @@
+/*
+    Capture files, see wxcapture.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wxcapture.h"
+#include "wxlog.h"
+
+static const char fileMagic[8] = "WXCAP01";
+
+struct wxcapture {
+    FILE *  fp;
+};
+
+struct caphdr {
+    uint64_t    mono;
+    int64_t     wall;
+    uint8_t     report;
+    uint8_t     length;
+} __attribute__((packed));
+
+uint64_t wxcapture_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+struct wxcapture *wxcapture_create(const char *path)
+{
+    struct wxcapture *cap = calloc(1, sizeof(struct wxcapture));
+
+    if (cap == NULL)
+        return NULL;
+    cap->fp = fopen(path, "ab");
+    if (cap->fp == NULL) {
+        free(cap);
+        return NULL;
+    }
+    // A brand new file gets the header, an old one already has it
+    if (ftell(cap->fp) == 0 && fwrite(fileMagic, sizeof(fileMagic), 1, cap->fp) != 1) {
+        wxcapture_close(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+struct wxcapture *wxcapture_open(const char *path)
+{
+    struct wxcapture *cap = calloc(1, sizeof(struct wxcapture));
+    char magic[8];
+
+    if (cap == NULL)
+        return NULL;
+    cap->fp = fopen(path, "rb");
+    if (cap->fp == NULL) {
+        free(cap);
+        return NULL;
+    }
+    if (fread(magic, sizeof(magic), 1, cap->fp) != 1 ||
+        memcmp(magic, fileMagic, sizeof(magic)) != 0) {
+        wxlog_error("%s isn't a capture file\n", path);
+        wxcapture_close(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+void wxcapture_close(struct wxcapture *cap)
+{
+    if (cap == NULL)
+        return;
+    fclose(cap->fp);
+    free(cap);
+}
+
+int wxcapture_write(struct wxcapture *cap, int report, const unsigned char *data, int length)
+{
+    struct caphdr hdr;
+
+    if (length < 0 || length > WXCAPTURE_MAXREPORT)
+        return -1;
+    hdr.mono = wxcapture_now();
+    hdr.wall = time(NULL);
+    hdr.report = report;
+    hdr.length = length;
+    if (fwrite(&hdr, sizeof(hdr), 1, cap->fp) != 1 ||
+        (length && fwrite(data, length, 1, cap->fp) != 1))
+        return -1;
+    // One report every few seconds; get each one out so a crash doesn't
+    // take the interesting part of the capture with it
+    return fflush(cap->fp) == 0 ? 0 : -1;
+}
+
+int wxcapture_read(struct wxcapture *cap, struct wxcapture_rec *rec)
+{
+    struct caphdr hdr;
+    size_t n = fread(&hdr, 1, sizeof(hdr), cap->fp);
+
+    if (n == 0)
+        return 0;
+    if (n != sizeof(hdr))
+        return -1;
+    rec->mono = hdr.mono;
+    rec->wall = (time_t)hdr.wall;
+    rec->report = hdr.report;
+    rec->length = hdr.length;
+    if (rec->length && fread(rec->data, rec->length, 1, cap->fp) != 1)
+        return -1;
+    return 1;
+}
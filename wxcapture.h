@@ -0,0 +1,58 @@
+/*
+    Raw USB report capture files.
+
+    Every report the console hands us can be written, exactly as it came
+    off the wire, to a capture file along with when it arrived.  Reading
+    the file back gives the same reports in the same order with the same
+    spacing, so a problem seen in the field can be run through the
+    decoders again on a desk with no console plugged in.
+
+    The file is an 8 byte header followed by records of
+
+        uint64  monotonic nanoseconds when the report arrived
+        int64   wall clock seconds, what the decoders stamp the data with
+        uint8   report id, 1 or 2, plus 4 times the station it came from
+        uint8   length
+        uint8   data[length]
+
+    all in the byte order of the machine that wrote it.
+*/
+#ifndef WXCAPTURE_H
+#define WXCAPTURE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define WXCAPTURE_MAXREPORT 255
+
+// Putting the station in with the report id and getting it back out.
+// Captures from before there were stations read back as station 0.
+#define WXCAPTURE_REPORT(station, id)   ((station) << 2 | (id))
+#define WXCAPTURE_STATION(report)       ((report) >> 2)
+#define WXCAPTURE_ID(report)            ((report) & 3)
+
+struct wxcapture;
+
+struct wxcapture_rec {
+    uint64_t        mono;
+    time_t          wall;
+    int             report;
+    int             length;
+    unsigned char   data[WXCAPTURE_MAXREPORT];
+};
+
+// Open for writing (appending to an existing capture) or reading
+struct wxcapture *wxcapture_create(const char *path);
+struct wxcapture *wxcapture_open(const char *path);
+void wxcapture_close(struct wxcapture *cap);
+
+// Returns 0, or -1 if it couldn't be written
+int wxcapture_write(struct wxcapture *cap, int report, const unsigned char *data, int length);
+// Returns 1 with rec filled in, 0 at the end of the file, -1 if the file
+// is damaged
+int wxcapture_read(struct wxcapture *cap, struct wxcapture_rec *rec);
+
+// Monotonic nanoseconds, the same clock the capture uses
+uint64_t wxcapture_now(void);
+
+#endif
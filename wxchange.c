@@ -0,0 +1,142 @@
+/*
+    Change tracking, see wxchange.h.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "wxchange.h"
+
+static const char *fieldNames[WXC_NFIELDS] = {
+    "windSpeed", "windDirection", "temperature", "humidity",
+    "rainCounter", "rainRaw", "barometer"
+};
+
+// The smallest move worth telling anybody about.  Wind direction and
+// the rain counters count every step, they're whole numbers anyway.
+static const float defaultDeadband[WXC_NFIELDS] = {
+    0.5,    // windSpeed
+    0,      // windDirection
+    0.2,    // temperature
+    0,      // humidity
+    0,      // rainCounter
+    0,      // rainRaw
+    0.02    // barometer
+};
+
+static float value(const struct weatherData *wx, int field)
+{
+    switch (field) {
+        case WXC_WINDSPEED:     return wx->windSpeed;
+        case WXC_WINDDIR:       return wx->windDirection;
+        case WXC_TEMP:          return wx->temperature;
+        case WXC_HUMIDITY:      return wx->humidity;
+        case WXC_RAINCOUNTER:   return wx->rainCounter;
+        case WXC_RAINRAW:       return wx->rainRaw;
+        case WXC_BAROMETER:     return wx->barometer;
+    }
+    return 0;
+}
+
+static time_t stamp(const struct weatherData *wx, int field)
+{
+    switch (field) {
+        case WXC_WINDSPEED:     return wx->wsTime;
+        case WXC_WINDDIR:       return wx->wdTime;
+        case WXC_TEMP:          return wx->tTime;
+        case WXC_HUMIDITY:      return wx->hTime;
+        case WXC_RAINCOUNTER:   return wx->rcTime;
+        case WXC_RAINRAW:       return wx->rrTime;
+        case WXC_BAROMETER:     return wx->bTime;
+    }
+    return 0;
+}
+
+const char *wxchange_field_name(int field)
+{
+    return field >= 0 && field < WXC_NFIELDS ? fieldNames[field] : "?";
+}
+
+void wxchange_policy_init(struct wxchange_policy *policy)
+{
+    memcpy(policy->deadband, defaultDeadband, sizeof(policy->deadband));
+    policy->heartbeat = 0;
+}
+
+int wxchange_policy_parse(struct wxchange_policy *policy, const char *spec)
+{
+    const char *p = spec, *eq;
+    char *end;
+    float v;
+    int f;
+
+    while (*p) {
+        eq = strchr(p, '=');
+        if (eq == NULL)
+            return -1;
+        for (f = 0; f < WXC_NFIELDS; f++)
+            if (strlen(fieldNames[f]) == (size_t)(eq - p) && strncmp(fieldNames[f], p, eq - p) == 0)
+                break;
+        if (f == WXC_NFIELDS)
+            return -1;
+        v = strtof(eq + 1, &end);
+        if (end == eq + 1 || v < 0 || (*end && *end != ','))
+            return -1;
+        policy->deadband[f] = v;
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+unsigned int wxchange_note(struct wxchange *ch, const struct weatherData *wx)
+{
+    unsigned int fresh = 0;
+    time_t t;
+    int f;
+
+    for (f = 0; f < WXC_NFIELDS; f++) {
+        t = stamp(wx, f);
+        if (t != ch->seen[f]) {
+            ch->seen[f] = t;
+            fresh |= 1u << f;
+        }
+    }
+    if (fresh)
+        ch->gen++;
+    ch->fresh = fresh;
+    return fresh;
+}
+
+unsigned int wxchange_due(struct wxchange_sink *sink, const struct wxchange *ch,
+                          const struct weatherData *wx, const struct wxchange_policy *policy,
+                          time_t now)
+{
+    unsigned int moved = 0;
+    float d;
+    int f;
+
+    if (policy->heartbeat == 0 || sink->when == 0)
+        moved = (1u << WXC_NFIELDS) - 1;
+    // Nothing new has come in since last time, so nothing can have moved
+    else if (sink->gen != ch->gen) {
+        for (f = 0; f < WXC_NFIELDS; f++) {
+            d = value(wx, f) - sink->sent[f];
+            if (d > policy->deadband[f] || -d > policy->deadband[f])
+                moved |= 1u << f;
+        }
+    }
+    if (moved == 0) {
+        if (now - sink->when < policy->heartbeat) {
+            // Compared already, it only needs doing again when there's
+            // something newer.  What's drifted is still measured from
+            // what we sent.
+            sink->gen = ch->gen;
+            return 0;
+        }
+        moved = WXC_HEARTBEAT;
+    }
+    for (f = 0; f < WXC_NFIELDS; f++)
+        sink->sent[f] = value(wx, f);
+    sink->gen = ch->gen;
+    sink->when = now;
+    return moved;
+}
@@ -0,0 +1,73 @@
+/*
+    Change tracking, so the outputs and the uploads only go out when
+    there's something new to say.
+
+    Each station has a wxchange that's told about its weather after
+    every report.  A field only changes when a frame with it in arrives,
+    and its xTime says when that was, so comparing those is enough to
+    know which fields have new data; any that do bump the station's
+    generation.  Every consumer of the station (the stdout sink, the
+    uploads) keeps a wxchange_sink with the generation and the values
+    it last sent.  If the generation hasn't moved there's nothing to
+    compare.  If it has, a field only counts as changed when it moved
+    by more than its deadband, so a temperature wobbling a tenth either
+    way doesn't send anything.  Whatever happens, something goes out
+    every heartbeat seconds so the other end knows we're alive.
+*/
+#ifndef WXCHANGE_H
+#define WXCHANGE_H
+
+#include <time.h>
+#include "weatherstation.h"
+
+enum wxchange_field {
+    WXC_WINDSPEED,
+    WXC_WINDDIR,
+    WXC_TEMP,
+    WXC_HUMIDITY,
+    WXC_RAINCOUNTER,
+    WXC_RAINRAW,
+    WXC_BAROMETER,
+    WXC_NFIELDS
+};
+
+struct wxchange_policy {
+    float   deadband[WXC_NFIELDS];  // has to move by more than this
+    long    heartbeat;              // seconds, 0 for no suppression at all
+};
+
+// One per station
+struct wxchange {
+    unsigned long   gen;                // bumped when any field gets new data
+    unsigned int    fresh;              // which ones did, the last time
+    time_t          seen[WXC_NFIELDS];  // their xTime when we last looked
+};
+
+// One per station per consumer
+struct wxchange_sink {
+    unsigned long   gen;                // the station's generation when we last sent
+    float           sent[WXC_NFIELDS];  // what we sent
+    time_t          when;               // and when
+};
+
+// Sensible deadbands, no heartbeat
+void wxchange_policy_init(struct wxchange_policy *policy);
+// "name=value,name=value" with the names from wxchange_field_name().
+// Returns 0, or -1 if something in there didn't make sense.
+int wxchange_policy_parse(struct wxchange_policy *policy, const char *spec);
+const char *wxchange_field_name(int field);
+
+// After every report.  Returns the mask of fields with new data.
+unsigned int wxchange_note(struct wxchange *ch, const struct weatherData *wx);
+
+// Should this consumer send wx now?  Returns the mask of fields that
+// moved past their deadband, all of them the first time, or 0 if
+// there's nothing worth sending; on a heartbeat with nothing changed
+// it's WXC_HEARTBEAT.  When it's not 0 the sink is updated as if it
+// was sent.
+#define WXC_HEARTBEAT   (1u << WXC_NFIELDS)
+unsigned int wxchange_due(struct wxchange_sink *sink, const struct wxchange *ch,
+                          const struct weatherData *wx, const struct wxchange_policy *policy,
+                          time_t now);
+
+#endif
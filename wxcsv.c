@@ -0,0 +1,218 @@
+/*
+    Daily CSV files, see wxcsv.h.
+
+    The script wrote its dates and times with str() on each part, so
+    there's no zero padding anywhere: 7-3-2024 and 9:5:0.  Programs
+    reading these files already expect that, so it stays.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "wxcsv.h"
+#include "wxlog.h"
+#include "wxdecode.h"
+
+#define CSVBUF  8192
+#define ROWMAX  256
+
+static const char header[] =
+    "date,time,wind speed,wind direction,temperature,humidity,rain counter\n";
+
+struct wxcsv {
+    char    dir[PATH_MAX];
+    int     sync;
+    int     fd;
+    time_t  dayStart;   // the day the open file is for
+    time_t  dayEnd;
+    char    date[36];   // d-m-y of that day, room for any three ints
+    size_t  used;
+    char    buf[CSVBUF];
+};
+
+int wxcsv_sync_by_name(const char *name)
+{
+    if (strcmp(name, "never") == 0)
+        return WXCSV_SYNC_NEVER;
+    if (strcmp(name, "day") == 0)
+        return WXCSV_SYNC_DAY;
+    if (strcmp(name, "flush") == 0)
+        return WXCSV_SYNC_FLUSH;
+    return -1;
+}
+
+// Write the buffer out, all of it
+static int writeOut(struct wxcsv *csv)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < csv->used) {
+        n = write(csv->fd, csv->buf + done, csv->used - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // Whatever made it is in the file, keep the rest for next time
+            memmove(csv->buf, csv->buf + done, csv->used - done);
+            csv->used -= done;
+            return -1;
+        }
+        done += n;
+    }
+    csv->used = 0;
+    return 0;
+}
+
+int wxcsv_flush(struct wxcsv *csv)
+{
+    if (csv->fd < 0 || csv->used == 0)
+        return 0;
+    if (writeOut(csv) < 0) {
+        wxlog_error("Couldn't write the day's CSV, %s\n", strerror(errno));
+        return -1;
+    }
+    if (csv->sync == WXCSV_SYNC_FLUSH)
+        fdatasync(csv->fd);
+    return 0;
+}
+
+// A crash can leave a row cut off at the end of the file.  Cut it back
+// to the last whole row.  Returns the size of what's left.
+static off_t trimPartial(int fd, off_t size)
+{
+    char chunk[512];
+    off_t pos = size;
+    ssize_t n, i;
+
+    while (pos > 0) {
+        n = pos < (off_t)sizeof(chunk) ? pos : (off_t)sizeof(chunk);
+        if (pread(fd, chunk, n, pos - n) != n)
+            return size;
+        for (i = n - 1; i >= 0; i--)
+            if (chunk[i] == '\n') {
+                if (pos - n + i + 1 == size)
+                    return size;
+                wxlog_warn("Dropping a half written row at the end of the day's CSV\n");
+                if (ftruncate(fd, pos - n + i + 1) < 0)
+                    return size;
+                return pos - n + i + 1;
+            }
+        pos -= n;
+    }
+    if (ftruncate(fd, 0) < 0)
+        return size;
+    return 0;
+}
+
+static void closeDay(struct wxcsv *csv)
+{
+    if (csv->fd < 0)
+        return;
+    // Anything that still won't go is lost, it mustn't end up in the
+    // next day's file
+    if (wxcsv_flush(csv) < 0)
+        csv->used = 0;
+    if (csv->sync != WXCSV_SYNC_NEVER)
+        fdatasync(csv->fd);
+    close(csv->fd);
+    csv->fd = -1;
+}
+
+static int openDay(struct wxcsv *csv, time_t when)
+{
+    char path[PATH_MAX];
+    struct tm tm;
+    struct stat st;
+    off_t size;
+
+    localtime_r(&when, &tm);
+    snprintf(csv->date, sizeof(csv->date), "%d-%d-%d", tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    csv->dayStart = mktime(&tm);
+    tm.tm_mday++;
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    csv->dayEnd = mktime(&tm);
+
+    if (snprintf(path, sizeof(path), "%s/%s.csv", csv->dir, csv->date) >= (int)sizeof(path)) {
+        wxlog_error("CSV directory %s is too long a name\n", csv->dir);
+        return -1;
+    }
+    // Read and write, a crash may have left something to trim
+    csv->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (csv->fd < 0) {
+        wxlog_error("Couldn't open %s, %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(csv->fd, &st) < 0) {
+        wxlog_error("Couldn't look at %s, %s\n", path, strerror(errno));
+        close(csv->fd);
+        csv->fd = -1;
+        return -1;
+    }
+    size = st.st_size;
+    if (size > 0)
+        size = trimPartial(csv->fd, size);
+    if (size == 0) {
+        memcpy(csv->buf + csv->used, header, sizeof(header) - 1);
+        csv->used += sizeof(header) - 1;
+    }
+    return 0;
+}
+
+struct wxcsv *wxcsv_open(const char *dir, int syncPolicy)
+{
+    struct wxcsv *csv;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return NULL;
+    csv = calloc(1, sizeof(struct wxcsv));
+    if (csv == NULL)
+        return NULL;
+    snprintf(csv->dir, sizeof(csv->dir), "%s", dir);
+    csv->sync = syncPolicy;
+    csv->fd = -1;
+    // The file itself is opened with the first row, for that row's day
+    return csv;
+}
+
+void wxcsv_close(struct wxcsv *csv)
+{
+    if (csv == NULL)
+        return;
+    closeDay(csv);
+    free(csv);
+}
+
+int wxcsv_write(struct wxcsv *csv, time_t when, const struct weatherData *wx)
+{
+    char row[ROWMAX];
+    struct tm tm;
+    int len;
+
+    // Past midnight, or the clock got set back, either way a new file
+    if (csv->fd < 0 || when >= csv->dayEnd || when < csv->dayStart) {
+        closeDay(csv);
+        if (openDay(csv, when) < 0)
+            return -1;
+    }
+    localtime_r(&when, &tm);
+    len = snprintf(row, sizeof(row), "%s,%d:%d:%d,%0.1f,%s,%0.1f,%d,%d\n",
+        csv->date, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        wx->windSpeed,
+        Direction[wx->windDirection & 0x0f],
+        wx->temperature,
+        wx->humidity,
+        wx->rainCounter);
+    if (csv->used + len > sizeof(csv->buf) && wxcsv_flush(csv) < 0)
+        return -1;
+    memcpy(csv->buf + csv->used, row, len);
+    csv->used += len;
+    return 0;
+}
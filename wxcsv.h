@@ -0,0 +1,46 @@
+/*
+    The day's CSV file, written from in here instead of by piping our
+    output through readWeatherData.py.
+
+    Same files the script made: one per local day, named d-m-y.csv in
+    the directory you give it, with the script's header and columns
+
+        date,time,wind speed,wind direction,temperature,humidity,rain counter
+
+    Rows collect in a buffer and go out with one write() when it fills
+    or wxcsv_flush() is called, and the file is switched at local
+    midnight.  How hard we push them at the card is up to the sync
+    policy.  Starting up again on a file that's already there carries
+    on appending to it, after chopping off any half written row a crash
+    left at the end.
+
+    Only one thread may use it.
+*/
+#ifndef WXCSV_H
+#define WXCSV_H
+
+#include <time.h>
+#include "weatherstation.h"
+
+// When to fsync()
+#define WXCSV_SYNC_NEVER    0   // leave it to the kernel
+#define WXCSV_SYNC_DAY      1   // when a day's file is finished, and at close
+#define WXCSV_SYNC_FLUSH    2   // every time the buffer goes out
+
+struct wxcsv;
+
+// Parse "never", "day" or "flush".  -1 if it's none of them.
+int wxcsv_sync_by_name(const char *name);
+
+// Makes dir if it isn't there.  NULL if it can't be used.
+struct wxcsv *wxcsv_open(const char *dir, int syncPolicy);
+// Flushes and syncs before closing.
+void wxcsv_close(struct wxcsv *csv);
+
+// Add a row for wx at time when.  Returns 0, or -1 if it couldn't be
+// written.
+int wxcsv_write(struct wxcsv *csv, time_t when, const struct weatherData *wx);
+// Write out whatever is waiting.
+int wxcsv_flush(struct wxcsv *csv);
+
+#endif
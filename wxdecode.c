@@ -0,0 +1,325 @@
+/*
+    The decoders for the reports the console sends us.  Report 1 carries
+    the 5 in 1 sensor head's radio messages, report 2 the console's own
+    sensors.  The results land in the struct wxdecoder for the console
+    the report came from.
+*/
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include "weatherstation.h"
+#include "wxdecode.h"
+#include "wxderive.h"
+#include "wxlog.h"
+
+time_t frameTime;   // when the frame being decoded came in
+float stationAltitude = WXDERIVE_ALTITUDE;
+
+// Array to translate the integer direction provided to text
+char *Direction[] = {
+    "NW",
+    "WSW",
+    "WNW",
+    "W",
+    "NNW",
+    "SW",
+    "N",
+    "SSW",
+    "ENE",
+    "SE",
+    "E",
+    "ESE",
+    "NE",
+    "SSE",
+    "NNE",
+    "S"
+};
+
+char *DirectionNum[] = {
+    "315",
+    "248",
+    "293",
+    "270",
+    "358",
+    "225",
+    "0",
+    "298",
+    "68",
+    "135",
+    "90",
+    "113",
+    "45",
+    "168",
+    "23",
+    "180"
+};
+
+/*
+    The 5 in 1 head sends two kinds of message, told apart by the low
+    nibble of byte 2, and every field in them is one or two bitfields
+    glued together:
+
+        raw = (data[hiByte] & hiMask) << hiShift | (data[loByte] & loMask) >> loShift
+        value = raw * scale + bias
+
+    so rather than a function per field there is a table per message
+    type saying where each field is.  A field with both masks zero isn't
+    in that message.  Another message type is another row.
+*/
+#define F(hb, hm, hs, lb, lm, ls, scale, bias) {hb, hm, hs, lb, lm, ls, scale, bias}
+#define NONE F(0, 0, 0, 0, 0, 0, 0.0f, 0.0f)
+
+const struct wxfield_desc wxFields[WXMSG_TYPES][WXF_NFIELDS] = {
+    // wind speed, direction and rainfall
+    [1] = {
+        [WXF_BATTERY]   = F(0, 0x00, 0,  3, 0xf0, 4,  1.0f, 0.0f),
+        [WXF_WINDSPEED] = F(3, 0x1f, 3,  4, 0x70, 4,  0.5f, 0.0f),
+        [WXF_WINDDIR]   = F(0, 0x00, 0,  4, 0x0f, 0,  1.0f, 0.0f),
+        [WXF_TEMP]      = NONE,
+        [WXF_HUMIDITY]  = NONE,
+        [WXF_RAIN]      = F(0, 0x00, 0,  6, 0x7f, 0,  1.0f, 0.0f),
+    },
+    // wind speed, temperature and relative humidity
+    [8] = {
+        [WXF_BATTERY]   = NONE,
+        [WXF_WINDSPEED] = F(3, 0x1f, 3,  4, 0x70, 4,  0.5f, 0.0f),
+        [WXF_WINDDIR]   = NONE,
+        [WXF_TEMP]      = F(4, 0x0f, 7,  5, 0x7f, 0,  0.1f, -40.0f),
+        [WXF_HUMIDITY]  = F(0, 0x00, 0,  6, 0x7f, 0,  1.0f, 0.0f),
+        [WXF_RAIN]      = NONE,
+    },
+};
+
+#undef NONE
+#undef F
+
+static inline int fieldRaw(const unsigned char *data, const struct wxfield_desc *f)
+{
+    return ((data[f->hiByte] & f->hiMask) << f->hiShift) |
+           ((data[f->loByte] & f->loMask) >> f->loShift);
+}
+
+static inline int fieldPresent(const struct wxfield_desc *f)
+{
+    return (f->hiMask | f->loMask) != 0;
+}
+
+static inline float fieldValue(const unsigned char *data, const struct wxfield_desc *f)
+{
+    return fieldRaw(data, f) * f->scale + f->bias;
+}
+
+/*
+This code translates the data from the 5 in 1 sensors to something
+that can be used by a human.
+*/
+float getWindSpeed(const unsigned char *data){
+    return(fieldValue(data, &wxFields[8][WXF_WINDSPEED]));
+}
+int getWindDirection(const unsigned char *data){
+    return(fieldRaw(data, &wxFields[1][WXF_WINDDIR]));
+}
+float getTemp(const unsigned char *data)
+{
+    // This item spans bytes, the table puts it back together
+    return(fieldValue(data, &wxFields[8][WXF_TEMP]));
+}
+int getHumidity(const unsigned char *data)
+{
+    return(fieldRaw(data, &wxFields[8][WXF_HUMIDITY]));
+}
+
+// Turn the console's running rain counter into rain since midnight
+static int dailyRain(struct wxdecoder *dec, int reading, int noisy)
+{
+    time_t utcnow;
+    struct tm* locnow;
+    int count = dec->wx.rainRaw;
+    int raincount = 0;
+
+    if(0 == reading && 0 < count) /* console value went to zero, counter reset? */
+    {
+        count = 0;
+    }
+
+    if(0 == count) //first starting up
+        count = reading;
+
+    raincount = reading - count;
+
+    // reset daily rain count to zero right after midnight
+    utcnow = frameTime;
+    locnow = localtime(&utcnow);
+    if(0 == locnow->tm_hour && 0 == dec->didDailyReset)
+    {
+        if(noisy) wxlog_debug("Did daily rain reset\n");
+        dec->didDailyReset = 1;
+        // Today starts from where the console is now
+        count = reading;
+        raincount = 0;
+    }
+    if(1 == locnow->tm_hour && 1 == dec->didDailyReset)
+    {
+        if(noisy) wxlog_debug("Ready for tomorrows daily rain reset\n");
+        dec->didDailyReset = 0;
+    }
+
+    dec->wx.rainRaw = count;
+    return(raincount);
+}
+
+int getRainCount(struct wxdecoder *dec, const unsigned char* data, int noisy)
+{
+    return(dailyRain(dec, fieldRaw(data, &wxFields[1][WXF_RAIN]), noisy));
+}
+
+float getConsoleTemp(const unsigned char* data, int noisy)
+{
+    unsigned int  left = (data[21] & 0x00);
+    unsigned int  lefts = (data[21]<<8);
+    unsigned int  right = (data[22] & 0x00FF);
+    unsigned int  reading = lefts | right;
+    reading &= 0x0000FFFF;
+    wxlog_debug("CT = %X %X %X %X %ld\n", left, lefts, right, reading, sizeof(unsigned int));
+    float temp = reading / 511.13;
+    wxlog_debug("Console Temp = %0.2f\n", temp);
+    return temp;
+}
+
+float getBaroPress(const unsigned char* data, int noisy)
+{
+    unsigned int  left = (data[23] & 0x00);
+    unsigned int  lefts = (data[23]<<8);
+    unsigned int  right = (data[24] & 0x00FF);
+    unsigned int  reading = lefts | right;
+    reading &= 0x0000FFFF;
+    wxlog_debug("BP = %X %X %X %X %ld\n", left, lefts, right, reading, sizeof(unsigned int));
+    float bar = 6.23 * (reading) - 20402;
+    bar /= 100.0; // convert to mbar from pascals
+    wxlog_debug("BP = %0.2f\n", bar);
+    return bar;
+}
+
+// Put one field of a frame where it goes
+static void storeField(struct wxdecoder *dec, int field, float value, time_t seconds, int noisy)
+{
+    switch (field) {
+        case WXF_BATTERY:
+            //# 0x7 indicates battery ok, 0xb indicates low battery?
+            dec->battery = (int)value;
+            //if(noisy)
+                wxlog_debug("Sensor Battery: 0x%1x\n", dec->battery);
+            break;
+        case WXF_WINDSPEED:
+            if(noisy)
+                wxlog_debug("Wind Speed: %.1f\n", value);
+            dec->wx.windSpeed = value;
+            dec->wx.wsTime = seconds;
+            break;
+        case WXF_WINDDIR:
+            dec->wx.windDirection = (int)value;
+            if(noisy)
+                wxlog_debug("Wind Direction: %s\n",Direction[dec->wx.windDirection]);
+            dec->wx.wdTime = seconds;
+            break;
+        case WXF_TEMP:
+            if(noisy)
+                wxlog_debug("Temperature: %.1f\n", value);
+            dec->wx.temperature = value;
+            dec->wx.tTime = seconds;
+            break;
+        case WXF_HUMIDITY:
+            if(noisy)
+                wxlog_debug("Humidity: %d\n", (int)value);
+            dec->wx.humidity = (int)value;
+            dec->wx.hTime = seconds;
+            break;
+        case WXF_RAIN:
+            dec->wx.rainCounter = dailyRain(dec, (int)value, noisy);
+            dec->wx.rcTime = seconds;
+            dec->wx.rrTime = seconds;
+            if(noisy)
+                wxlog_debug("Rain Counter: %d\n",dec->wx.rainCounter);
+            break;
+    }
+}
+
+// Now that I have the data from the station, do something useful with it.
+void decode(struct wxdecoder *dec, const unsigned char *data, int length, int noisy){
+    time_t seconds = frameTime;
+    const struct wxfield_desc *fields;
+    int f;
+
+    if (length < WXFRAME_MIN)
+        return;
+    // There are two varieties of data, both of them have wind speed
+    fields = wxFields[data[2] & 0x0f];
+    for (f = 0; f < WXF_NFIELDS; f++)
+        if (fieldPresent(&fields[f]))
+            storeField(dec, f, fieldValue(data, &fields[f]), seconds, noisy);
+}
+
+/*
+    The batch version, for going back over captured frames.  It goes a
+    field at a time down a chunk of frames instead of a frame at a time,
+    with a pass for every message type that has the field.  Inside a
+    pass the byte positions, masks and scale are all the same, so it's
+    loads, shifts and a multiply by whether the frame is that type, with
+    nothing to branch on.  The frames none of the passes matched get NAN
+    added at the end.  All of it vectorizes, -fopt-info-vec says so.
+*/
+#define BATCHCHUNK 256
+
+void wxdecode_batch(const unsigned char *frames, size_t stride, long n, struct wxdecode_soa *out)
+{
+    unsigned char *restrict type = out->type;
+    float seen[BATCHCHUNK];
+    long base, i, m;
+    int f, t;
+
+    if (type)
+        for (i = 0; i < n; i++)
+            type[i] = frames[i * stride + 2] & 0x0f;
+    for (base = 0; base < n; base += BATCHCHUNK) {
+        const unsigned char *chunk = frames + base * stride;
+        m = n - base < BATCHCHUNK ? n - base : BATCHCHUNK;
+        for (f = 0; f < WXF_NFIELDS; f++) {
+            float *restrict dst = out->field[f] ? out->field[f] + base : NULL;
+            if (dst == NULL)
+                continue;
+            for (i = 0; i < m; i++)
+                dst[i] = seen[i] = 0;
+            for (t = 0; t < WXMSG_TYPES; t++) {
+                const struct wxfield_desc *fd = &wxFields[t][f];
+                const unsigned hiByte = fd->hiByte, hiMask = fd->hiMask, hiShift = fd->hiShift;
+                const unsigned loByte = fd->loByte, loMask = fd->loMask, loShift = fd->loShift;
+                const float scale = fd->scale, bias = fd->bias;
+                if (!fieldPresent(fd))
+                    continue;
+                for (i = 0; i < m; i++) {
+                    const unsigned char *data = chunk + i * stride;
+                    unsigned raw = ((data[hiByte] & hiMask) << hiShift) |
+                                   ((data[loByte] & loMask) >> loShift);
+                    float is = (data[2] & 0x0f) == (unsigned)t;
+                    dst[i] += is * (raw * scale + bias);
+                    seen[i] += is;
+                }
+            }
+            for (i = 0; i < m; i++)
+                dst[i] += seen[i] != 0 ? 0.0f : NAN;
+        }
+    }
+}
+
+void decode2(struct wxdecoder *dec, const unsigned char *data, int length, int noisy)
+{
+    time_t seconds = frameTime;
+
+    getConsoleTemp(data, noisy);
+    dec->wx.barometer = wxderive_sealevel(getBaroPress(data, noisy), stationAltitude);
+    dec->wx.bTime = seconds;
+    if(noisy)
+        wxlog_debug("Baro: %0.2f\n", dec->wx.barometer);
+    return;
+}
@@ -0,0 +1,81 @@
+/*
+    Frame decoders for the 5 in 1 weather head and the console, see
+    wxdecode.c.
+*/
+#ifndef WXDECODE_H
+#define WXDECODE_H
+
+#include <stddef.h>
+#include <time.h>
+#include "weatherstation.h"
+
+// Everything the decoders keep about one console between frames
+struct wxdecoder {
+    struct weatherData  wx;             // the latest of everything
+    int                 battery;        // 0x7 indicates battery ok, 0xb indicates low battery?
+    int                 didDailyReset;  // rain since midnight was zeroed today
+};
+
+// Set this to when the frame came in before calling decode()/decode2()
+extern time_t frameTime;
+// Metres up, for bringing the barometer down to sea level
+extern float stationAltitude;
+
+// Array to translate the integer direction provided to text
+extern char *Direction[];
+extern char *DirectionNum[];
+
+/*
+    Where each field sits in a report 1 frame, by message type (the low
+    nibble of byte 2), see wxdecode.c.
+*/
+#define WXMSG_TYPES     16
+// Bytes of a report 1 frame (after the report id) the fields come from
+#define WXFRAME_MIN     7
+
+enum wxfield {
+    WXF_BATTERY,
+    WXF_WINDSPEED,
+    WXF_WINDDIR,
+    WXF_TEMP,
+    WXF_HUMIDITY,
+    WXF_RAIN,       // the console's running counter, not rain today
+    WXF_NFIELDS
+};
+
+struct wxfield_desc {
+    unsigned char   hiByte, hiMask, hiShift;    // shifted left
+    unsigned char   loByte, loMask, loShift;    // shifted right
+    float           scale, bias;
+};
+
+extern const struct wxfield_desc wxFields[WXMSG_TYPES][WXF_NFIELDS];
+
+float getWindSpeed(const unsigned char *data);
+int getWindDirection(const unsigned char *data);
+float getTemp(const unsigned char *data);
+int getHumidity(const unsigned char *data);
+int getRainCount(struct wxdecoder *dec, const unsigned char* data, int noisy);
+float getConsoleTemp(const unsigned char* data, int noisy);
+float getBaroPress(const unsigned char* data, int noisy);
+
+// report 1, starting after the report id byte
+void decode(struct wxdecoder *dec, const unsigned char *data, int length, int noisy);
+// report 2, report id and all
+void decode2(struct wxdecoder *dec, const unsigned char *data, int length, int noisy);
+
+/*
+    Batch decoding, structure of arrays out.  Each array the caller
+    wants gets n entries; leave a pointer NULL to skip that field.  A
+    frame whose message type doesn't carry a field gets NAN there.
+    There's no wxdecoder, so the rain counter is left raw.
+*/
+struct wxdecode_soa {
+    unsigned char * type;
+    float *         field[WXF_NFIELDS];
+};
+
+// n report 1 frames (after the report id), stride bytes apart
+void wxdecode_batch(const unsigned char *frames, size_t stride, long n, struct wxdecode_soa *out);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+    Derived quantities, see wxderive.h.
+
+    The kernels are written once, on GCC vector types four floats wide,
+    which gcc and clang turn into SSE, NEON or MSA, or plain loops where
+    there's none.  The one-at-a-time versions put the value in all four
+    lanes and take the first one back out.  A kernel can't branch on its
+    lanes, so both sides get worked out and sel() picks.
+
+    exp() and log() are our own for the same reason: libm's won't go
+    four at a time without -ffast-math and a vector libm, which the
+    router build has neither of.  Both are good to a few parts in ten
+    million over the range the weather can reach, better than the
+    formulas they go into.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#include "wxderive.h"
+
+typedef float   vf __attribute__((vector_size(16)));
+typedef int32_t vi __attribute__((vector_size(16)));
+#define LANES   4
+
+#define SPLAT(x)    ((vf){(x), (x), (x), (x)})
+#define SPLATI(x)   ((vi){(x), (x), (x), (x)})
+
+// Adding this to a float rounds it to a whole number sitting in the low
+// bits, and the other way around
+#define MAGIC       12582912.0f     // 1.5 * 2^23
+#define MAGICBITS   0x4b400000
+
+#define LN2         0.693147181f
+#define LN2HI       0.693359375f
+#define LN2LO       -2.12194440e-4f
+#define LOG2E       1.44269504f
+#define SQRT2       1.41421356f
+
+static inline vf sel(vi mask, vf a, vf b)
+{
+    return (vf)(((vi)a & mask) | ((vi)b & ~mask));
+}
+
+static inline vf vmax(vf a, vf b) { return sel(a > b, a, b); }
+static inline vf vmin(vf a, vf b) { return sel(a < b, a, b); }
+static inline vf vabs(vf a)       { return (vf)((vi)a & SPLATI(0x7fffffff)); }
+
+// Whole numbers under 2^22 either way
+static inline vf itof(vi i)
+{
+    return (vf)(i + SPLATI(MAGICBITS)) - SPLAT(MAGIC);
+}
+
+// x > 0.  Split into 2^e * m with m between √½ and √2, then log(m) is
+// 2 atanh((m - 1) / (m + 1)), which is quick to converge there.
+static inline vf vlog(vf x)
+{
+    vi bits = (vi)x;
+    vi e = ((bits >> 23) & SPLATI(0xff)) - SPLATI(127);
+    vf m = (vf)((bits & SPLATI(0x007fffff)) | SPLATI(0x3f800000));
+    vi big = m > SPLAT(SQRT2);
+    vf s, s2, p;
+
+    m = sel(big, m * SPLAT(0.5f), m);
+    e -= big;   // true is -1
+    s = (m - SPLAT(1.0f)) / (m + SPLAT(1.0f));
+    s2 = s * s;
+    p = SPLAT(2.0f / 9) * s2 + SPLAT(2.0f / 7);
+    p = p * s2 + SPLAT(2.0f / 5);
+    p = p * s2 + SPLAT(2.0f / 3);
+    p = p * s2 + SPLAT(2.0f);
+    return itof(e) * SPLAT(LN2) + p * s;
+}
+
+// e^x = 2^n e^r with r within half of ln 2 of 0
+static inline vf vexp(vf x)
+{
+    vf n, r, p;
+    vi ni;
+
+    x = vmin(vmax(x, SPLAT(-87.0f)), SPLAT(88.0f));
+    n = (x * SPLAT(LOG2E) + SPLAT(MAGIC)) - SPLAT(MAGIC);
+    r = x - n * SPLAT(LN2HI) - n * SPLAT(LN2LO);
+    p = SPLAT(1.0f / 5040) * r + SPLAT(1.0f / 720);
+    p = p * r + SPLAT(1.0f / 120);
+    p = p * r + SPLAT(1.0f / 24);
+    p = p * r + SPLAT(1.0f / 6);
+    p = p * r + SPLAT(0.5f);
+    p = p * r + SPLAT(1.0f);
+    p = p * r + SPLAT(1.0f);
+    ni = (vi)(n + SPLAT(MAGIC)) - SPLATI(MAGICBITS);
+    return p * (vf)((ni + SPLATI(127)) << 23);
+}
+
+// x > 0
+static inline vf vpow(vf x, vf y)
+{
+    return vexp(y * vlog(x));
+}
+
+static inline vf toC(vf f) { return (f - SPLAT(32.0f)) * SPLAT(5.0f / 9); }
+static inline vf toF(vf c) { return c * SPLAT(1.8f) + SPLAT(32.0f); }
+
+// Whatever was NAN going in is NAN coming out, not what the bit
+// twiddling made of it
+static inline vf keepNan(vf t, vf v)
+{
+    return sel(t == t, v, t);
+}
+
+static inline vf dewpoint(vf t, vf rh)
+{
+    vf c = toC(t);
+    vf g = vlog(vmax(rh, SPLAT(1.0f)) * SPLAT(0.01f)) + SPLAT(17.625f) * c / (SPLAT(243.04f) + c);
+
+    return keepNan(t, toF(SPLAT(243.04f) * g / (SPLAT(17.625f) - g)));
+}
+
+static inline vf heatindex(vf t, vf rh)
+{
+    vf simple = SPLAT(0.5f) * (t + SPLAT(61.0f) + (t - SPLAT(68.0f)) * SPLAT(1.2f) + rh * SPLAT(0.094f));
+    vf t2 = t * t, rh2 = rh * rh, full, dry, wet;
+
+    full = SPLAT(-42.379f) + SPLAT(2.04901523f) * t + SPLAT(10.14333127f) * rh
+         - SPLAT(0.22475541f) * t * rh - SPLAT(6.83783e-3f) * t2 - SPLAT(5.481717e-2f) * rh2
+         + SPLAT(1.22874e-3f) * t2 * rh + SPLAT(8.5282e-4f) * t * rh2 - SPLAT(1.99e-6f) * t2 * rh2;
+    // Dry and hot, or muggy and not so hot, the regression is off a bit
+    dry = (SPLAT(13.0f) - rh) * SPLAT(0.25f) *
+          vexp(SPLAT(0.5f) * vlog(vmax(SPLAT(17.0f) - vabs(t - SPLAT(95.0f)), SPLAT(1e-6f)) * SPLAT(1.0f / 17)));
+    full = sel((rh < SPLAT(13.0f)) & (t >= SPLAT(80.0f)) & (t <= SPLAT(112.0f)), full - dry, full);
+    wet = (rh - SPLAT(85.0f)) * SPLAT(0.1f) * (SPLAT(87.0f) - t) * SPLAT(0.2f);
+    full = sel((rh > SPLAT(85.0f)) & (t >= SPLAT(80.0f)) & (t <= SPLAT(87.0f)), full + wet, full);
+    // Below about 80°F it's no hotter than it is
+    return keepNan(t, sel((simple + t) * SPLAT(0.5f) >= SPLAT(80.0f), full, t));
+}
+
+static inline vf windchill(vf t, vf v)
+{
+    vf v16 = vpow(vmax(v, SPLAT(1.0f)), SPLAT(0.16f));
+    vf wc = SPLAT(35.74f) + SPLAT(0.6215f) * t - SPLAT(35.75f) * v16 + SPLAT(0.4275f) * t * v16;
+
+    return sel((t <= SPLAT(50.0f)) & (v >= SPLAT(3.0f)), wc, t);
+}
+
+static inline vf apparent(vf t, vf rh, vf v)
+{
+    vf c = toC(t);
+    vf e = rh * SPLAT(0.01f * 6.105f) * vexp(SPLAT(17.27f) * c / (SPLAT(237.7f) + c));
+
+    return keepNan(t, toF(c + SPLAT(0.33f) * e - SPLAT(0.70f * 0.44704f) * v - SPLAT(4.0f)));
+}
+
+// What station pressure gets multiplied by at altitude, in mbar to inHg
+static float levelFactor(float altitude)
+{
+    return vpow(SPLAT(1.0f - 2.25577e-5f * altitude), SPLAT(-5.25588f))[0] / 33.86389f;
+}
+
+float wxderive_dewpoint(float temperature, int humidity)
+{
+    return dewpoint(SPLAT(temperature), SPLAT((float)humidity))[0];
+}
+
+float wxderive_heatindex(float temperature, int humidity)
+{
+    return heatindex(SPLAT(temperature), SPLAT((float)humidity))[0];
+}
+
+float wxderive_windchill(float temperature, float windSpeed)
+{
+    return windchill(SPLAT(temperature), SPLAT(windSpeed))[0];
+}
+
+float wxderive_apparent(float temperature, int humidity, float windSpeed)
+{
+    return apparent(SPLAT(temperature), SPLAT((float)humidity), SPLAT(windSpeed))[0];
+}
+
+float wxderive_sealevel(float pressure, float altitude)
+{
+    return pressure * levelFactor(altitude);
+}
+
+/*
+    Batches.  Whole vectors straight from the arrays, then what's left
+    over through a vector padded out with something harmless.
+*/
+static inline vf loadf(const float *p, long k, float pad)
+{
+    vf v = SPLAT(pad);
+    long j;
+
+    if (k == LANES)
+        memcpy(&v, p, sizeof(v));
+    else
+        for (j = 0; j < k; j++)
+            v[j] = p[j];
+    return v;
+}
+
+static inline vf loadi(const int *p, long k, int pad)
+{
+    vi v = SPLATI(pad);
+    long j;
+
+    if (k == LANES && sizeof(int) == sizeof(int32_t))
+        memcpy(&v, p, sizeof(v));
+    else
+        for (j = 0; j < k; j++)
+            v[j] = p[j];
+    return itof(v);
+}
+
+static inline void store(float *p, long k, vf v)
+{
+    long j;
+
+    if (k == LANES)
+        memcpy(p, &v, sizeof(v));
+    else
+        for (j = 0; j < k; j++)
+            p[j] = v[j];
+}
+
+void wxderive_batch(const float *restrict temperature, const int *restrict humidity,
+                    const float *restrict windSpeed, long n, struct wxderive_soa *out)
+{
+    float *restrict dp = out->dewpoint, *restrict hi = out->heatIndex;
+    float *restrict wc = out->windChill, *restrict at = out->apparent;
+    long i, k;
+    vf t, rh, v = SPLAT(0.0f);
+
+    for (i = 0; i < n; i += LANES) {
+        k = n - i < LANES ? n - i : LANES;
+        t = loadf(temperature + i, k, 60.0f);
+        rh = loadi(humidity + i, k, 50);
+        if (wc || at)
+            v = loadf(windSpeed + i, k, 0.0f);
+        if (dp)
+            store(dp + i, k, dewpoint(t, rh));
+        if (hi)
+            store(hi + i, k, heatindex(t, rh));
+        if (wc)
+            store(wc + i, k, windchill(t, v));
+        if (at)
+            store(at + i, k, apparent(t, rh, v));
+    }
+}
+
+void wxderive_sealevel_batch(const float *restrict pressure, float *restrict barometer, long n, float altitude)
+{
+    vf f = SPLAT(levelFactor(altitude));
+    long i, k;
+
+    for (i = 0; i < n; i += LANES) {
+        k = n - i < LANES ? n - i : LANES;
+        store(barometer + i, k, loadf(pressure + i, k, 0.0f) * f);
+    }
+}
+
+void wxderive_relevel(float *barometer, long n, float from, float to)
+{
+    vf f = SPLAT(levelFactor(to) / levelFactor(from));
+    long i, k;
+
+    for (i = 0; i < n; i += LANES) {
+        k = n - i < LANES ? n - i : LANES;
+        store(barometer + i, k, loadf(barometer + i, k, 0.0f) * f);
+    }
+}
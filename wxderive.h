@@ -0,0 +1,56 @@
+/*
+    Derived quantities: dew point, heat index, wind chill, apparent
+    temperature and sea level pressure.
+
+    Temperatures are in °F, humidity in percent, wind in mph and the
+    barometer in inHg, the same as weatherData.  Dew point is the Magnus
+    formula with the Alduchov and Eskridge constants, heat index and
+    wind chill are the National Weather Service's, and apparent
+    temperature is Steadman's as the Australian Bureau of Meteorology
+    uses it.  Heat index is just the temperature below about 80°F, wind
+    chill is just the temperature above 50°F or under 3 mph.  Sea level
+    pressure comes down the standard atmosphere from the station's
+    altitude.
+
+    Every one comes two ways: one value at a time for the live data, and
+    a batch over structure of arrays for history, four values at a time.
+    Both run the same code, so what's worked out live and what's worked
+    out again from the archive later agree to the last bit.  The batch
+    one does all four in a few tens of nanoseconds a sample, so years of
+    archive can be done over in seconds when the altitude or the
+    constants change.
+*/
+#ifndef WXDERIVE_H
+#define WXDERIVE_H
+
+// Metres.  The console never said, this is where the 21.1 mbar it
+// always added comes out at.
+#define WXDERIVE_ALTITUDE   176
+
+float wxderive_dewpoint(float temperature, int humidity);
+float wxderive_heatindex(float temperature, int humidity);
+float wxderive_windchill(float temperature, float windSpeed);
+float wxderive_apparent(float temperature, int humidity, float windSpeed);
+// Station pressure in mbar to sea level pressure in inHg
+float wxderive_sealevel(float pressure, float altitude);
+
+/*
+    n samples in, structure of arrays.  Leave an output NULL to skip it;
+    wind is only needed for windChill and apparent.  Nothing may
+    overlap.  A NAN temperature comes out NAN.
+*/
+struct wxderive_soa {
+    float * dewpoint;
+    float * heatIndex;
+    float * windChill;
+    float * apparent;
+};
+
+void wxderive_batch(const float *temperature, const int *humidity, const float *windSpeed,
+                    long n, struct wxderive_soa *out);
+void wxderive_sealevel_batch(const float *pressure, float *barometer, long n, float altitude);
+// Barometer readings in inHg already brought down from one altitude,
+// brought down from another instead, in place.
+void wxderive_relevel(float *barometer, long n, float from, float to);
+
+#endif
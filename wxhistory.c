@@ -0,0 +1,124 @@
+/*
+    In memory history, see wxhistory.h.
+
+    A slot's sequence number is 0 while it's being written and the
+    record's number plus one once it's done, the same as the trace
+    rings in wxtrace.c.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "wxhistory.h"
+
+struct slot {
+    atomic_uint             seq;
+    struct wxhistory_rec    rec;
+};
+
+struct wxhistory {
+    unsigned int    mask;
+    atomic_uint     head;       // records ever added
+    struct slot *   slots;
+};
+
+struct wxhistory *wxhistory_new(unsigned int capacity)
+{
+    struct wxhistory *h;
+    unsigned int size = 1, i;
+
+    while (size < capacity)
+        size <<= 1;
+    h = calloc(1, sizeof(struct wxhistory));
+    if (h == NULL)
+        return NULL;
+    h->slots = calloc(size, sizeof(struct slot));
+    if (h->slots == NULL) {
+        free(h);
+        return NULL;
+    }
+    h->mask = size - 1;
+    atomic_init(&h->head, 0);
+    for (i = 0; i < size; i++)
+        atomic_init(&h->slots[i].seq, 0);
+    return h;
+}
+
+void wxhistory_free(struct wxhistory *h)
+{
+    if (h == NULL)
+        return;
+    free(h->slots);
+    free(h);
+}
+
+void wxhistory_add(struct wxhistory *h, int station, time_t when, const struct weatherData *wx)
+{
+    unsigned int head = atomic_load_explicit(&h->head, memory_order_relaxed);
+    struct slot *s = &h->slots[head & h->mask];
+
+    atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->rec.when = when;
+    s->rec.station = station;
+    s->rec.wx = *wx;
+    atomic_store_explicit(&s->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&h->head, head + 1, memory_order_release);
+}
+
+// Copy out record n if it's still there, whole, and from station.  The
+// station is looked at before the copy is made, which is safe enough:
+// if the slot changes in between, the check afterwards throws it out.
+static int readRec(struct wxhistory *h, unsigned int n, int station, struct wxhistory_rec *rec)
+{
+    struct slot *s = &h->slots[n & h->mask];
+    unsigned int seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+
+    if (seq != n + 1 || (station >= 0 && s->rec.station != station))
+        return -1;
+    memcpy(rec, &s->rec, sizeof(*rec));
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&s->seq, memory_order_relaxed) == seq ? 0 : -1;
+}
+
+// The oldest record that can still be in the ring
+static unsigned int oldest(struct wxhistory *h, unsigned int head)
+{
+    return head > h->mask + 1 ? head - (h->mask + 1) : 0;
+}
+
+int wxhistory_latest(struct wxhistory *h, int station, struct wxhistory_rec *rec)
+{
+    unsigned int head = atomic_load_explicit(&h->head, memory_order_acquire);
+    unsigned int n, first = oldest(h, head);
+
+    for (n = head; n != first; n--)
+        if (readRec(h, n - 1, station, rec) == 0 && (station < 0 || rec->station == station))
+            return 0;
+    return -1;
+}
+
+int wxhistory_range(struct wxhistory *h, int station, time_t from, time_t to,
+                    struct wxhistory_rec *recs, int max)
+{
+    unsigned int head = atomic_load_explicit(&h->head, memory_order_acquire);
+    unsigned int n, first = oldest(h, head);
+    struct wxhistory_rec tmp;
+    int count = 0, i;
+
+    // Newest first, since those are the ones to keep if there are too many
+    for (n = head; n != first && count < max; n--) {
+        if (readRec(h, n - 1, station, &recs[count]) < 0)
+            continue;
+        if ((station >= 0 && recs[count].station != station) ||
+            recs[count].when < from || recs[count].when > to)
+            continue;
+        count++;
+    }
+    for (i = 0; i < count / 2; i++) {
+        tmp = recs[i];
+        recs[i] = recs[count - 1 - i];
+        recs[count - 1 - i] = tmp;
+    }
+    return count;
+}
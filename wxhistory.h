@@ -0,0 +1,42 @@
+/*
+    The last few hours of observations, kept in memory for anybody who
+    wants to look without touching the disk.
+
+    It's a ring of fixed size records.  The loop thread is the only one
+    that adds to it; any number of other threads can read it at the
+    same time without a lock.  Each slot carries a sequence number and
+    a reader copies a record out and then checks the number didn't
+    change under it, so a record that's being overwritten is skipped
+    rather than read half old and half new.  Once the ring is full the
+    oldest record makes way for the newest.
+*/
+#ifndef WXHISTORY_H
+#define WXHISTORY_H
+
+#include <time.h>
+#include "weatherstation.h"
+
+struct wxhistory_rec {
+    time_t              when;
+    int                 station;
+    struct weatherData  wx;
+};
+
+struct wxhistory;
+
+// capacity is rounded up to a power of two.  NULL if out of memory.
+struct wxhistory *wxhistory_new(unsigned int capacity);
+void wxhistory_free(struct wxhistory *h);
+
+// Writer side, the one thread only
+void wxhistory_add(struct wxhistory *h, int station, time_t when, const struct weatherData *wx);
+
+// Reader side, any thread.  station -1 matches every station.
+// The newest record for station.  Returns 0, or -1 if there isn't one.
+int wxhistory_latest(struct wxhistory *h, int station, struct wxhistory_rec *rec);
+// Records from..to inclusive, oldest first, at most max of them (the
+// newest max if there are more).  Returns how many.
+int wxhistory_range(struct wxhistory *h, int station, time_t from, time_t to,
+                    struct wxhistory_rec *recs, int max);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+    Persistent upload client, see wxhttp.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+
+#include "wxhttp.h"
+#include "wxlog.h"
+
+// Nobody waits longer than this on the weather sites
+#define CONNECTSECS 10
+#define TOTALSECS   30
+
+struct wxtarget {
+    CURL *      easy;
+    int         queued;
+    CURLcode    result;
+    long        status;
+    long        ms;
+    char        url[WXHTTP_URLSZ];
+};
+
+struct wxhttp {
+    CURLM *         multi;
+    CURLSH *        share;
+    int             ntargets;
+    struct wxtarget target[WXHTTP_MAXTARGET];
+};
+
+// The sites answer with a line or two we don't care about; without this
+// curl would print it to stdout right in the middle of our JSON.
+static size_t discard(char *ptr, size_t size, size_t nmemb, void *arg)
+{
+    return size * nmemb;
+}
+
+struct wxhttp *wxhttp_new(int ntargets)
+{
+    struct wxhttp *http;
+    int i;
+
+    if (ntargets < 1 || ntargets > WXHTTP_MAXTARGET)
+        return NULL;
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+        return NULL;
+    http = calloc(1, sizeof(struct wxhttp));
+    if (http == NULL)
+        return NULL;
+    http->ntargets = ntargets;
+    http->multi = curl_multi_init();
+    http->share = curl_share_init();
+    if (http->multi == NULL || http->share == NULL) {
+        wxhttp_free(http);
+        return NULL;
+    }
+    curl_share_setopt(http->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(http->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_multi_setopt(http->multi, CURLMOPT_MAXCONNECTS, (long)ntargets);
+    curl_multi_setopt(http->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+
+    for (i = 0; i < ntargets; i++) {
+        CURL *easy = curl_easy_init();
+        if (easy == NULL) {
+            wxhttp_free(http);
+            return NULL;
+        }
+        http->target[i].easy = easy;
+        curl_easy_setopt(easy, CURLOPT_SHARE, http->share);
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, &http->target[i]);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard);
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, (long)CONNECTSECS);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT, (long)TOTALSECS);
+        // The addresses of the weather sites hardly ever change
+        curl_easy_setopt(easy, CURLOPT_DNS_CACHE_TIMEOUT, 3600L);
+    }
+    return http;
+}
+
+void wxhttp_free(struct wxhttp *http)
+{
+    int i;
+
+    if (http == NULL)
+        return;
+    for (i = 0; i < http->ntargets; i++) {
+        if (http->target[i].easy == NULL)
+            continue;
+        if (http->target[i].queued)
+            curl_multi_remove_handle(http->multi, http->target[i].easy);
+        curl_easy_cleanup(http->target[i].easy);
+    }
+    if (http->multi)
+        curl_multi_cleanup(http->multi);
+    if (http->share)
+        curl_share_cleanup(http->share);
+    free(http);
+    curl_global_cleanup();
+}
+
+int wxhttp_get(struct wxhttp *http, int target, const char *url)
+{
+    struct wxtarget *t;
+
+    if (target < 0 || target >= http->ntargets)
+        return -1;
+    t = &http->target[target];
+    if (t->queued)
+        return -1;
+    // Whatever the last one did, this one hasn't gone until it's added
+    t->result = CURLE_FAILED_INIT;
+    t->status = 0;
+    t->ms = 0;
+    t->url[0] = '\0';
+    if (strlen(url) >= sizeof(t->url))
+        return -1;
+    strcpy(t->url, url);
+    curl_easy_setopt(t->easy, CURLOPT_URL, t->url);
+    if (curl_multi_add_handle(http->multi, t->easy) != CURLM_OK)
+        return -1;
+    t->queued = 1;
+    t->result = CURLE_OK;
+    return 0;
+}
+
+int wxhttp_run(struct wxhttp *http)
+{
+    int running = 1, left, failed = 0;
+    double secs;
+    CURLMsg *msg;
+    CURLMcode mc;
+
+    while (running) {
+        mc = curl_multi_perform(http->multi, &running);
+        if (mc != CURLM_OK) {
+            wxlog_error("curl multi failed, %s\n", curl_multi_strerror(mc));
+            break;
+        }
+        if (running)
+            curl_multi_wait(http->multi, NULL, 0, 1000, NULL);
+    }
+
+    while ((msg = curl_multi_info_read(http->multi, &left)) != NULL) {
+        struct wxtarget *t;
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+        t->result = msg->data.result;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &t->status);
+        if (curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &secs) == CURLE_OK)
+            t->ms = (long)(secs * 1000.0);
+    }
+    // Take them all back out of the multi handle.  The easy handles keep
+    // their connections open for next time.
+    for (left = 0; left < http->ntargets; left++) {
+        struct wxtarget *t = &http->target[left];
+        if (!t->queued)
+            continue;
+        curl_multi_remove_handle(http->multi, t->easy);
+        t->queued = 0;
+        if (t->result != CURLE_OK || t->status >= 400)
+            failed++;
+    }
+    return failed;
+}
+
+int wxhttp_result(struct wxhttp *http, int target, long *status, long *ms)
+{
+    if (target < 0 || target >= http->ntargets)
+        return -1;
+    if (status)
+        *status = http->target[target].status;
+    if (ms)
+        *ms = http->target[target].ms;
+    return http->target[target].result;
+}
+
+const char *wxhttp_url(struct wxhttp *http, int target)
+{
+    if (target < 0 || target >= http->ntargets)
+        return NULL;
+    return http->target[target].url;
+}
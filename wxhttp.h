@@ -0,0 +1,41 @@
+/*
+    The HTTP client the uploaders share for the life of the process.
+
+    libcurl is set up once.  Each upload target gets its own easy handle
+    that is kept around, so the connection to the site stays open between
+    uploads and doesn't need a new DNS lookup or TCP/TLS handshake every
+    time.  DNS answers and TLS sessions are shared between the handles,
+    and all the targets queued up are sent at the same time through one
+    curl multi handle.
+
+    Only one thread may use a client; for us that's the upload thread.
+*/
+#ifndef WXHTTP_H
+#define WXHTTP_H
+
+#define WXHTTP_MAXTARGET    8
+#define WXHTTP_URLSZ        2048
+
+struct wxhttp;
+
+// Call from main() before any other threads exist, curl_global_init()
+// isn't thread safe.  ntargets is how many different sites we talk to.
+struct wxhttp *wxhttp_new(int ntargets);
+void wxhttp_free(struct wxhttp *http);
+
+// Queue a GET of url on target.  Nothing goes out until wxhttp_run().
+// Returns -1 if the target already has one queued, or if it couldn't be
+// queued, when wxhttp_result() says CURLE_FAILED_INIT until the next.
+int wxhttp_get(struct wxhttp *http, int target, const char *url);
+
+// Send everything queued, all at once, and wait until it is all done or
+// timed out.  Returns how many of them failed.
+int wxhttp_run(struct wxhttp *http);
+
+// How the last request on target went: the CURLcode, plus the HTTP status
+// and time taken in milliseconds if you pass somewhere to put them.
+int wxhttp_result(struct wxhttp *http, int target, long *status, long *ms);
+// The URL last queued on target, so a failure can be kept for later.
+const char *wxhttp_url(struct wxhttp *http, int target);
+
+#endif
@@ -0,0 +1,623 @@
+/*
+    Logging, see wxlog.h.
+
+    A record is the format pointer, the arguments as they came, and a
+    blob on the end that strings get copied into along with the bytes
+    for a hex dump.  The format gets gone over twice, once on the way in
+    to know what to take off the va_list, once on the way out to print
+    it, and both times by spec() so they can't disagree.  On the way out
+    every integer goes through as long long and every float as double,
+    which is what they were stored as.
+
+    The writer thread sleeps in poll() on a pipe for up to WXLOG_FLUSHMS
+    and empties every ring when it wakes.  Loggers only poke the pipe for
+    an error or a ring getting full, so the usual log call makes no
+    system call at all.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "wxlog.h"
+#include "wxring.h"
+
+#define WXLOG_MAXRINGS  4
+#define WXLOG_DEPTH     256     // records per ring
+#define WXLOG_RECORD    768     // bytes in one, all told
+#define WXLOG_FLUSHMS   100
+#define WXLOG_SECRETS   16
+#define WXLOG_LINE      4096
+
+union arg {
+    long long           i;
+    unsigned long long  u;
+    double              d;
+    const void *        p;
+};
+
+struct header {
+    const char *    fmt;
+    unsigned int    limited;
+    unsigned short  nargs;
+    unsigned short  used;       // of the blob
+    unsigned short  hexAt, hexLen;
+    unsigned short  dump;       // from wxlog_write_hex(), a line of its own
+    union arg       arg[WXLOG_MAXARGS];
+};
+
+struct record {
+    struct header   h;
+    char            blob[WXLOG_RECORD - sizeof(struct header)];
+};
+
+int wxlog_level = WXLOG_DEBUG;
+
+static struct wxring *_Atomic rings[WXLOG_MAXRINGS];
+static atomic_int nrings;
+static atomic_int running;
+static atomic_ulong direct, limited;
+static __thread struct wxring *mine;
+static __thread int noRing;
+
+static int logFd = 2;
+static int wake[2] = {-1, -1};
+static pthread_t writer;
+
+static pthread_mutex_t secretLock = PTHREAD_MUTEX_INITIALIZER;
+static char secrets[WXLOG_SECRETS][64];
+static int nsecrets;
+
+// Query parameters whose values never get written out
+static const char *hidden[] = {"password=", "passwd=", "pass=", "key=", "token=", "secret=", NULL};
+
+/*
+    One conversion, with f at its %.  *prefix is how much of it is the
+    flags, width and precision, *size the length modifier, h and l for
+    themselves, H for hh and q for ll.  Returns where it ends.
+*/
+static const char *spec(const char *f, int *prefix, char *size, char *conv)
+{
+    const char *p = f + 1;
+
+    p += strspn(p, "-+ #0'");
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.') {
+        p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    *prefix = p - f;
+    *size = 0;
+    if (*p && strchr("hlLjzt", *p)) {
+        *size = *p++;
+        if ((*size == 'h' || *size == 'l') && *p == *size) {
+            *size = *size == 'h' ? 'H' : 'q';
+            p++;
+        }
+    }
+    *conv = *p;
+    return *p ? p + 1 : p;
+}
+
+static void copyString(struct record *r, union arg *a, const char *s)
+{
+    size_t room = sizeof(r->blob) - r->h.used, n;
+
+    if (s == NULL)
+        s = "(null)";
+    n = strlen(s);
+    if (room == 0) {
+        a->u = sizeof(r->blob);     // the empty string at the end
+        return;
+    }
+    if (n >= room)
+        n = room - 1;
+    memcpy(r->blob + r->h.used, s, n);
+    r->blob[r->h.used + n] = '\0';
+    a->u = r->h.used;
+    r->h.used += n + 1;
+}
+
+// Take the arguments fmt says are there off ap
+static void capture(struct record *r, const char *fmt, va_list ap)
+{
+    const char *f = fmt;
+    union arg *a;
+    int prefix;
+    char size, conv;
+
+    r->h.fmt = fmt;
+    r->h.nargs = 0;
+    while ((f = strchr(f, '%')) != NULL && r->h.nargs < WXLOG_MAXARGS) {
+        if (f[1] == '%') {
+            f += 2;
+            continue;
+        }
+        f = spec(f, &prefix, &size, &conv);
+        a = &r->h.arg[r->h.nargs];
+        switch (conv) {
+            case 'd': case 'i':
+                switch (size) {
+                    case 'l': a->i = va_arg(ap, long); break;
+                    case 'q': a->i = va_arg(ap, long long); break;
+                    case 'j': a->i = va_arg(ap, intmax_t); break;
+                    case 'z': a->i = va_arg(ap, ssize_t); break;
+                    case 't': a->i = va_arg(ap, ptrdiff_t); break;
+                    default:  a->i = va_arg(ap, int); break;
+                }
+                break;
+            case 'o': case 'u': case 'x': case 'X': case 'c':
+                switch (size) {
+                    case 'l': a->u = va_arg(ap, unsigned long); break;
+                    case 'q': a->u = va_arg(ap, unsigned long long); break;
+                    case 'j': a->u = va_arg(ap, uintmax_t); break;
+                    case 'z': a->u = va_arg(ap, size_t); break;
+                    case 't': a->u = va_arg(ap, ptrdiff_t); break;
+                    default:  a->u = va_arg(ap, unsigned int); break;
+                }
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                a->d = size == 'L' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+                break;
+            case 's':
+                copyString(r, a, va_arg(ap, const char *));
+                break;
+            case 'p':
+                a->p = va_arg(ap, void *);
+                break;
+            default:
+                // Nothing we can keep the va_list straight past
+                return;
+        }
+        r->h.nargs++;
+    }
+}
+
+static size_t put(char *out, size_t size, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (len >= size)
+        return len;
+    va_start(ap, fmt);
+    n = vsnprintf(out + len, size - len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return len;
+    return len + n < size ? len + n : size - 1;
+}
+
+// The record the way printf would have had it
+static size_t format(const struct record *r, char *out, size_t size)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *bytes;
+    const char *f = r->h.fmt, *end;
+    const union arg *a;
+    char one[32];
+    size_t len = 0;
+    int n = 0, prefix, i;
+    char sz, conv;
+
+    while (*f && len < size - 1) {
+        if (*f != '%') {
+            out[len++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[len++] = '%';
+            f += 2;
+            continue;
+        }
+        end = spec(f, &prefix, &sz, &conv);
+        // Ran out of arguments, or the spec's no good; print it as it is
+        if (n >= r->h.nargs || prefix > (int)sizeof(one) - 4) {
+            while (f < end && len < size - 1)
+                out[len++] = *f++;
+            continue;
+        }
+        a = &r->h.arg[n++];
+        memcpy(one, f, prefix);
+        switch (conv) {
+            case 'd': case 'i':
+                snprintf(one + prefix, sizeof(one) - prefix, "ll%c", conv);
+                len = put(out, size, len, one, a->i);
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                snprintf(one + prefix, sizeof(one) - prefix, "ll%c", conv);
+                len = put(out, size, len, one, a->u);
+                break;
+            case 'c':
+                snprintf(one + prefix, sizeof(one) - prefix, "c");
+                len = put(out, size, len, one, (int)a->u);
+                break;
+            case 's':
+                snprintf(one + prefix, sizeof(one) - prefix, "s");
+                len = put(out, size, len, one, a->u < sizeof(r->blob) ? r->blob + a->u : "");
+                break;
+            case 'p':
+                snprintf(one + prefix, sizeof(one) - prefix, "p");
+                len = put(out, size, len, one, a->p);
+                break;
+            default:
+                snprintf(one + prefix, sizeof(one) - prefix, "%c", conv);
+                len = put(out, size, len, one, a->d);
+                break;
+        }
+        f = end;
+    }
+    bytes = (const unsigned char *)r->blob + r->h.hexAt;
+    for (i = 0; i < r->h.hexLen && len + 3 < size; i++) {
+        out[len++] = hex[bytes[i] >> 4];
+        out[len++] = hex[bytes[i] & 0x0f];
+        out[len++] = ' ';
+    }
+    if (r->h.dump && len) {
+        if (out[len - 1] == ' ')
+            len--;
+        out[len++] = '\n';
+    }
+    // Say how many were held back, at the end of the line if it has one
+    if (r->h.limited) {
+        if (len && out[len - 1] == '\n') {
+            len--;
+            len = put(out, size, len, " [%u more held back]\n", r->h.limited);
+        } else
+            len = put(out, size, len, " [%u more held back]", r->h.limited);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static int hiddenAt(const char *s, size_t at)
+{
+    int i;
+
+    if (!strchr("pPkKtTsS", s[at]) || (at > 0 && !strchr("?&; ", s[at - 1])))
+        return 0;
+    for (i = 0; hidden[i]; i++)
+        if (strncasecmp(s + at, hidden[i], strlen(hidden[i])) == 0)
+            return strlen(hidden[i]);
+    return 0;
+}
+
+// in to out with the passwords taken out.  Returns out's length.  A
+// password can come out longer than it went in, so a line that doesn't
+// fit any more stops where it got to.
+static size_t redact(const char *in, size_t n, char *out, size_t size)
+{
+    size_t i = 0, len = 0, k = 0;
+    int j, name;
+
+    pthread_mutex_lock(&secretLock);
+    while (i < n && len + 1 < size) {
+        if ((name = hiddenAt(in, i)) > 0) {
+            if (len + name + 4 >= size)
+                break;
+            memcpy(out + len, in + i, name);
+            len += name;
+            i += name;
+            memcpy(out + len, "****", 4);
+            len += 4;
+            while (i < n && !strchr("&; \n\r\t", in[i]))
+                i++;
+            continue;
+        }
+        for (j = 0; j < nsecrets; j++) {
+            k = strlen(secrets[j]);
+            if (in[i] == secrets[j][0] && strncmp(in + i, secrets[j], k) == 0)
+                break;
+        }
+        if (j < nsecrets) {
+            if (len + 4 >= size)
+                break;
+            memcpy(out + len, "****", 4);
+            len += 4;
+            i += k;
+            continue;
+        }
+        out[len++] = in[i++];
+    }
+    pthread_mutex_unlock(&secretLock);
+    // Cut short, it still ends the line so the next one starts its own
+    if (i < n && len > 0 && in[n - 1] == '\n')
+        out[len - 1] = '\n';
+    out[len] = '\0';
+    return len;
+}
+
+static void writeAll(const char *buf, size_t n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+        w = write(logFd, buf, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return;
+        buf += w;
+        n -= w;
+    }
+}
+
+// Format and write one record out right now
+static void writeNow(const struct record *r)
+{
+    char line[WXLOG_LINE], clean[WXLOG_LINE];
+    size_t n;
+
+    n = format(r, line, sizeof(line));
+    writeAll(clean, redact(line, n, clean, sizeof(clean)));
+}
+
+static struct wxring *myRing(void)
+{
+    struct wxring *ring;
+    int i;
+
+    if (mine || noRing)
+        return mine;
+    i = atomic_fetch_add(&nrings, 1);
+    if (i >= WXLOG_MAXRINGS || (ring = wxring_new(sizeof(struct record), WXLOG_DEPTH)) == NULL) {
+        noRing = 1;
+        return NULL;
+    }
+    atomic_store_explicit(&rings[i], ring, memory_order_release);
+    mine = ring;
+    return ring;
+}
+
+static long long nowMs(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int allowed(struct wxlog_site *site)
+{
+    long long now = nowMs(), back = (now - site->refill) / WXLOG_EVERY;
+
+    if (back > 0) {
+        site->tokens = back >= WXLOG_BURST - site->tokens ? WXLOG_BURST : site->tokens + back;
+        site->refill = site->refill && back < WXLOG_BURST ? site->refill + back * WXLOG_EVERY : now;
+    }
+    if (site->tokens <= 0) {
+        site->limited++;
+        atomic_fetch_add_explicit(&limited, 1, memory_order_relaxed);
+        return 0;
+    }
+    site->tokens--;
+    return 1;
+}
+
+static void submit(struct record *r, int level)
+{
+    struct wxring *ring = atomic_load_explicit(&running, memory_order_acquire) ? myRing() : NULL;
+    char b = 0;
+
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&direct, 1, memory_order_relaxed);
+        writeNow(r);
+        return;
+    }
+    if (wxring_push(ring, r) < 0)
+        return;
+    if (level == WXLOG_ERROR || wxring_depth(ring) >= WXLOG_DEPTH / 2)
+        if (write(wake[1], &b, 1) < 0)
+            ;
+}
+
+void wxlog_write(struct wxlog_site *site, int level, const char *fmt, ...)
+{
+    struct record r;
+    va_list ap;
+
+    if (!allowed(site))
+        return;
+    r.h.used = r.h.hexAt = r.h.hexLen = r.h.dump = 0;
+    r.h.limited = site->limited;
+    site->limited = 0;
+    va_start(ap, fmt);
+    capture(&r, fmt, ap);
+    va_end(ap);
+    submit(&r, level);
+}
+
+void wxlog_write_hex(struct wxlog_site *site, int level, const void *data, int len, const char *fmt, ...)
+{
+    struct record r;
+    va_list ap;
+    size_t room;
+
+    if (!allowed(site))
+        return;
+    r.h.used = 0;
+    r.h.dump = 1;
+    r.h.limited = site->limited;
+    site->limited = 0;
+    va_start(ap, fmt);
+    capture(&r, fmt, ap);
+    va_end(ap);
+    room = sizeof(r.blob) - r.h.used;
+    if (len < 0)
+        len = 0;
+    r.h.hexAt = r.h.used;
+    r.h.hexLen = (size_t)len < room ? (size_t)len : room;
+    memcpy(r.blob + r.h.hexAt, data, r.h.hexLen);
+    r.h.used += r.h.hexLen;
+    submit(&r, level);
+}
+
+// Everything that's waiting, out in as few writes as it'll go in
+static void drain(void)
+{
+    static char out[4 * WXLOG_LINE];
+    static unsigned long seenDropped[WXLOG_MAXRINGS];
+    char line[WXLOG_LINE];
+    struct wxring_stats stats;
+    struct wxring *ring;
+    struct record r;
+    size_t len = 0, n;
+    int i, count = atomic_load(&nrings);
+
+    if (count > WXLOG_MAXRINGS)
+        count = WXLOG_MAXRINGS;
+    for (i = 0; i < count; i++) {
+        ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (ring == NULL)
+            continue;
+        while (wxring_pop(ring, &r) == 0) {
+            n = format(&r, line, sizeof(line));
+            if (len + n + 5 > sizeof(out)) {
+                writeAll(out, len);
+                len = 0;
+            }
+            len += redact(line, n, out + len, sizeof(out) - len);
+        }
+        wxring_get_stats(ring, &stats);
+        if (stats.dropped != seenDropped[i]) {
+            n = snprintf(line, sizeof(line), "%lu log messages lost, the ring was full\n",
+                         stats.dropped - seenDropped[i]);
+            seenDropped[i] = stats.dropped;
+            if (len + n > sizeof(out)) {
+                writeAll(out, len);
+                len = 0;
+            }
+            memcpy(out + len, line, n);
+            len += n;
+        }
+    }
+    writeAll(out, len);
+}
+
+static void *writerThread(void *arg)
+{
+    struct pollfd pfd;
+    char buf[64];
+
+    pfd.fd = wake[0];
+    pfd.events = POLLIN;
+    while (atomic_load(&running)) {
+        if (poll(&pfd, 1, WXLOG_FLUSHMS) > 0)
+            while (read(wake[0], buf, sizeof(buf)) > 0)
+                ;
+        drain();
+    }
+    return NULL;
+}
+
+int wxlog_start(int fd)
+{
+    sigset_t all, old;
+    int rc;
+
+    if (atomic_load(&running))
+        return 0;
+    logFd = fd;
+    if (pipe(wake) < 0)
+        return -1;
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake[1], F_SETFD, FD_CLOEXEC);
+    atomic_store(&running, 1);
+    // This starts before the loop blocks the signals it wants, so the
+    // thread has to block them itself or a ^C lands here and kills us
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rc = pthread_create(&writer, NULL, writerThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        atomic_store(&running, 0);
+        close(wake[0]);
+        close(wake[1]);
+        return -1;
+    }
+    return 0;
+}
+
+void wxlog_stop(void)
+{
+    char b = 0;
+    int i;
+
+    if (!atomic_exchange(&running, 0))
+        return;
+    if (write(wake[1], &b, 1) < 0)
+        ;
+    pthread_join(writer, NULL);
+    // Whatever got in before running went to 0
+    drain();
+    close(wake[0]);
+    close(wake[1]);
+    for (i = 0; i < WXLOG_MAXRINGS; i++)
+        wxring_free(atomic_exchange(&rings[i], NULL));
+}
+
+int wxlog_parse_level(const char *name)
+{
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+void wxlog_secret(const char *secret)
+{
+    int i;
+
+    // Anything shorter would blank half the log
+    if (secret == NULL || strlen(secret) < 4 || strlen(secret) >= sizeof(secrets[0]))
+        return;
+    pthread_mutex_lock(&secretLock);
+    for (i = 0; i < nsecrets; i++)
+        if (strcmp(secrets[i], secret) == 0)
+            break;
+    if (i == nsecrets && nsecrets < WXLOG_SECRETS)
+        strcpy(secrets[nsecrets++], secret);
+    pthread_mutex_unlock(&secretLock);
+}
+
+void wxlog_get_stats(struct wxlog_stats *stats)
+{
+    struct wxring_stats rs;
+    struct wxring *ring;
+    int i;
+
+    stats->logged = atomic_load(&direct);
+    stats->dropped = 0;
+    stats->limited = atomic_load(&limited);
+    for (i = 0; i < WXLOG_MAXRINGS; i++) {
+        ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (ring == NULL)
+            continue;
+        wxring_get_stats(ring, &rs);
+        stats->logged += rs.pushed;
+        stats->dropped += rs.dropped;
+    }
+}
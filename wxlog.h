@@ -0,0 +1,90 @@
+/*
+    Logging, off the loop.
+
+    stderr is unbuffered, so every fprintf to it was a write(), one per
+    byte of every hex dump, and on the Pi's serial console or an SD card
+    those were the slowest thing the daemon did.  Now a log call doesn't
+    format anything or make a system call.  It copies the format
+    pointer and the arguments into a record, strings and all, on a ring
+    belonging to the calling thread (wxring.h).  A thread of its own
+    does the formatting and writes out a whole ring's worth at a time.
+
+    Each call has a level.  Anything above WXLOG_MAXLEVEL isn't compiled
+    in at all, and anything above wxlog_level is a load and a branch.
+    Each place that logs can go WXLOG_BURST times in a row and then once
+    every WXLOG_EVERY ms, so something failing in a tight loop doesn't
+    fill the log; the next one that goes out says how many didn't.
+
+    Nothing in the log says what a password is.  Anything that looks
+    like password=, key= or the like in a URL has its value blanked,
+    and so does anything handed to wxlog_secret().
+
+    The formats are printf's, checked by the compiler, except that
+    there's no * for the width or precision and at most WXLOG_MAXARGS
+    arguments.  A string that doesn't fit in what's left of the record
+    is cut short.  Before wxlog_start(), after wxlog_stop(), or on a
+    thread that couldn't get a ring, it's formatted and written right
+    there the way it always was.
+*/
+#ifndef WXLOG_H
+#define WXLOG_H
+
+enum { WXLOG_ERROR, WXLOG_WARN, WXLOG_INFO, WXLOG_DEBUG };
+
+// -DWXLOG_MAXLEVEL=WXLOG_INFO and there's no debug logging in the binary
+#ifndef WXLOG_MAXLEVEL
+#define WXLOG_MAXLEVEL  WXLOG_DEBUG
+#endif
+
+#define WXLOG_MAXARGS   12
+#define WXLOG_BURST     20
+#define WXLOG_EVERY     1000
+
+extern int wxlog_level;
+
+// One for each place that logs, for its rate limit.  Two threads
+// logging from the same place can miscount it a little.
+struct wxlog_site {
+    int             tokens;
+    long long       refill;     // ms, when it last got one back
+    unsigned int    limited;    // held back since the last one went out
+};
+
+struct wxlog_stats {
+    unsigned long   logged;     // made it onto a ring, or out directly
+    unsigned long   dropped;    // the ring was full
+    unsigned long   limited;    // held back by the rate limit
+};
+
+#define WXLOG_AT(lvl, call) do { \
+        static struct wxlog_site wxlogSite = {WXLOG_BURST, 0, 0}; \
+        if ((lvl) <= WXLOG_MAXLEVEL && (lvl) <= wxlog_level) \
+            call; \
+    } while (0)
+
+#define wxlog_error(...)    WXLOG_AT(WXLOG_ERROR, wxlog_write(&wxlogSite, WXLOG_ERROR, __VA_ARGS__))
+#define wxlog_warn(...)     WXLOG_AT(WXLOG_WARN, wxlog_write(&wxlogSite, WXLOG_WARN, __VA_ARGS__))
+#define wxlog_info(...)     WXLOG_AT(WXLOG_INFO, wxlog_write(&wxlogSite, WXLOG_INFO, __VA_ARGS__))
+#define wxlog_debug(...)    WXLOG_AT(WXLOG_DEBUG, wxlog_write(&wxlogSite, WXLOG_DEBUG, __VA_ARGS__))
+// The formatted message followed by len bytes of data in hex, and the
+// end of the line
+#define wxlog_hex(lvl, data, len, ...) \
+    WXLOG_AT(lvl, wxlog_write_hex(&wxlogSite, lvl, data, len, __VA_ARGS__))
+
+// Start the thread writing to fd.  Returns 0, or -1 and everything's
+// written directly.
+int wxlog_start(int fd);
+// Write out what's waiting and stop the thread.  Fine to call twice.
+void wxlog_stop(void);
+// error, warn, info or debug.  Returns -1 for anything else.
+int wxlog_parse_level(const char *name);
+// Never write this out, whatever it turns up in
+void wxlog_secret(const char *secret);
+void wxlog_get_stats(struct wxlog_stats *stats);
+
+void wxlog_write(struct wxlog_site *site, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+void wxlog_write_hex(struct wxlog_site *site, int level, const void *data, int len, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+#endif
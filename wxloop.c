@@ -0,0 +1,515 @@
+/*
+    Event loop used by weatherstation.c, see wxloop.h for the why.
+
+    Handlers live in fixed size tables inside the loop so nothing is
+    allocated once the loop is built.  There are only a handful of file
+    descriptors in this program (libusb's, a few timers, a socket or two),
+    so a linear search on the rare add/remove is plenty fast.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#if __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "wxloop.h"
+#include "wxlog.h"
+
+struct wxio {
+    int             fd;
+    int             events;
+    wxloop_io_fn    fn;
+    void *          arg;
+};
+
+struct wxtimer {
+    int             used;
+    wxloop_timer_fn fn;
+    void *          arg;
+    struct wxloop * loop;
+#if __linux__
+    int             fd;
+#else
+    long long       deadline;   // 0 when not armed
+    long            interval;
+#endif
+};
+
+struct wxsig {
+    int              signo;
+    wxloop_signal_fn fn;
+    void *           arg;
+};
+
+struct wxloop {
+    volatile int    running;
+    struct wxio     io[WXLOOP_MAXIO];
+    struct wxtimer  timer[WXLOOP_MAXTIMER];
+    struct wxsig    sig[WXLOOP_MAXSIG];
+    int             nsig;
+#if __linux__
+    int             epfd;
+    int             sigfd;
+    sigset_t        sigmask;
+#else
+    int             sigpipe[2];
+#endif
+};
+
+long long wxloop_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct wxio *findIo(struct wxloop *loop, int fd)
+{
+    int i;
+    for (i = 0; i < WXLOOP_MAXIO; i++)
+        if (loop->io[i].fn != NULL && loop->io[i].fd == fd)
+            return &loop->io[i];
+    return NULL;
+}
+
+static void dispatchSignal(struct wxloop *loop, int signo)
+{
+    int i;
+    for (i = 0; i < loop->nsig; i++)
+        if (loop->sig[i].signo == signo)
+            loop->sig[i].fn(signo, loop->sig[i].arg);
+}
+
+#if __linux__
+
+static uint32_t toEpoll(int events)
+{
+    uint32_t ev = 0;
+    if (events & WXLOOP_READ)  ev |= EPOLLIN;
+    if (events & WXLOOP_WRITE) ev |= EPOLLOUT;
+    return ev;
+}
+
+struct wxloop *wxloop_new(void)
+{
+    struct wxloop *loop = calloc(1, sizeof(struct wxloop));
+    int i;
+
+    if (loop == NULL)
+        return NULL;
+    for (i = 0; i < WXLOOP_MAXIO; i++)
+        loop->io[i].fd = -1;
+    for (i = 0; i < WXLOOP_MAXTIMER; i++)
+        loop->timer[i].fd = -1;
+    loop->sigfd = -1;
+    sigemptyset(&loop->sigmask);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void wxloop_free(struct wxloop *loop)
+{
+    int i;
+
+    if (loop == NULL)
+        return;
+    for (i = 0; i < WXLOOP_MAXTIMER; i++)
+        if (loop->timer[i].fd >= 0)
+            close(loop->timer[i].fd);
+    if (loop->sigfd >= 0)
+        close(loop->sigfd);
+    close(loop->epfd);
+    free(loop);
+}
+
+int wxloop_add_io(struct wxloop *loop, int fd, int events, wxloop_io_fn fn, void *arg)
+{
+    struct epoll_event ev;
+    int i;
+
+    for (i = 0; i < WXLOOP_MAXIO; i++)
+        if (loop->io[i].fn == NULL)
+            break;
+    if (i == WXLOOP_MAXIO)
+        return -1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(events);
+    ev.data.ptr = &loop->io[i];
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+    loop->io[i].fd = fd;
+    loop->io[i].events = events;
+    loop->io[i].fn = fn;
+    loop->io[i].arg = arg;
+    return 0;
+}
+
+int wxloop_mod_io(struct wxloop *loop, int fd, int events)
+{
+    struct wxio *io = findIo(loop, fd);
+    struct epoll_event ev;
+
+    if (io == NULL)
+        return -1;
+    if (io->events == events)
+        return 0;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(events);
+    ev.data.ptr = io;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        return -1;
+    io->events = events;
+    return 0;
+}
+
+int wxloop_del_io(struct wxloop *loop, int fd)
+{
+    struct wxio *io = findIo(loop, fd);
+
+    if (io == NULL)
+        return -1;
+    // The fd may already be closed, in which case epoll dropped it already
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    io->fn = NULL;
+    io->fd = -1;
+    return 0;
+}
+
+static void timerReady(int fd, int events, void *arg)
+{
+    struct wxtimer *t = arg;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    // If we fell behind by more than one period just run once, the
+    // callbacks all sample "now" rather than catching up.
+    t->fn((int)(t - t->loop->timer), t->arg);
+}
+
+int wxloop_add_timer(struct wxloop *loop, wxloop_timer_fn fn, void *arg)
+{
+    int i, fd;
+
+    for (i = 0; i < WXLOOP_MAXTIMER; i++)
+        if (!loop->timer[i].used)
+            break;
+    if (i == WXLOOP_MAXTIMER)
+        return -1;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    loop->timer[i].used = 1;
+    loop->timer[i].fn = fn;
+    loop->timer[i].arg = arg;
+    loop->timer[i].loop = loop;
+    loop->timer[i].fd = fd;
+    if (wxloop_add_io(loop, fd, WXLOOP_READ, timerReady, &loop->timer[i]) < 0) {
+        close(fd);
+        loop->timer[i].used = 0;
+        loop->timer[i].fd = -1;
+        return -1;
+    }
+    return i;
+}
+
+int wxloop_arm_timer(struct wxloop *loop, int id, long first_ms, long interval_ms)
+{
+    struct itimerspec its;
+
+    if (id < 0 || id >= WXLOOP_MAXTIMER || !loop->timer[id].used)
+        return -1;
+    its.it_value.tv_sec = first_ms / 1000;
+    its.it_value.tv_nsec = (first_ms % 1000) * 1000000;
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    return timerfd_settime(loop->timer[id].fd, 0, &its, NULL);
+}
+
+static void signalReady(int fd, int events, void *arg)
+{
+    struct wxloop *loop = arg;
+    struct signalfd_siginfo si;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si))
+        dispatchSignal(loop, (int)si.ssi_signo);
+}
+
+int wxloop_add_signal(struct wxloop *loop, int signo, wxloop_signal_fn fn, void *arg)
+{
+    int fd;
+
+    if (loop->nsig == WXLOOP_MAXSIG)
+        return -1;
+    sigaddset(&loop->sigmask, signo);
+    if (sigprocmask(SIG_BLOCK, &loop->sigmask, NULL) < 0)
+        return -1;
+    fd = signalfd(loop->sigfd, &loop->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (loop->sigfd < 0) {
+        loop->sigfd = fd;
+        if (wxloop_add_io(loop, fd, WXLOOP_READ, signalReady, loop) < 0)
+            return -1;
+    }
+    loop->sig[loop->nsig].signo = signo;
+    loop->sig[loop->nsig].fn = fn;
+    loop->sig[loop->nsig].arg = arg;
+    loop->nsig++;
+    return 0;
+}
+
+int wxloop_run(struct wxloop *loop)
+{
+    struct epoll_event ev[16];
+    int n, i, events;
+
+    loop->running = 1;
+    while (loop->running) {
+        n = epoll_wait(loop->epfd, ev, 16, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            wxlog_error("epoll_wait, %s\n", strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < n && loop->running; i++) {
+            struct wxio *io = ev[i].data.ptr;
+            // removed by an earlier callback in this same batch
+            if (io->fn == NULL)
+                continue;
+            events = 0;
+            if (ev[i].events & EPOLLIN)  events |= WXLOOP_READ;
+            if (ev[i].events & EPOLLOUT) events |= WXLOOP_WRITE;
+            if (ev[i].events & (EPOLLERR | EPOLLHUP)) events |= WXLOOP_ERROR;
+            io->fn(io->fd, events, io->arg);
+        }
+    }
+    return 0;
+}
+
+#else   // poll() fallback
+
+static int sigpipeWrite = -1;
+
+static void sigToPipe(int signo)
+{
+    unsigned char b = (unsigned char)signo;
+    int saved = errno;
+    // write() is async signal safe, which is all we do in here
+    if (write(sigpipeWrite, &b, 1) < 0)
+        ;
+    errno = saved;
+}
+
+static void signalReady(int fd, int events, void *arg)
+{
+    struct wxloop *loop = arg;
+    unsigned char b;
+
+    while (read(fd, &b, 1) == 1)
+        dispatchSignal(loop, (int)b);
+}
+
+struct wxloop *wxloop_new(void)
+{
+    struct wxloop *loop = calloc(1, sizeof(struct wxloop));
+    int i;
+
+    if (loop == NULL)
+        return NULL;
+    for (i = 0; i < WXLOOP_MAXIO; i++)
+        loop->io[i].fd = -1;
+    loop->sigpipe[0] = loop->sigpipe[1] = -1;
+    return loop;
+}
+
+void wxloop_free(struct wxloop *loop)
+{
+    if (loop == NULL)
+        return;
+    if (loop->sigpipe[0] >= 0) {
+        close(loop->sigpipe[0]);
+        close(loop->sigpipe[1]);
+    }
+    free(loop);
+}
+
+int wxloop_add_io(struct wxloop *loop, int fd, int events, wxloop_io_fn fn, void *arg)
+{
+    int i;
+
+    for (i = 0; i < WXLOOP_MAXIO; i++)
+        if (loop->io[i].fn == NULL)
+            break;
+    if (i == WXLOOP_MAXIO)
+        return -1;
+    loop->io[i].fd = fd;
+    loop->io[i].events = events;
+    loop->io[i].fn = fn;
+    loop->io[i].arg = arg;
+    return 0;
+}
+
+int wxloop_mod_io(struct wxloop *loop, int fd, int events)
+{
+    struct wxio *io = findIo(loop, fd);
+
+    if (io == NULL)
+        return -1;
+    io->events = events;
+    return 0;
+}
+
+int wxloop_del_io(struct wxloop *loop, int fd)
+{
+    struct wxio *io = findIo(loop, fd);
+
+    if (io == NULL)
+        return -1;
+    io->fn = NULL;
+    io->fd = -1;
+    return 0;
+}
+
+int wxloop_add_timer(struct wxloop *loop, wxloop_timer_fn fn, void *arg)
+{
+    int i;
+
+    for (i = 0; i < WXLOOP_MAXTIMER; i++)
+        if (!loop->timer[i].used)
+            break;
+    if (i == WXLOOP_MAXTIMER)
+        return -1;
+    loop->timer[i].used = 1;
+    loop->timer[i].fn = fn;
+    loop->timer[i].arg = arg;
+    loop->timer[i].loop = loop;
+    loop->timer[i].deadline = 0;
+    loop->timer[i].interval = 0;
+    return i;
+}
+
+int wxloop_arm_timer(struct wxloop *loop, int id, long first_ms, long interval_ms)
+{
+    if (id < 0 || id >= WXLOOP_MAXTIMER || !loop->timer[id].used)
+        return -1;
+    loop->timer[id].deadline = first_ms ? wxloop_now_ms() + first_ms : 0;
+    loop->timer[id].interval = interval_ms;
+    return 0;
+}
+
+int wxloop_add_signal(struct wxloop *loop, int signo, wxloop_signal_fn fn, void *arg)
+{
+    struct sigaction sa;
+
+    if (loop->nsig == WXLOOP_MAXSIG)
+        return -1;
+    if (loop->sigpipe[0] < 0) {
+        if (pipe(loop->sigpipe) < 0)
+            return -1;
+        fcntl(loop->sigpipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(loop->sigpipe[1], F_SETFL, O_NONBLOCK);
+        sigpipeWrite = loop->sigpipe[1];
+        if (wxloop_add_io(loop, loop->sigpipe[0], WXLOOP_READ, signalReady, loop) < 0)
+            return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigToPipe;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(signo, &sa, NULL) < 0)
+        return -1;
+    loop->sig[loop->nsig].signo = signo;
+    loop->sig[loop->nsig].fn = fn;
+    loop->sig[loop->nsig].arg = arg;
+    loop->nsig++;
+    return 0;
+}
+
+int wxloop_run(struct wxloop *loop)
+{
+    struct pollfd pfd[WXLOOP_MAXIO];
+    struct wxio *map[WXLOOP_MAXIO];
+    long long now, next;
+    int n, i, nfds, timeout, events;
+
+    loop->running = 1;
+    while (loop->running) {
+        nfds = 0;
+        for (i = 0; i < WXLOOP_MAXIO; i++) {
+            if (loop->io[i].fn == NULL)
+                continue;
+            pfd[nfds].fd = loop->io[i].fd;
+            pfd[nfds].events = 0;
+            if (loop->io[i].events & WXLOOP_READ)  pfd[nfds].events |= POLLIN;
+            if (loop->io[i].events & WXLOOP_WRITE) pfd[nfds].events |= POLLOUT;
+            pfd[nfds].revents = 0;
+            map[nfds++] = &loop->io[i];
+        }
+        next = 0;
+        for (i = 0; i < WXLOOP_MAXTIMER; i++)
+            if (loop->timer[i].used && loop->timer[i].deadline &&
+                (next == 0 || loop->timer[i].deadline < next))
+                next = loop->timer[i].deadline;
+        timeout = -1;
+        if (next) {
+            now = wxloop_now_ms();
+            timeout = next > now ? (int)(next - now) : 0;
+        }
+
+        n = poll(pfd, nfds, timeout);
+        if (n < 0 && errno != EINTR) {
+            wxlog_error("poll, %s\n", strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < nfds && n > 0 && loop->running; i++) {
+            if (pfd[i].revents == 0 || map[i]->fn == NULL || map[i]->fd != pfd[i].fd)
+                continue;
+            events = 0;
+            if (pfd[i].revents & POLLIN)  events |= WXLOOP_READ;
+            if (pfd[i].revents & POLLOUT) events |= WXLOOP_WRITE;
+            if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) events |= WXLOOP_ERROR;
+            map[i]->fn(map[i]->fd, events, map[i]->arg);
+        }
+
+        now = wxloop_now_ms();
+        for (i = 0; i < WXLOOP_MAXTIMER && loop->running; i++) {
+            struct wxtimer *t = &loop->timer[i];
+            if (!t->used || t->deadline == 0 || t->deadline > now)
+                continue;
+            // Step the deadline forward from where it was supposed to be,
+            // not from now, so we don't drift.
+            if (t->interval) {
+                while (t->deadline <= now)
+                    t->deadline += t->interval;
+            }
+            else
+                t->deadline = 0;
+            t->fn(i, t->arg);
+        }
+    }
+    return 0;
+}
+
+#endif
+
+void wxloop_stop(struct wxloop *loop)
+{
+    loop->running = 0;
+}
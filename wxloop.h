@@ -0,0 +1,57 @@
+/*
+    A small single-threaded event loop for the weatherstation daemon.
+
+    On Linux this is epoll with one timerfd per interval timer and a
+    signalfd for the signals we care about.  Everywhere else (the Mac in
+    the closet) it falls back to poll() with the timer deadlines kept in
+    the loop and a self-pipe for signals.  Either way nothing wakes up
+    unless a file descriptor is ready or a deadline has arrived.
+
+    Timers are periodic and measured against the monotonic clock, so the
+    time spent doing work in a callback doesn't push the next one back.
+*/
+#ifndef WXLOOP_H
+#define WXLOOP_H
+
+#define WXLOOP_READ     0x01
+#define WXLOOP_WRITE    0x02
+#define WXLOOP_ERROR    0x04
+
+#define WXLOOP_MAXIO    64
+#define WXLOOP_MAXTIMER 32
+#define WXLOOP_MAXSIG   8
+
+struct wxloop;
+
+typedef void (*wxloop_io_fn)(int fd, int events, void *arg);
+typedef void (*wxloop_timer_fn)(int id, void *arg);
+typedef void (*wxloop_signal_fn)(int signo, void *arg);
+
+struct wxloop *wxloop_new(void);
+void wxloop_free(struct wxloop *loop);
+
+// Watch fd for WXLOOP_READ and/or WXLOOP_WRITE.  One callback per fd.
+int wxloop_add_io(struct wxloop *loop, int fd, int events, wxloop_io_fn fn, void *arg);
+int wxloop_mod_io(struct wxloop *loop, int fd, int events);
+int wxloop_del_io(struct wxloop *loop, int fd);
+
+// Create a timer.  It does nothing until it is armed.  Returns the timer
+// id, or -1 if we are out of slots.
+int wxloop_add_timer(struct wxloop *loop, wxloop_timer_fn fn, void *arg);
+// first_ms is the delay to the first expiry, interval_ms the period after
+// that (0 for a one shot).  first_ms of 0 disarms the timer.
+int wxloop_arm_timer(struct wxloop *loop, int id, long first_ms, long interval_ms);
+
+// Deliver signo through the loop instead of an asynchronous handler.
+// On Linux the signal gets blocked, so call this before starting any
+// threads so they inherit the mask.
+int wxloop_add_signal(struct wxloop *loop, int signo, wxloop_signal_fn fn, void *arg);
+
+// Run until wxloop_stop() is called.  Returns 0, or -1 if waiting failed.
+int wxloop_run(struct wxloop *loop);
+void wxloop_stop(struct wxloop *loop);
+
+// Monotonic milliseconds, for anyone who needs to measure things.
+long long wxloop_now_ms(void);
+
+#endif
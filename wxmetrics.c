@@ -0,0 +1,422 @@
+/*
+    Metrics, see wxmetrics.h.
+
+    A counter takes one slot in every shard.  A histogram takes one per
+    bucket, counted as they land and only made cumulative for the
+    scrape, plus one for the sum in microseconds; its count is the
+    total of its buckets.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "wxmetrics.h"
+
+#define MAXSLOTS    (WXMETRICS_MAXSERIES * 4)
+#define REQUESTMAX  1024
+
+static const unsigned long bucketUs[WXMETRICS_BUCKETS - 1] = {
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 10000000
+};
+static const char *bucketLe[WXMETRICS_BUCKETS] = {
+    "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1", "0.25", "0.5", "1", "2.5", "10", "+Inf"
+};
+
+struct series {
+    const char *    name;
+    const char *    labels;
+    const char *    help;
+    int             histogram;
+    int             slot;       // first of its slots in the shards
+};
+
+struct wxmetrics_shard {
+    atomic_ulong    v[MAXSLOTS];
+};
+
+struct conn {
+    struct wxmetrics *  m;
+    int                 fd;
+    char                in[REQUESTMAX];
+    size_t              inLen;
+    char *              out;
+    size_t              outLen;
+    size_t              outDone;
+};
+
+struct wxmetrics {
+    struct series       series[WXMETRICS_MAXSERIES];
+    int                 nseries;
+    int                 nslots;
+    struct wxmetrics_shard *shards[WXMETRICS_MAXSHARDS];
+    int                 nshards;
+    struct wxloop *     loop;
+    int                 listenFd;
+    wxmetrics_gauge_fn  gauges;
+    void *              gaugeArg;
+    struct conn         conns[WXMETRICS_MAXCONN];
+};
+
+struct wxmetrics_page {
+    char *  buf;
+    size_t  len;
+    size_t  cap;
+    int     failed;     // ran out of memory somewhere along the way
+};
+
+struct wxmetrics *wxmetrics_new(void)
+{
+    struct wxmetrics *m = calloc(1, sizeof(struct wxmetrics));
+    int i;
+
+    if (m == NULL)
+        return NULL;
+    m->listenFd = -1;
+    for (i = 0; i < WXMETRICS_MAXCONN; i++)
+        m->conns[i].fd = -1;
+    return m;
+}
+
+static void closeConn(struct conn *c)
+{
+    if (c->fd < 0)
+        return;
+    wxloop_del_io(c->m->loop, c->fd);
+    close(c->fd);
+    c->fd = -1;
+    free(c->out);
+    c->out = NULL;
+}
+
+void wxmetrics_free(struct wxmetrics *m)
+{
+    int i;
+
+    if (m == NULL)
+        return;
+    for (i = 0; i < WXMETRICS_MAXCONN; i++)
+        closeConn(&m->conns[i]);
+    if (m->listenFd >= 0) {
+        wxloop_del_io(m->loop, m->listenFd);
+        close(m->listenFd);
+    }
+    for (i = 0; i < m->nshards; i++)
+        free(m->shards[i]);
+    free(m);
+}
+
+static int addSeries(struct wxmetrics *m, const char *name, const char *labels,
+                     const char *help, int histogram)
+{
+    int slots = histogram ? WXMETRICS_BUCKETS + 1 : 1;
+    struct series *s;
+
+    // Shards handed out already don't have room for more
+    if (m->nseries == WXMETRICS_MAXSERIES || m->nslots + slots > MAXSLOTS || m->nshards)
+        return -1;
+    s = &m->series[m->nseries];
+    s->name = name;
+    s->labels = labels;
+    s->help = help;
+    s->histogram = histogram;
+    s->slot = m->nslots;
+    m->nslots += slots;
+    m->nseries++;
+    // The id is where it lives in the shards
+    return s->slot;
+}
+
+int wxmetrics_counter(struct wxmetrics *m, const char *name, const char *labels, const char *help)
+{
+    return addSeries(m, name, labels, help, 0);
+}
+
+int wxmetrics_histogram(struct wxmetrics *m, const char *name, const char *labels, const char *help)
+{
+    return addSeries(m, name, labels, help, 1);
+}
+
+struct wxmetrics_shard *wxmetrics_shard(struct wxmetrics *m)
+{
+    struct wxmetrics_shard *shard;
+    int i;
+
+    if (m == NULL || m->nshards == WXMETRICS_MAXSHARDS)
+        return NULL;
+    shard = malloc(sizeof(struct wxmetrics_shard));
+    if (shard == NULL)
+        return NULL;
+    for (i = 0; i < MAXSLOTS; i++)
+        atomic_init(&shard->v[i], 0);
+    m->shards[m->nshards++] = shard;
+    return shard;
+}
+
+// Only the shard's own thread writes to it, so there's no need for an
+// atomic add, just a store the scrape can't see half of.
+static inline void bump(struct wxmetrics_shard *shard, int slot, unsigned long n)
+{
+    atomic_store_explicit(&shard->v[slot],
+        atomic_load_explicit(&shard->v[slot], memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+static inline unsigned long total(struct wxmetrics *m, int slot)
+{
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < m->nshards; i++)
+        sum += atomic_load_explicit(&m->shards[i]->v[slot], memory_order_relaxed);
+    return sum;
+}
+
+void wxmetrics_add(struct wxmetrics_shard *shard, int id, unsigned long n)
+{
+    if (shard == NULL || id < 0)
+        return;
+    bump(shard, id, n);
+}
+
+void wxmetrics_observe(struct wxmetrics_shard *shard, int id, unsigned long us)
+{
+    int b;
+
+    if (shard == NULL || id < 0)
+        return;
+    for (b = 0; b < WXMETRICS_BUCKETS - 1 && us > bucketUs[b]; b++)
+        ;
+    bump(shard, id + b, 1);
+    bump(shard, id + WXMETRICS_BUCKETS, us);
+}
+
+uint64_t wxmetrics_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+    Putting the page together
+*/
+static void put(struct wxmetrics_page *page, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *bigger;
+    int n;
+
+    if (page->failed)
+        return;
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(page->buf + page->len, page->cap - page->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            page->failed = 1;
+            return;
+        }
+        need = page->len + n + 1;
+        if (need <= page->cap)
+            break;
+        bigger = realloc(page->buf, need * 2);
+        if (bigger == NULL) {
+            page->failed = 1;
+            return;
+        }
+        page->buf = bigger;
+        page->cap = need * 2;
+    }
+    page->len += n;
+}
+
+void wxmetrics_help(struct wxmetrics_page *page, const char *name, const char *type, const char *help)
+{
+    put(page, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// name{labels}, or just name when there aren't any
+#define LABELS(l)   *(l) ? "{" : "", (l), *(l) ? "}" : ""
+
+void wxmetrics_sample(struct wxmetrics_page *page, const char *name, const char *labels, double value)
+{
+    put(page, "%s%s%s%s %.17g\n", name, LABELS(labels), value);
+}
+
+static void render(struct wxmetrics *m, struct wxmetrics_page *page)
+{
+    struct series *s;
+    unsigned long count;
+    int i, b;
+
+    for (i = 0; i < m->nseries; i++) {
+        s = &m->series[i];
+        if (i == 0 || strcmp(s->name, m->series[i - 1].name) != 0)
+            wxmetrics_help(page, s->name, s->histogram ? "histogram" : "counter", s->help);
+        if (!s->histogram) {
+            put(page, "%s%s%s%s %lu\n", s->name, LABELS(s->labels), total(m, s->slot));
+            continue;
+        }
+        count = 0;
+        for (b = 0; b < WXMETRICS_BUCKETS; b++) {
+            count += total(m, s->slot + b);
+            put(page, "%s_bucket{%s%sle=\"%s\"} %lu\n", s->name,
+                s->labels, *s->labels ? "," : "", bucketLe[b], count);
+        }
+        put(page, "%s_sum%s%s%s %.6f\n", s->name, LABELS(s->labels),
+            total(m, s->slot + WXMETRICS_BUCKETS) / 1e6);
+        put(page, "%s_count%s%s%s %lu\n", s->name, LABELS(s->labels), count);
+    }
+    if (m->gauges)
+        m->gauges(page, m->gaugeArg);
+}
+
+/*
+    The HTTP side.  Just enough of it for a scraper: one request per
+    connection, the answer, and we hang up.
+*/
+static void respond(struct conn *c, const char *status, struct wxmetrics_page *page)
+{
+    struct wxmetrics_page head = {0};
+    const char *body = page ? page->buf : "";
+    size_t bodyLen = page ? page->len : 0;
+
+    put(&head, "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", status, bodyLen);
+    if (head.failed || (page && page->failed)) {
+        free(head.buf);
+        closeConn(c);
+        return;
+    }
+    c->out = malloc(head.len + bodyLen);
+    if (c->out == NULL) {
+        free(head.buf);
+        closeConn(c);
+        return;
+    }
+    memcpy(c->out, head.buf, head.len);
+    memcpy(c->out + head.len, body, bodyLen);
+    c->outLen = head.len + bodyLen;
+    c->outDone = 0;
+    free(head.buf);
+    wxloop_mod_io(c->m->loop, c->fd, WXLOOP_WRITE);
+}
+
+static void connReady(int fd, int events, void *arg)
+{
+    struct conn *c = arg;
+    struct wxmetrics_page page = {0};
+    ssize_t n;
+
+    if (c->out) {
+        n = write(c->fd, c->out + c->outDone, c->outLen - c->outDone);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n < 0 || (c->outDone += n) == c->outLen)
+            closeConn(c);
+        return;
+    }
+    n = read(c->fd, c->in + c->inLen, sizeof(c->in) - 1 - c->inLen);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        closeConn(c);
+        return;
+    }
+    c->inLen += n;
+    c->in[c->inLen] = '\0';
+    if (strstr(c->in, "\r\n\r\n") == NULL && strstr(c->in, "\n\n") == NULL) {
+        if (c->inLen == sizeof(c->in) - 1)
+            respond(c, "431 Request Header Fields Too Large", NULL);
+        return;
+    }
+    if (strncmp(c->in, "GET /metrics ", 13) != 0 && strncmp(c->in, "GET / ", 6) != 0) {
+        respond(c, "404 Not Found", NULL);
+        return;
+    }
+    render(c->m, &page);
+    respond(c, "200 OK", &page);
+    free(page.buf);
+}
+
+static int nonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void acceptReady(int fd, int events, void *arg)
+{
+    struct wxmetrics *m = arg;
+    struct conn *c = NULL;
+    int i, cfd;
+
+    cfd = accept(fd, NULL, NULL);
+    if (cfd < 0)
+        return;
+    if (nonBlocking(cfd) < 0) {
+        close(cfd);
+        return;
+    }
+    for (i = 0; i < WXMETRICS_MAXCONN && c == NULL; i++)
+        if (m->conns[i].fd < 0)
+            c = &m->conns[i];
+    // Too many at once, somebody's scraping much too hard
+    if (c == NULL) {
+        close(cfd);
+        return;
+    }
+    c->m = m;
+    c->fd = cfd;
+    c->inLen = 0;
+    if (wxloop_add_io(m->loop, cfd, WXLOOP_READ, connReady, c) < 0) {
+        close(cfd);
+        c->fd = -1;
+    }
+}
+
+int wxmetrics_serve(struct wxmetrics *m, struct wxloop *loop, int port,
+                    wxmetrics_gauge_fn gauges, void *arg)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+
+    m->loop = loop;
+    m->gauges = gauges;
+    m->gaugeArg = arg;
+    m->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->listenFd < 0)
+        return -1;
+    nonBlocking(m->listenFd);
+    setsockopt(m->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    // Nobody off the box needs to see this
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(m->listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(m->listenFd, WXMETRICS_MAXCONN) < 0 ||
+        wxloop_add_io(loop, m->listenFd, WXLOOP_READ, acceptReady, m) < 0) {
+        close(m->listenFd);
+        m->listenFd = -1;
+        return -1;
+    }
+    return 0;
+}
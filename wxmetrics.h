@@ -0,0 +1,69 @@
+/*
+    Counters and latency histograms for the daemon, served up in the
+    Prometheus text format from a little HTTP listener on the loop.
+
+    Everything is registered once at startup, before any threads start.
+    Each thread that counts things takes its own shard and only ever
+    writes to that, so counting is a load and a store with nobody to
+    wait for.  The shards only get added up when somebody scrapes
+    /metrics, on the loop thread.
+
+    The counts are unsigned longs, which the Pi and the Omega2 can load
+    and store whole without a lock.  On those they wrap after 2^32, and
+    Prometheus takes that for a restart.
+
+    Things that are only worth knowing at the moment of the scrape,
+    queue depths and how old the readings are, come from a callback
+    that writes them into the page as it's put together.
+*/
+#ifndef WXMETRICS_H
+#define WXMETRICS_H
+
+#include <stdint.h>
+#include "wxloop.h"
+
+#define WXMETRICS_MAXSERIES 64
+#define WXMETRICS_MAXSHARDS 4
+#define WXMETRICS_MAXCONN   4
+// Latency buckets run from 1ms to 10s, plus +Inf
+#define WXMETRICS_BUCKETS   13
+
+struct wxmetrics;
+struct wxmetrics_shard;
+struct wxmetrics_page;
+
+typedef void (*wxmetrics_gauge_fn)(struct wxmetrics_page *page, void *arg);
+
+struct wxmetrics *wxmetrics_new(void);
+// Stops serving too
+void wxmetrics_free(struct wxmetrics *m);
+
+// Register a series.  labels is what goes between the braces, like
+// report="1", or "" for none.  Series of the same name have to be
+// registered one after the other.  Returns the id to count with, or -1
+// if there's no room.
+int wxmetrics_counter(struct wxmetrics *m, const char *name, const char *labels, const char *help);
+int wxmetrics_histogram(struct wxmetrics *m, const char *name, const char *labels, const char *help);
+
+// One per thread that counts.  NULL if they're all taken.
+struct wxmetrics_shard *wxmetrics_shard(struct wxmetrics *m);
+
+// These are fine to call with a NULL shard, they just don't count
+void wxmetrics_add(struct wxmetrics_shard *shard, int id, unsigned long n);
+#define wxmetrics_inc(shard, id)    wxmetrics_add((shard), (id), 1)
+// Something that took us microseconds
+void wxmetrics_observe(struct wxmetrics_shard *shard, int id, unsigned long us);
+
+// Monotonic microseconds, for timing what gets observed
+uint64_t wxmetrics_now_us(void);
+
+// For the gauge callback
+void wxmetrics_help(struct wxmetrics_page *page, const char *name, const char *type, const char *help);
+void wxmetrics_sample(struct wxmetrics_page *page, const char *name, const char *labels, double value);
+
+// Listen on 127.0.0.1:port and answer GET /metrics from the loop.
+// gauges may be NULL.  Returns 0, or -1 if the port can't be had.
+int wxmetrics_serve(struct wxmetrics *m, struct wxloop *loop, int port,
+                    wxmetrics_gauge_fn gauges, void *arg);
+
+#endif
@@ -0,0 +1,784 @@
+/*
+    MQTT publisher, see wxmqtt.h.
+
+    Just enough of MQTT 3.1.1 to publish: CONNECT with a will, PUBLISH
+    at QoS 1 with PUBACKs back, PINGREQ when there's nothing else to
+    say, and DISCONNECT at the end.  Nothing is ever subscribed to, so
+    the broker only ever sends us small things.
+
+    Each message waiting for its PUBACK has a slot, and the slot's index
+    is its packet id, so an ack finds its slot without looking.  The
+    packet stays in the slot until it's acknowledged, which is all a
+    reconnect needs to send everything again.  The socket's
+    non-blocking and the thread sleeps in poll() on it and the wake
+    pipe, until the next ping or the end of the linger.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wxmqtt.h"
+#include "wxsink.h"
+#include "wxdecode.h"
+#include "wxderive.h"
+#include "wxloop.h"
+#include "wxlog.h"
+
+#define PACKETMAX   (WXSINK_RECMAX + 160)   // a topic, the JSON and the headers
+#define INMAX       64                      // the broker only sends acks
+#define CONNECTSECS 5
+#define RETRYMIN    1000    // ms between tries to connect, doubling
+#define RETRYMAX    60000
+#define STOPWAIT    2000    // ms to get what's waiting out at the end
+#define FIELDS      7
+
+// Packet types in the top four bits, flags in the bottom
+#define CONNECT     0x10
+#define CONNACK     0x20
+#define PUBLISH     0x30
+#define PUBACK      0x40
+#define PINGREQ     0xc0
+#define PINGRESP    0xd0
+#define DISCONNECT  0xe0
+#define DUP         0x08
+#define QOS1        0x02
+#define RETAIN      0x01
+
+// No SIGPIPE when the broker's gone, it comes back as EPIPE
+#ifdef MSG_NOSIGNAL
+#define SENDFLAGS   MSG_NOSIGNAL
+#else
+#define SENDFLAGS   0
+#endif
+
+static const char *fieldName[FIELDS] = {
+    "windSpeed", "windDirection", "temperature", "humidity", "rainCounter", "barometer", "dewPoint"
+};
+
+struct observation {
+    time_t              when;
+    int                 station;
+    uint64_t            queued;     // us, when it was handed over
+    struct weatherData  wx;
+};
+
+struct slot {
+    int             busy;       // waiting for its PUBACK
+    uint64_t        queued;
+    int             len;
+    unsigned char * packet;     // PACKETMAX
+};
+
+struct wxmqtt {
+    struct wxmqtt_options opt;
+    struct wxring *     ring;
+    int                 wake[2];
+    atomic_int          stopping;
+    pthread_t           thread;
+
+    int                 fd;
+    int                 up;         // the broker's said yes
+    long long           dialedAt;
+    long long           retryAt;
+    long                retryWait;
+    long long           lastSent;
+    long long           lastHeard;
+
+    struct slot *       slots;      // opt.window of them
+    unsigned char *     packets;
+    int                 free;
+    int                 nextSlot;
+    struct observation  held;       // off the ring, waiting for room
+    int                 holding;
+    time_t              last[MAXSTATIONS][FIELDS];  // what each field's time was when it last went
+
+    unsigned char *     out;        // what's to be sent
+    size_t              outLen;
+    size_t              outSent;
+    size_t              outCap;
+    long long           batchAt;    // when the oldest thing in it was put there
+    int                 flushing;   // send it now, don't wait for more
+    unsigned char       in[INMAX];
+    size_t              inLen;
+
+    struct wxmqtt_stats stats;
+};
+
+static int copy(char *dst, size_t size, const char *src)
+{
+    return snprintf(dst, size, "%s", src) < (int)size ? 0 : -1;
+}
+
+int wxmqtt_parse(const char *url, struct wxmqtt_options *opt)
+{
+    char buf[512], *p, *at, *colon, *slash, *query, *key, *value, *save = NULL;
+    size_t len;
+
+    memset(opt, 0, sizeof(*opt));
+    strcpy(opt->port, WXMQTT_PORT);
+    strcpy(opt->prefix, WXMQTT_PREFIX);
+    snprintf(opt->clientId, sizeof(opt->clientId), "wxstation-%d", (int)getpid());
+    opt->window = WXMQTT_WINDOW;
+    opt->linger = WXMQTT_LINGER;
+    opt->keepalive = WXMQTT_KEEPALIVE;
+    opt->latency = -1;
+
+    if (strncmp(url, "mqtt://", 7) == 0)
+        url += 7;
+    if (copy(buf, sizeof(buf), url) < 0)
+        return -1;
+    p = buf;
+    query = strchr(p, '?');
+    if (query)
+        *query++ = '\0';
+    else
+        query = p + strlen(p);
+    slash = strchr(p, '/');
+    if (slash) {
+        *slash++ = '\0';
+        len = strlen(slash);
+        while (len && slash[len - 1] == '/')
+            slash[--len] = '\0';
+        // Wildcards can't go in a topic we publish to
+        if (len && (strpbrk(slash, "+#") || copy(opt->prefix, sizeof(opt->prefix), slash) < 0))
+            return -1;
+    }
+    at = strrchr(p, '@');
+    if (at) {
+        *at = '\0';
+        colon = strchr(p, ':');
+        if (colon) {
+            *colon++ = '\0';
+            if (copy(opt->password, sizeof(opt->password), colon) < 0)
+                return -1;
+        }
+        if (copy(opt->user, sizeof(opt->user), p) < 0)
+            return -1;
+        p = at + 1;
+    }
+    // [::1]:1883 for an IPv6 address
+    if (*p == '[') {
+        colon = strchr(++p, ']');
+        if (colon == NULL)
+            return -1;
+        *colon++ = '\0';
+        if (*colon != ':' && *colon != '\0')
+            return -1;
+    } else
+        colon = strchr(p, ':');
+    if (colon && *colon == ':') {
+        *colon++ = '\0';
+        if (*colon == '\0' || strspn(colon, "0123456789") != strlen(colon) ||
+            copy(opt->port, sizeof(opt->port), colon) < 0)
+            return -1;
+    }
+    if (*p == '\0' || copy(opt->host, sizeof(opt->host), p) < 0)
+        return -1;
+
+    for (key = strtok_r(query, "&", &save); key; key = strtok_r(NULL, "&", &save)) {
+        value = strchr(key, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+        if (strcmp(key, "window") == 0)
+            opt->window = atoi(value);
+        else if (strcmp(key, "linger") == 0)
+            opt->linger = atol(value);
+        else if (strcmp(key, "keepalive") == 0)
+            opt->keepalive = atoi(value);
+        else if (strcmp(key, "id") == 0) {
+            if (copy(opt->clientId, sizeof(opt->clientId), value) < 0)
+                return -1;
+        } else
+            return -1;
+    }
+    // A whole observation has to fit in the window
+    if (opt->window < WXMQTT_PEROBS)
+        opt->window = WXMQTT_PEROBS;
+    if (opt->window > WXMQTT_MAXWINDOW)
+        opt->window = WXMQTT_MAXWINDOW;
+    if (opt->linger < 0)
+        opt->linger = 0;
+    if (opt->keepalive < 1 || opt->keepalive > 65535)
+        opt->keepalive = WXMQTT_KEEPALIVE;
+    return 0;
+}
+
+/*
+    Packets.  Each of these writes at p and returns the end.
+*/
+static unsigned char *putLength(unsigned char *p, size_t n)
+{
+    unsigned char b;
+
+    do {
+        b = n & 0x7f;
+        n >>= 7;
+        *p++ = n ? b | 0x80 : b;
+    } while (n);
+    return p;
+}
+
+static unsigned char *putString(unsigned char *p, const char *s, size_t len)
+{
+    *p++ = len >> 8;
+    *p++ = len;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static unsigned char *putPublish(unsigned char *p, int flags, const char *topic,
+                                 const char *payload, size_t len, int id)
+{
+    size_t topicLen = strlen(topic);
+
+    *p++ = PUBLISH | flags;
+    p = putLength(p, 2 + topicLen + (id ? 2 : 0) + len);
+    p = putString(p, topic, topicLen);
+    if (id) {
+        *p++ = id >> 8;
+        *p++ = id;
+    }
+    memcpy(p, payload, len);
+    return p + len;
+}
+
+static unsigned char *putConnect(unsigned char *p, const struct wxmqtt_options *opt, const char *will)
+{
+    // Clean session, and a will of "offline", QoS 1 and retained
+    unsigned char flags = 0x02 | 0x04 | 0x08 | 0x20;
+    size_t len = 10 + 2 + strlen(opt->clientId) + 2 + strlen(will) + 2 + 7;
+
+    // A password without a user isn't allowed
+    if (opt->user[0]) {
+        flags |= 0x80;
+        len += 2 + strlen(opt->user);
+        if (opt->password[0]) {
+            flags |= 0x40;
+            len += 2 + strlen(opt->password);
+        }
+    }
+    *p++ = CONNECT;
+    p = putLength(p, len);
+    p = putString(p, "MQTT", 4);
+    *p++ = 4;
+    *p++ = flags;
+    *p++ = opt->keepalive >> 8;
+    *p++ = opt->keepalive;
+    p = putString(p, opt->clientId, strlen(opt->clientId));
+    p = putString(p, will, strlen(will));
+    p = putString(p, "offline", 7);
+    if (flags & 0x80)
+        p = putString(p, opt->user, strlen(opt->user));
+    if (flags & 0x40)
+        p = putString(p, opt->password, strlen(opt->password));
+    return p;
+}
+
+/*
+    The connection.
+*/
+// Onto the end of what's to be sent
+static void queue(struct wxmqtt *m, const unsigned char *packet, size_t len, long long now)
+{
+    if (m->outSent == m->outLen) {
+        m->outSent = m->outLen = 0;
+        m->batchAt = now;
+    } else if (m->outSent) {
+        memmove(m->out, m->out + m->outSent, m->outLen - m->outSent);
+        m->outLen -= m->outSent;
+        m->outSent = 0;
+    }
+    // There's room for every slot and then some, this can't happen
+    if (m->outLen + len > m->outCap)
+        return;
+    memcpy(m->out + m->outLen, packet, len);
+    m->outLen += len;
+}
+
+static void status(struct wxmqtt *m, const char *what, long long now)
+{
+    unsigned char packet[PACKETMAX];
+    char topic[sizeof(m->opt.prefix) + 8];
+
+    snprintf(topic, sizeof(topic), "%s/status", m->opt.prefix);
+    queue(m, packet, putPublish(packet, RETAIN, topic, what, strlen(what), 0) - packet, now);
+}
+
+static void hangUp(struct wxmqtt *m, long long now, const char *why)
+{
+    if (m->fd >= 0) {
+        close(m->fd);
+        if (why)
+            wxlog_warn("Lost MQTT broker %s:%s, %s\n", m->opt.host, m->opt.port, why);
+    }
+    m->fd = -1;
+    m->up = 0;
+    m->stats.connected = 0;
+    // Whatever was in here is still in the slots
+    m->outLen = m->outSent = 0;
+    m->inLen = 0;
+    m->flushing = 0;
+    m->retryAt = now + m->retryWait;
+    m->retryWait = m->retryWait * 2 < RETRYMAX ? m->retryWait * 2 : RETRYMAX;
+}
+
+static void dial(struct wxmqtt *m, long long now)
+{
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = {CONNECTSECS, 0};
+    unsigned char packet[PACKETMAX];
+    char will[sizeof(m->opt.prefix) + 8];
+    int fd = -1, one = 1, rc, err = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rc = getaddrinfo(m->opt.host, m->opt.port, &hints, &res);
+    if (rc != 0) {
+        wxlog_warn("Can't find MQTT broker %s, %s\n", m->opt.host, gai_strerror(rc));
+        hangUp(m, now, NULL);
+        return;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        // So a broker that doesn't answer doesn't hold up the stop
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        wxlog_warn("Can't connect to MQTT broker %s:%s, %s\n", m->opt.host, m->opt.port, strerror(err));
+        hangUp(m, now, NULL);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // We do our own batching
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    m->fd = fd;
+    m->dialedAt = m->lastSent = m->lastHeard = now;
+    snprintf(will, sizeof(will), "%s/status", m->opt.prefix);
+    queue(m, packet, putConnect(packet, &m->opt, will) - packet, now);
+    m->flushing = 1;
+}
+
+// The broker said yes.  Everything it hadn't acknowledged goes again,
+// oldest first, which is the next slot round from the last one used.
+static void connected(struct wxmqtt *m, long long now)
+{
+    struct slot *s;
+    int i;
+
+    m->up = 1;
+    m->stats.connected = 1;
+    m->stats.connects++;
+    m->retryWait = RETRYMIN;
+    status(m, "online", now);
+    for (i = 0; i < m->opt.window; i++) {
+        s = &m->slots[(m->nextSlot + i) % m->opt.window];
+        if (!s->busy)
+            continue;
+        s->packet[0] |= DUP;
+        queue(m, s->packet, s->len, now);
+        m->stats.resent++;
+    }
+    m->flushing = 1;
+    wxlog_info("Connected to MQTT broker %s:%s\n", m->opt.host, m->opt.port);
+}
+
+static void acked(struct wxmqtt *m, int id)
+{
+    struct slot *s;
+
+    if (id < 1 || id > m->opt.window)
+        return;
+    s = &m->slots[id - 1];
+    if (!s->busy)
+        return;
+    s->busy = 0;
+    m->free++;
+    m->stats.inflight--;
+    m->stats.acked++;
+    wxmetrics_observe(m->opt.shard, m->opt.latency, wxmetrics_now_us() - s->queued);
+}
+
+static void readIn(struct wxmqtt *m, long long now)
+{
+    unsigned char *body;
+    size_t len, head, shift;
+    ssize_t n;
+    char why[32];
+
+    n = recv(m->fd, m->in + m->inLen, sizeof(m->in) - m->inLen, 0);
+    if (n == 0) {
+        hangUp(m, now, "it hung up");
+        return;
+    }
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            hangUp(m, now, strerror(errno));
+        return;
+    }
+    m->inLen += n;
+    m->lastHeard = now;
+    for (;;) {
+        // The fixed header, and however much of the length is here
+        len = 0;
+        shift = 0;
+        for (head = 1; head < m->inLen && head < 5; head++) {
+            len |= (size_t)(m->in[head] & 0x7f) << shift;
+            shift += 7;
+            if (!(m->in[head] & 0x80))
+                break;
+        }
+        if (head >= m->inLen)
+            return;
+        if (head == 5) {
+            hangUp(m, now, "it sent something that made no sense");
+            return;
+        }
+        head++;
+        if (head + len > sizeof(m->in)) {
+            hangUp(m, now, "it sent something we didn't ask for");
+            return;
+        }
+        if (head + len > m->inLen)
+            return;
+        body = m->in + head;
+        switch (m->in[0] & 0xf0) {
+            case CONNACK:
+                if (len < 2 || body[1] != 0) {
+                    snprintf(why, sizeof(why), "refused, code %d", len < 2 ? -1 : body[1]);
+                    hangUp(m, now, why);
+                    return;
+                }
+                connected(m, now);
+                break;
+            case PUBACK:
+                if (len >= 2)
+                    acked(m, body[0] << 8 | body[1]);
+                break;
+        }
+        m->inLen -= head + len;
+        memmove(m->in, m->in + head + len, m->inLen);
+    }
+}
+
+static void sendOut(struct wxmqtt *m, long long now)
+{
+    ssize_t n;
+
+    n = send(m->fd, m->out + m->outSent, m->outLen - m->outSent, SENDFLAGS);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            hangUp(m, now, strerror(errno));
+        return;
+    }
+    m->stats.writes++;
+    m->stats.bytes += n;
+    m->outSent += n;
+    m->lastSent = now;
+    if (m->outSent == m->outLen) {
+        m->outSent = m->outLen = 0;
+        m->flushing = 0;
+    }
+}
+
+/*
+    Observations into messages.
+*/
+static void message(struct wxmqtt *m, const char *topic, const char *payload, size_t len,
+                    uint64_t queued, long long now)
+{
+    struct slot *s;
+
+    while (m->slots[m->nextSlot].busy)
+        m->nextSlot = (m->nextSlot + 1) % m->opt.window;
+    s = &m->slots[m->nextSlot];
+    s->busy = 1;
+    s->queued = queued;
+    s->len = putPublish(s->packet, QOS1 | RETAIN, topic, payload, len, m->nextSlot + 1) - s->packet;
+    m->nextSlot = (m->nextSlot + 1) % m->opt.window;
+    m->free--;
+    m->stats.inflight++;
+    m->stats.published++;
+    queue(m, s->packet, s->len, now);
+}
+
+static void publish(struct wxmqtt *m, const struct observation *ob, long long now)
+{
+    const struct weatherData *wx = &ob->wx;
+    char topic[sizeof(m->opt.prefix) + 32], payload[WXSINK_RECMAX];
+    time_t t[FIELDS], *last = NULL;
+    int f, len = 0;
+
+    t[0] = wx->wsTime;
+    t[1] = wx->wdTime;
+    t[2] = wx->tTime;
+    t[3] = wx->hTime;
+    t[4] = wx->rcTime;
+    t[5] = wx->bTime;
+    // The dew point is new whenever either of what it's from is
+    t[6] = wx->tTime == 0 || wx->hTime == 0 ? 0 : wx->tTime > wx->hTime ? wx->tTime : wx->hTime;
+    if (ob->station >= 0 && ob->station < MAXSTATIONS)
+        last = m->last[ob->station];
+    for (f = 0; f < FIELDS; f++) {
+        if (t[f] == 0 || (last && last[f] == t[f]))
+            continue;
+        switch (f) {
+            case 0: len = snprintf(payload, sizeof(payload), "%.1f", wx->windSpeed); break;
+            case 1: len = snprintf(payload, sizeof(payload), "%s", DirectionNum[wx->windDirection & 0x0f]); break;
+            case 2: len = snprintf(payload, sizeof(payload), "%.1f", wx->temperature); break;
+            case 3: len = snprintf(payload, sizeof(payload), "%d", wx->humidity); break;
+            case 4: len = snprintf(payload, sizeof(payload), "%d", wx->rainCounter); break;
+            case 5: len = snprintf(payload, sizeof(payload), "%.2f", wx->barometer); break;
+            case 6: len = snprintf(payload, sizeof(payload), "%.1f",
+                                   wxderive_dewpoint(wx->temperature, wx->humidity)); break;
+        }
+        if (last)
+            last[f] = t[f];
+        snprintf(topic, sizeof(topic), "%s/%d/%s", m->opt.prefix, ob->station, fieldName[f]);
+        message(m, topic, payload, len, ob->queued, now);
+    }
+    // and all of it, less the newline
+    len = wxsink_format(WXSINK_JSON, ob->station, ob->when, wx, payload) - 1;
+    snprintf(topic, sizeof(topic), "%s/%d", m->opt.prefix, ob->station);
+    message(m, topic, payload, len, ob->queued, now);
+}
+
+// Take observations off the ring while there's room in the window
+static void fill(struct wxmqtt *m, long long now)
+{
+    for (;;) {
+        if (!m->holding) {
+            if (wxring_pop(m->ring, &m->held) < 0)
+                return;
+            m->holding = 1;
+        }
+        if (m->free < WXMQTT_PEROBS)
+            return;
+        publish(m, &m->held, now);
+        m->holding = 0;
+    }
+}
+
+// Say goodbye properly, so the broker doesn't send the will
+static void goodbye(struct wxmqtt *m)
+{
+    unsigned char disconnect[2] = {DISCONNECT, 0};
+    long long now = wxloop_now_ms();
+    ssize_t n;
+
+    if (m->fd < 0)
+        return;
+    if (m->up) {
+        status(m, "offline", now);
+        queue(m, disconnect, sizeof(disconnect), now);
+    }
+    // Blocking, with the send timeout from when it was dialed
+    fcntl(m->fd, F_SETFL, fcntl(m->fd, F_GETFL) & ~O_NONBLOCK);
+    while (m->outSent < m->outLen) {
+        n = send(m->fd, m->out + m->outSent, m->outLen - m->outSent, SENDFLAGS);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        m->stats.writes++;
+        m->stats.bytes += n;
+        m->outSent += n;
+    }
+    close(m->fd);
+    m->fd = -1;
+    m->up = 0;
+    m->stats.connected = 0;
+}
+
+static long long sooner(long long a, long long b)
+{
+    return a < b ? a : b;
+}
+
+static void *worker(void *arg)
+{
+    struct wxmqtt *m = arg;
+    struct pollfd fds[2];
+    long long now, deadline, stopBy = 0;
+    long keepalive = m->opt.keepalive * 1000L;
+    char buf[64];
+
+    for (;;) {
+        now = wxloop_now_ms();
+        if (atomic_load(&m->stopping)) {
+            if (stopBy == 0)
+                stopBy = now + STOPWAIT;
+            // Not connected and not going to be in time
+            if ((m->fd < 0 && m->retryAt > stopBy) || now >= stopBy ||
+                (!m->holding && wxring_depth(m->ring) == 0 && m->free == m->opt.window))
+                break;
+        }
+        if (m->fd < 0 && now >= m->retryAt)
+            dial(m, now);
+        if (m->up)
+            fill(m, now);
+        if (m->fd >= 0) {
+            if (!m->up && now - m->dialedAt > CONNECTSECS * 1000L)
+                hangUp(m, now, "no CONNACK");
+            else if (now - m->lastHeard > keepalive * 3 / 2)
+                hangUp(m, now, "it stopped answering");
+            else if (m->up && m->outLen == 0 && now - m->lastSent >= keepalive / 2) {
+                buf[0] = PINGREQ;
+                buf[1] = 0;
+                queue(m, (unsigned char *)buf, 2, now);
+                m->flushing = 1;
+            }
+        }
+        // Linger for more, unless the window's full or we're stopping
+        if (m->fd >= 0 && m->outSent < m->outLen &&
+            (now - m->batchAt >= m->opt.linger || m->free < WXMQTT_PEROBS || stopBy))
+            m->flushing = 1;
+        if (m->fd >= 0 && m->flushing)
+            sendOut(m, now);
+
+        deadline = now + 1000;
+        if (m->fd < 0)
+            deadline = sooner(deadline, m->retryAt);
+        else {
+            if (m->outSent < m->outLen && !m->flushing)
+                deadline = sooner(deadline, m->batchAt + m->opt.linger);
+            if (m->up)
+                deadline = sooner(deadline, m->lastSent + keepalive / 2);
+        }
+        if (stopBy)
+            deadline = sooner(deadline, stopBy);
+        fds[0].fd = m->wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = m->fd;
+        fds[1].events = POLLIN | (m->flushing ? POLLOUT : 0);
+        if (poll(fds, m->fd >= 0 ? 2 : 1, deadline > now ? (int)(deadline - now) : 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            wxlog_error("MQTT worker, %s\n", strerror(errno));
+            break;
+        }
+        if (fds[0].revents)
+            while (read(m->wake[0], buf, sizeof(buf)) > 0)
+                ;
+        if (m->fd >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            readIn(m, wxloop_now_ms());
+    }
+    goodbye(m);
+    return NULL;
+}
+
+struct wxmqtt *wxmqtt_start(const struct wxmqtt_options *opt, unsigned int depth)
+{
+    struct wxmqtt *m = calloc(1, sizeof(struct wxmqtt));
+    int i;
+
+    if (m == NULL)
+        return NULL;
+    m->opt = *opt;
+    m->fd = -1;
+    m->wake[0] = m->wake[1] = -1;
+    m->retryWait = RETRYMIN;
+    m->free = opt->window;
+    atomic_init(&m->stopping, 0);
+    // Every slot going again after a reconnect, behind the CONNECT and
+    // the status
+    m->outCap = (opt->window + 3) * PACKETMAX;
+    m->out = malloc(m->outCap);
+    m->slots = calloc(opt->window, sizeof(struct slot));
+    m->packets = malloc(opt->window * PACKETMAX);
+    m->ring = wxring_new(sizeof(struct observation), depth);
+    if (m->out == NULL || m->slots == NULL || m->packets == NULL || m->ring == NULL ||
+        pipe(m->wake) < 0)
+        goto fail;
+    for (i = 0; i < opt->window; i++)
+        m->slots[i].packet = m->packets + i * PACKETMAX;
+    fcntl(m->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(m->wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(m->wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(m->wake[1], F_SETFD, FD_CLOEXEC);
+    if (pthread_create(&m->thread, NULL, worker, m) != 0)
+        goto fail;
+    return m;
+
+fail:
+    if (m->wake[0] >= 0) {
+        close(m->wake[0]);
+        close(m->wake[1]);
+    }
+    wxring_free(m->ring);
+    free(m->packets);
+    free(m->slots);
+    free(m->out);
+    free(m);
+    return NULL;
+}
+
+void wxmqtt_stop(struct wxmqtt *m)
+{
+    char b = 0;
+
+    if (m == NULL)
+        return;
+    atomic_store(&m->stopping, 1);
+    if (write(m->wake[1], &b, 1) < 0)
+        ;
+    pthread_join(m->thread, NULL);
+    close(m->wake[0]);
+    close(m->wake[1]);
+    wxring_free(m->ring);
+    free(m->packets);
+    free(m->slots);
+    free(m->out);
+    free(m);
+}
+
+int wxmqtt_submit(struct wxmqtt *m, int station, time_t when, const struct weatherData *wx)
+{
+    struct observation ob;
+    char b = 0;
+
+    ob.when = when;
+    ob.station = station;
+    ob.queued = wxmetrics_now_us();
+    ob.wx = *wx;
+    if (wxring_push(m->ring, &ob) < 0)
+        return -1;
+    // EAGAIN means there's a wakeup waiting already
+    if (write(m->wake[1], &b, 1) < 0)
+        ;
+    return 0;
+}
+
+void wxmqtt_get_stats(struct wxmqtt *m, struct wxmqtt_stats *stats)
+{
+    *stats = m->stats;
+}
+
+void wxmqtt_get_queue(struct wxmqtt *m, struct wxring_stats *stats)
+{
+    wxring_get_stats(m->ring, stats);
+}
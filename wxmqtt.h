@@ -0,0 +1,110 @@
+/*
+    Observations onto an MQTT broker (-B url).
+
+        mqtt://[user[:password]@]host[:port][/prefix][?window=N&linger=ms&keepalive=s&id=name]
+
+    Each observation goes out as prefix/N, the same JSON the daemon
+    writes to stdout (see wxsink.h), and each reading that's new since
+    the last one as prefix/N/field, just the number:
+
+        weather/0                   {"station":0,"windSpeed":{...},...}
+        weather/0/windSpeed         3.5         mph
+        weather/0/windDirection     315         degrees
+        weather/0/temperature       72.4        °F
+        weather/0/humidity          41          %
+        weather/0/rainCounter       12          hundredths of an inch
+        weather/0/barometer         29.9        inHg
+        weather/0/dewPoint          47.1        °F
+
+    N is the station number.  Everything is retained, so anyone who
+    subscribes gets the latest straight away, and QoS 1.  prefix/status
+    is "online" while we're connected and "offline", as our will, when
+    we're not.
+
+    It's all done on a thread of its own over one connection that's kept
+    open, with a wxring of observations between it and the loop, like
+    wxupload.  Up to window messages can be waiting for the broker's
+    PUBACK at once; past that the thread stops taking observations off
+    the ring until some come back, and if the ring fills they're dropped
+    and counted.  Messages aren't written as they're made.  They pile up
+    for linger ms, or until the window's full, and go out in one send(),
+    so one observation, or a station's worth of them, is one write and
+    usually one packet.  If the connection goes, whatever hadn't been
+    acknowledged goes again when it's back, marked as a duplicate.
+
+    To try it with a mosquitto of your own:
+
+        mosquitto -p 1883 &
+        mosquitto_sub -t 'weather/#' -v &
+        weatherstation -B mqtt://127.0.0.1/weather -p capture.bin
+
+    Play the capture back as it was recorded, not with -F.  That hands
+    over observations far faster than any broker acknowledges them, and
+    once the ring's full the rest are dropped.
+*/
+#ifndef WXMQTT_H
+#define WXMQTT_H
+
+#include <time.h>
+#include "weatherstation.h"
+#include "wxring.h"
+#include "wxmetrics.h"
+
+#define WXMQTT_PORT         "1883"
+#define WXMQTT_PREFIX       "weather"
+#define WXMQTT_WINDOW       20      // mosquitto's default for what it'll have in flight
+#define WXMQTT_MAXWINDOW    256
+#define WXMQTT_LINGER       50      // ms
+#define WXMQTT_KEEPALIVE    60      // s
+// Most messages one observation can make, the fields and the JSON
+#define WXMQTT_PEROBS       8
+
+struct wxmqtt_options {
+    char    host[128];
+    char    port[8];
+    char    prefix[64];
+    char    clientId[24];       // 23 is all a 3.1.1 broker has to take
+    char    user[64];
+    char    password[64];
+    int     window;
+    long    linger;
+    int     keepalive;
+    // Where the thread times each message, from being handed over to
+    // its PUBACK.  NULL and nothing's timed.
+    struct wxmetrics_shard *shard;
+    int     latency;
+};
+
+struct wxmqtt_stats {
+    unsigned long   published;  // messages made and queued to go
+    unsigned long   acked;
+    unsigned long   resent;     // sent again after a reconnect
+    unsigned long   writes;     // send() calls
+    unsigned long   bytes;
+    unsigned long   connects;
+    unsigned int    inflight;   // waiting for a PUBACK right now
+    int             connected;
+};
+
+struct wxmqtt;
+
+// Fill opt in from url, with the defaults for anything it doesn't say.
+// Returns 0, or -1 if it isn't one.
+int wxmqtt_parse(const char *url, struct wxmqtt_options *opt);
+
+// Start the thread with room for depth observations waiting.  It
+// connects in the background and keeps trying.  Block any signals you
+// want handled elsewhere first.  NULL if it won't start.
+struct wxmqtt *wxmqtt_start(const struct wxmqtt_options *opt, unsigned int depth);
+// Give what's waiting a couple of seconds to get to the broker, then
+// disconnect, join and free it.
+void wxmqtt_stop(struct wxmqtt *m);
+
+// Queue a copy of wx.  Never blocks.  Returns -1 if it had to be dropped.
+int wxmqtt_submit(struct wxmqtt *m, int station, time_t when, const struct weatherData *wx);
+
+// The numbers are a snapshot, they're written by the thread
+void wxmqtt_get_stats(struct wxmqtt *m, struct wxmqtt_stats *stats);
+void wxmqtt_get_queue(struct wxmqtt *m, struct wxring_stats *stats);
+
+#endif
@@ -0,0 +1,465 @@
+/*
+    Query server, see wxquery.h.
+
+    Up to WXQUERY_MAXCONN connections at once, all non-blocking on one
+    poll set: read the request, answer it, hang up.  Everything comes
+    out of memory so answering takes well under a millisecond; it's the
+    reading and writing that can take a while, and nobody waits on
+    anybody else for that.  A connection gets TIMEOUTSECS from accept()
+    to the last byte of the answer, then it's hung up on.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "wxquery.h"
+#include "wxsink.h"
+#include "wxlog.h"
+
+#define REQUESTMAX  2048
+#define TIMEOUTSECS 2
+
+// No SIGPIPE when they hang up first
+#ifdef MSG_NOSIGNAL
+#define SENDFLAGS   MSG_NOSIGNAL
+#else
+#define SENDFLAGS   0
+#endif
+
+struct conn {
+    int         fd;
+    long long   deadline;   // ms, hung up on if it's not done by then
+    char        in[REQUESTMAX];
+    size_t      inLen;
+    char *      out;        // the whole answer, once there is one
+    size_t      outLen;
+    size_t      outDone;
+};
+
+struct wxquery {
+    struct wxhistory *      history;
+    int                     listenFd;
+    int                     wake[2];
+    pthread_t               thread;
+    struct wxhistory_rec *  recs;       // WXQUERY_MAXRECS of them
+    char *                  out;        // the answer being put together
+    size_t                  outLen;
+    size_t                  outCap;
+    struct conn             conns[WXQUERY_MAXCONN];
+};
+
+struct params {
+    int     station;
+    time_t  from;
+    time_t  to;
+    long    step;
+    int     limit;
+};
+
+static int grow(struct wxquery *q, size_t more)
+{
+    char *bigger;
+    size_t cap;
+
+    if (q->outLen + more <= q->outCap)
+        return 0;
+    cap = (q->outLen + more) * 2;
+    bigger = realloc(q->out, cap);
+    if (bigger == NULL)
+        return -1;
+    q->out = bigger;
+    q->outCap = cap;
+    return 0;
+}
+
+static int putStr(struct wxquery *q, const char *s, size_t len)
+{
+    if (grow(q, len) < 0)
+        return -1;
+    memcpy(q->out + q->outLen, s, len);
+    q->outLen += len;
+    return 0;
+}
+
+// One record as the stdout JSON, less its newline
+static int putRec(struct wxquery *q, const struct wxhistory_rec *rec)
+{
+    if (grow(q, WXSINK_RECMAX) < 0)
+        return -1;
+    q->outLen += wxsink_format(WXSINK_JSON, rec->station, rec->when, &rec->wx, q->out + q->outLen) - 1;
+    return 0;
+}
+
+static int putRecs(struct wxquery *q, const struct wxhistory_rec *recs, int n)
+{
+    int i;
+
+    if (putStr(q, "[", 1) < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+        if ((i && putStr(q, ",\n", 2) < 0) || putRec(q, &recs[i]) < 0)
+            return -1;
+    return putStr(q, "]\n", 2);
+}
+
+// Average each step's worth of records down to one, in place.  They're
+// all from the one station, oldest first.
+static int downsample(struct wxhistory_rec *recs, int n, time_t from, long step)
+{
+    struct weatherData *wx, *sum;
+    time_t bucket;
+    int i, out = -1, count = 0;
+
+    for (i = 0; i < n; i++) {
+        bucket = from + (recs[i].when - from) / step * step;
+        if (out < 0 || recs[out].when != bucket) {
+            if (out >= 0) {
+                sum = &recs[out].wx;
+                sum->windSpeed /= count;
+                sum->temperature /= count;
+                sum->barometer /= count;
+                sum->humidity /= count;
+            }
+            recs[++out] = recs[i];
+            recs[out].when = bucket;
+            count = 1;
+            continue;
+        }
+        sum = &recs[out].wx;
+        wx = &recs[i].wx;
+        sum->windSpeed += wx->windSpeed;
+        sum->temperature += wx->temperature;
+        sum->barometer += wx->barometer;
+        sum->humidity += wx->humidity;
+        sum->windDirection = wx->windDirection;
+        sum->rainCounter = wx->rainCounter;
+        sum->rainRaw = wx->rainRaw;
+        count++;
+    }
+    if (out >= 0) {
+        sum = &recs[out].wx;
+        sum->windSpeed /= count;
+        sum->temperature /= count;
+        sum->barometer /= count;
+        sum->humidity /= count;
+    }
+    for (i = 0; i <= out; i++) {
+        wx = &recs[i].wx;
+        wx->wsTime = wx->wdTime = wx->tTime = wx->hTime =
+            wx->rcTime = wx->rrTime = wx->bTime = recs[i].when;
+    }
+    return out + 1;
+}
+
+static void parseParams(char *query, struct params *p)
+{
+    char *key, *value, *save = NULL;
+    time_t now = time(NULL);
+
+    p->station = -1;
+    p->from = now - 3600;
+    p->to = now;
+    p->step = 0;
+    p->limit = WXQUERY_MAXRECS;
+    for (key = strtok_r(query, "&", &save); key; key = strtok_r(NULL, "&", &save)) {
+        value = strchr(key, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        if (strcmp(key, "station") == 0)
+            p->station = atoi(value);
+        else if (strcmp(key, "from") == 0)
+            p->from = strtoll(value, NULL, 10);
+        else if (strcmp(key, "to") == 0)
+            p->to = strtoll(value, NULL, 10);
+        else if (strcmp(key, "step") == 0)
+            p->step = atol(value);
+        else if (strcmp(key, "limit") == 0)
+            p->limit = atoi(value);
+    }
+    if (p->limit < 1 || p->limit > WXQUERY_MAXRECS)
+        p->limit = WXQUERY_MAXRECS;
+}
+
+// Put the body together for path.  Returns the HTTP status.
+static int answer(struct wxquery *q, char *path)
+{
+    char *query = strchr(path, '?');
+    struct params p;
+    int n, s;
+
+    if (query)
+        *query++ = '\0';
+    parseParams(query ? query : (char *)"", &p);
+
+    if (strcmp(path, "/latest") == 0) {
+        if (p.station >= 0) {
+            if (wxhistory_latest(q->history, p.station, &q->recs[0]) < 0)
+                return 404;
+            return putRec(q, &q->recs[0]) < 0 || putStr(q, "\n", 1) < 0 ? 500 : 200;
+        }
+        // A station that's never been heard from has nothing to say
+        for (s = 0, n = 0; s < MAXSTATIONS; s++)
+            if (wxhistory_latest(q->history, s, &q->recs[n]) == 0)
+                n++;
+        return putRecs(q, q->recs, n) < 0 ? 500 : 200;
+    }
+    if (strcmp(path, "/range") == 0) {
+        // Averaging has to be one station at a time
+        if (p.step > 0 && p.station < 0)
+            p.station = 0;
+        n = wxhistory_range(q->history, p.station, p.from, p.to, q->recs,
+                            p.step > 0 ? WXQUERY_MAXRECS : p.limit);
+        if (p.step > 0) {
+            n = downsample(q->recs, n, p.from, p.step);
+            if (n > p.limit) {
+                memmove(q->recs, q->recs + n - p.limit, p.limit * sizeof(q->recs[0]));
+                n = p.limit;
+            }
+        }
+        return putRecs(q, q->recs, n) < 0 ? 500 : 200;
+    }
+    return 404;
+}
+
+static long long nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void closeConn(struct conn *c)
+{
+    if (c->fd < 0)
+        return;
+    close(c->fd);
+    c->fd = -1;
+    free(c->out);
+    c->out = NULL;
+}
+
+// The request's all in, or all there's room for, put the answer together
+// for it.  Returns -1 if there's no memory for it.
+static int respond(struct wxquery *q, struct conn *c)
+{
+    char head[256], *path, *end;
+    int status, headLen;
+    const char *reason;
+
+    q->outLen = 0;
+    if (strstr(c->in, "\r\n\r\n") == NULL && strstr(c->in, "\n\n") == NULL)
+        status = 431;
+    else if (strncmp(c->in, "GET ", 4) != 0)
+        status = 405;
+    else {
+        path = c->in + 4;
+        end = strpbrk(path, " \r\n");
+        if (end)
+            *end = '\0';
+        status = answer(q, path);
+    }
+    switch (status) {
+        case 200: reason = "OK"; break;
+        case 404: reason = "Not Found"; break;
+        case 405: reason = "Method Not Allowed"; break;
+        case 431: reason = "Request Header Fields Too Large"; break;
+        default:  reason = "Internal Server Error"; break;
+    }
+    if (status != 200)
+        q->outLen = 0;
+    headLen = snprintf(head, sizeof(head), "HTTP/1.0 %d %s\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", status, reason, q->outLen);
+    c->out = malloc(headLen + q->outLen);
+    if (c->out == NULL)
+        return -1;
+    memcpy(c->out, head, headLen);
+    memcpy(c->out + headLen, q->out, q->outLen);
+    c->outLen = headLen + q->outLen;
+    c->outDone = 0;
+    return 0;
+}
+
+// Whichever way it's going, as much as it'll take without waiting
+static void connReady(struct wxquery *q, struct conn *c)
+{
+    ssize_t n;
+
+    if (c->out == NULL) {
+        n = read(c->fd, c->in + c->inLen, sizeof(c->in) - 1 - c->inLen);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0) {
+            closeConn(c);
+            return;
+        }
+        c->inLen += n;
+        c->in[c->inLen] = '\0';
+        if (strstr(c->in, "\r\n\r\n") == NULL && strstr(c->in, "\n\n") == NULL &&
+            c->inLen < sizeof(c->in) - 1)
+            return;
+        if (respond(q, c) < 0) {
+            closeConn(c);
+            return;
+        }
+    }
+    n = send(c->fd, c->out + c->outDone, c->outLen - c->outDone, SENDFLAGS);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n < 0 || (c->outDone += n) == c->outLen)
+        closeConn(c);
+}
+
+static void acceptReady(struct wxquery *q)
+{
+    struct conn *c = NULL;
+    int i, fd, flags;
+
+    for (i = 0; i < WXQUERY_MAXCONN && c == NULL; i++)
+        if (q->conns[i].fd < 0)
+            c = &q->conns[i];
+    if (c == NULL)
+        return;
+    fd = accept(q->listenFd, NULL, NULL);
+    if (fd < 0)
+        return;
+    // Some systems hand it over non-blocking like the listener, some don't
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    c->fd = fd;
+    c->deadline = nowMs() + TIMEOUTSECS * 1000;
+    c->inLen = 0;
+}
+
+static void *worker(void *arg)
+{
+    struct wxquery *q = arg;
+    struct pollfd fds[2 + WXQUERY_MAXCONN];
+    struct conn *which[WXQUERY_MAXCONN];
+    long long now, soonest;
+    int i, n, nconn, timeout;
+
+    for (;;) {
+        fds[0].fd = q->wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = q->listenFd;
+        fds[1].events = POLLIN;
+        n = 2;
+        nconn = 0;
+        now = nowMs();
+        soonest = -1;
+        for (i = 0; i < WXQUERY_MAXCONN; i++) {
+            struct conn *c = &q->conns[i];
+            if (c->fd < 0)
+                continue;
+            if (c->deadline <= now) {
+                closeConn(c);
+                continue;
+            }
+            if (soonest < 0 || c->deadline < soonest)
+                soonest = c->deadline;
+            fds[n].fd = c->fd;
+            fds[n].events = c->out ? POLLOUT : POLLIN;
+            which[n - 2] = c;
+            n++;
+            nconn++;
+        }
+        // All full, the rest wait in the listen backlog
+        if (nconn == WXQUERY_MAXCONN)
+            fds[1].fd = -1;
+        timeout = soonest < 0 ? -1 : (int)(soonest - now);
+        if (poll(fds, n, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            wxlog_error("query server, %s\n", strerror(errno));
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        for (i = 2; i < n; i++)
+            if (fds[i].revents)
+                connReady(q, which[i - 2]);
+        if (fds[1].revents & POLLIN)
+            acceptReady(q);
+    }
+    for (i = 0; i < WXQUERY_MAXCONN; i++)
+        closeConn(&q->conns[i]);
+    return NULL;
+}
+
+struct wxquery *wxquery_start(struct wxhistory *history, int port)
+{
+    struct wxquery *q = calloc(1, sizeof(struct wxquery));
+    struct sockaddr_in addr;
+    int i, one = 1;
+
+    if (q == NULL)
+        return NULL;
+    q->history = history;
+    q->wake[0] = q->wake[1] = -1;
+    for (i = 0; i < WXQUERY_MAXCONN; i++)
+        q->conns[i].fd = -1;
+    q->recs = malloc(WXQUERY_MAXRECS * sizeof(struct wxhistory_rec));
+    q->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (q->recs == NULL || q->listenFd < 0 || pipe(q->wake) < 0)
+        goto fail;
+    fcntl(q->listenFd, F_SETFD, FD_CLOEXEC);
+    fcntl(q->listenFd, F_SETFL, O_NONBLOCK);
+    fcntl(q->wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(q->wake[1], F_SETFD, FD_CLOEXEC);
+    setsockopt(q->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(q->listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(q->listenFd, 64) < 0)
+        goto fail;
+    if (pthread_create(&q->thread, NULL, worker, q) != 0)
+        goto fail;
+    return q;
+
+fail:
+    if (q->listenFd >= 0)
+        close(q->listenFd);
+    if (q->wake[0] >= 0) {
+        close(q->wake[0]);
+        close(q->wake[1]);
+    }
+    free(q->recs);
+    free(q);
+    return NULL;
+}
+
+void wxquery_stop(struct wxquery *q)
+{
+    char b = 0;
+
+    if (q == NULL)
+        return;
+    if (write(q->wake[1], &b, 1) < 0)
+        ;
+    pthread_join(q->thread, NULL);
+    close(q->listenFd);
+    close(q->wake[0]);
+    close(q->wake[1]);
+    free(q->recs);
+    free(q->out);
+    free(q);
+}
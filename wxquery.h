@@ -0,0 +1,40 @@
+/*
+    A little HTTP/JSON server for dashboards and anything else that
+    wants the weather, answered straight out of the wxhistory in
+    memory.  No disk, and it runs on its own thread so however many
+    requests come in, the loop reading the consoles doesn't wait on
+    them.  It only listens on 127.0.0.1.
+
+        GET /latest                     every station's newest, an array
+        GET /latest?station=N           station N's newest, an object
+        GET /range?from=T&to=T          everything in between, oldest first
+                  &station=N            just the one station
+                  &step=S               averaged over S seconds at a time
+                  &limit=N              at most the newest N
+
+    Times are Unix seconds; from defaults to an hour ago and to to now.
+    The objects are the same JSON the daemon writes to stdout (see
+    wxsink.h).  With step, the numbers are averages over the step,
+    except the wind direction and rain, which are the last ones in it,
+    and every "t" is the start of the step.
+*/
+#ifndef WXQUERY_H
+#define WXQUERY_H
+
+#include "wxhistory.h"
+
+// Most records one answer will have
+#define WXQUERY_MAXRECS 8192
+// Most connections being read or answered at once; more wait to be
+// accepted
+#define WXQUERY_MAXCONN 16
+
+struct wxquery;
+
+// Start answering on port.  Block any signals you want handled
+// elsewhere first.  NULL if the port can't be had or the thread won't
+// start.
+struct wxquery *wxquery_start(struct wxhistory *history, int port);
+void wxquery_stop(struct wxquery *q);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+    The recovery ladder, see wxrecover.h.
+*/
+#include "wxrecover.h"
+
+static const char *names[WXRECOVER_STEPS + 1] = {
+    "retry", "clear halt", "reset", "reopen", "give up"
+};
+
+void wxrecover_init(struct wxrecover *r, unsigned int seed)
+{
+    r->step = -1;
+    r->tries = 0;
+    r->pending = WXRECOVER_RETRY;
+    r->since = 0;
+    r->seed = seed ? seed : 1;
+}
+
+// xorshift, it only has to keep the consoles out of step
+static unsigned int jitter(struct wxrecover *r)
+{
+    r->seed ^= r->seed << 13;
+    r->seed ^= r->seed >> 17;
+    r->seed ^= r->seed << 5;
+    return r->seed;
+}
+
+int wxrecover_failed(struct wxrecover *r, long long now, long *wait, int *failed)
+{
+    long d;
+
+    *failed = -1;
+    if (r->step < 0) {
+        r->step = WXRECOVER_RETRY;
+        r->tries = 0;
+        r->since = now;
+    }
+    // The ones above the bottom get one read each
+    else if (r->step > WXRECOVER_RETRY || r->tries >= WXRECOVER_RETRIES) {
+        *failed = r->step;
+        r->step++;
+        r->tries = 0;
+        r->since = now;
+        r->pending = r->step;
+        if (r->step == WXRECOVER_GIVEUP) {
+            wxrecover_init(r, r->seed);
+            *wait = 0;
+            return WXRECOVER_GIVEUP;
+        }
+    }
+    if (r->step == WXRECOVER_RETRY) {
+        // Somewhere between half and all of the doubled wait
+        d = (long)WXRECOVER_BACKOFF << r->tries;
+        *wait = d / 2 + jitter(r) % (d / 2 + 1);
+    } else
+        *wait = 1;
+    r->tries++;
+    return r->step;
+}
+
+int wxrecover_ok(struct wxrecover *r, long long now, long *took)
+{
+    int step = r->step;
+
+    if (step < 0)
+        return -1;
+    *took = (long)(now - r->since);
+    r->step = -1;
+    r->tries = 0;
+    r->pending = WXRECOVER_RETRY;
+    return step;
+}
+
+int wxrecover_take(struct wxrecover *r)
+{
+    int step = r->pending;
+
+    r->pending = WXRECOVER_RETRY;
+    return step;
+}
+
+int wxrecover_skip(struct wxrecover *r, int step, long long now)
+{
+    int failed = r->step;
+
+    r->step = step;
+    r->tries = 1;
+    r->since = now;
+    r->pending = step;
+    return failed;
+}
+
+const char *wxrecover_name(int step)
+{
+    if (step < 0 || step > WXRECOVER_GIVEUP)
+        return "none";
+    return names[step];
+}
@@ -0,0 +1,64 @@
+/*
+    What to do about a console that didn't answer.
+
+    Most of the time it's a glitch, and reading again a moment later
+    works.  When it doesn't, there's a ladder of harder and harder
+    things to try, each followed by another read:
+
+        retry       just read again, a few times, backing off
+        clear halt  clear the stall on the interrupt endpoint, the
+                    same thing openOne() does for the plug and unplug bug
+        reset       reset the device, which puts it back the way it was
+                    when it was plugged in
+        reopen      let go of it altogether and open it again
+
+    and a read that works at any point puts it back at the bottom.  A
+    reset that makes the console come back as a new device goes straight
+    on to reopen, there's nothing left to read from.  Only
+    when the top one doesn't work is the station given up on, the way
+    it always was.  The waits between retries double each time, with a
+    random part so consoles on the same hub don't all come back at
+    once.
+
+    This is only the deciding; weatherstation.c does the USB part.
+*/
+#ifndef WXRECOVER_H
+#define WXRECOVER_H
+
+enum {
+    WXRECOVER_RETRY,
+    WXRECOVER_CLEARHALT,
+    WXRECOVER_RESET,
+    WXRECOVER_REOPEN,
+    WXRECOVER_STEPS,
+    WXRECOVER_GIVEUP = WXRECOVER_STEPS
+};
+
+#define WXRECOVER_RETRIES   3       // reads on the bottom step
+#define WXRECOVER_BACKOFF   50      // ms before the first of them, doubling
+
+struct wxrecover {
+    int             step;       // where we are on the ladder, -1 when it's working
+    int             tries;      // reads so far on this step
+    int             pending;    // a step still to be taken before the next read
+    long long       since;      // ms, when we got to this step
+    unsigned int    seed;       // for the jitter
+};
+
+void wxrecover_init(struct wxrecover *r, unsigned int seed);
+// A read didn't work at now (ms).  Returns the step to take, with how
+// long to wait before reading again in *wait, or WXRECOVER_GIVEUP.
+// *failed gets the step that was being tried, or -1.
+int wxrecover_failed(struct wxrecover *r, long long now, long *wait, int *failed);
+// A read worked.  Returns the step that got it going again, with how
+// long after the step began in *took, or -1 if nothing was wrong.
+int wxrecover_ok(struct wxrecover *r, long long now, long *took);
+// The step to take before the next read, just the once; RETRY for none
+int wxrecover_take(struct wxrecover *r);
+// Go straight to step at now (ms), passing over any below it, when it's
+// plain the one being tried can't work.  Returns the step that was being
+// tried, or -1.
+int wxrecover_skip(struct wxrecover *r, int step, long long now);
+const char *wxrecover_name(int step);
+
+#endif
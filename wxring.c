@@ -0,0 +1,100 @@
+/*
+    SPSC ring, see wxring.h.
+
+    head is only written by the producer and tail only by the consumer.
+    Both just count up and wrap naturally; the slot is the count masked
+    by the capacity.  The release store on one side pairs with the
+    acquire load on the other so the item bytes are visible before the
+    index that covers them.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "wxring.h"
+
+struct wxring {
+    size_t          itemSize;
+    unsigned int    mask;
+    // Kept on separate cache lines so the two threads don't fight over them
+    _Atomic unsigned int    head __attribute__((aligned(64)));
+    unsigned long           pushed;
+    unsigned long           dropped;
+    unsigned int            highWater;
+    _Atomic unsigned int    tail __attribute__((aligned(64)));
+    unsigned long           popped;
+    unsigned char           items[] __attribute__((aligned(64)));
+};
+
+struct wxring *wxring_new(size_t itemSize, unsigned int capacity)
+{
+    struct wxring *ring;
+    unsigned int size = 1;
+
+    if (itemSize == 0 || capacity == 0)
+        return NULL;
+    while (size < capacity)
+        size <<= 1;
+    ring = calloc(1, sizeof(struct wxring) + itemSize * size);
+    if (ring == NULL)
+        return NULL;
+    ring->itemSize = itemSize;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring;
+}
+
+void wxring_free(struct wxring *ring)
+{
+    free(ring);
+}
+
+int wxring_push(struct wxring *ring, const void *item)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned int depth = head - tail;
+
+    if (depth > ring->mask) {
+        ring->dropped++;
+        return -1;
+    }
+    memcpy(&ring->items[(head & ring->mask) * ring->itemSize], item, ring->itemSize);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    ring->pushed++;
+    if (depth + 1 > ring->highWater)
+        ring->highWater = depth + 1;
+    return 0;
+}
+
+int wxring_pop(struct wxring *ring, void *item)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail)
+        return -1;
+    memcpy(item, &ring->items[(tail & ring->mask) * ring->itemSize], ring->itemSize);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    ring->popped++;
+    return 0;
+}
+
+unsigned int wxring_depth(struct wxring *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+void wxring_get_stats(struct wxring *ring, struct wxring_stats *stats)
+{
+    // The plain counters belong to one side or the other, so these can be
+    // a count or two stale when read from the other thread.  Good enough
+    // for a status line.
+    stats->pushed = ring->pushed;
+    stats->popped = ring->popped;
+    stats->dropped = ring->dropped;
+    stats->highWater = ring->highWater;
+    stats->depth = wxring_depth(ring);
+}
@@ -0,0 +1,39 @@
+/*
+    A bounded single producer / single consumer ring of fixed size items.
+
+    One thread pushes, one other thread pops, and neither ever takes a
+    lock or waits on the other.  Items are copied in and copied out, so
+    the producer can go right back to scribbling on its own copy.  When
+    the ring is full the new item is dropped and counted; the producer
+    is not allowed to touch the consumer's end, so it can't throw away
+    the oldest one instead.
+*/
+#ifndef WXRING_H
+#define WXRING_H
+
+#include <stddef.h>
+
+struct wxring;
+
+struct wxring_stats {
+    unsigned long   pushed;     // made it into the ring
+    unsigned long   popped;
+    unsigned long   dropped;    // ring was full
+    unsigned int    depth;      // waiting right now
+    unsigned int    highWater;  // deepest it has been
+};
+
+// capacity is rounded up to a power of two.  Returns NULL if out of memory.
+struct wxring *wxring_new(size_t itemSize, unsigned int capacity);
+void wxring_free(struct wxring *ring);
+
+// Producer side.  Returns 0, or -1 if the ring was full and item dropped.
+int wxring_push(struct wxring *ring, const void *item);
+// Consumer side.  Returns 0, or -1 if there was nothing to pop.
+int wxring_pop(struct wxring *ring, void *item);
+
+// Either side, or anybody else; the numbers are a snapshot.
+unsigned int wxring_depth(struct wxring *ring);
+void wxring_get_stats(struct wxring *ring, struct wxring_stats *stats);
+
+#endif
@@ -0,0 +1,249 @@
+/*
+    Report 1 scheduling, see wxsched.h.
+*/
+#include <stddef.h>
+
+#define FALSE 0
+#define TRUE 1
+
+#include "wxsched.h"
+
+// Any further from what it's supposed to be than this, and it's really
+// two periods with a frame missing, or something that isn't the head
+#define MINPERIOD   (WXSCHED_PERIOD / 2)
+#define MAXPERIOD   (WXSCHED_PERIOD * 3 / 2)
+// Known to within this, and the window's good enough to go by
+#define SYNCED      (2 * WXSCHED_SEARCH)
+#define MISSES      3
+// Don't let the early side of the window out more than this many doublings
+#define MAXUNSURE   4
+// How far into the window the first read goes, in quarters
+#define PROBE       3
+
+void wxsched_init(struct wxsched *s, long maxWait)
+{
+    s->period = WXSCHED_PERIOD;
+    s->maxWait = maxWait;
+    s->lo = s->hi = 0;
+    s->anchor = 0;
+    s->lastSent = 0;
+    s->missed = 0;
+    s->stale = 0;
+    s->wasStale = FALSE;
+    s->unsure = 0;
+}
+
+static long long nearest(long long gap, long period)
+{
+    return (gap + period / 2) / period;
+}
+
+// A frame turned up in (lo, hi].  If we know where the last one was,
+// that narrows it down and says how long the period is.  The window
+// only says when the frame could have come if the period's right,
+// which it isn't until a stale read right before has shown where the
+// frame wasn't.  Until then the early side of it is let out further
+// every time, so the first read goes earlier and earlier until one of
+// them does come back stale.
+static void found(struct wxsched *s, long long lo, long long hi, int confirmed)
+{
+    long long k, plo, phi, p, mid = (lo + hi) / 2;
+
+    if (confirmed)
+        s->unsure = 0;
+    else if (s->unsure < MAXUNSURE)
+        s->unsure++;
+
+    // Looking for it a second at a time we see every frame, so two in a
+    // row we're sure of are a period apart, whatever we thought it was
+    if (s->hi == 0) {
+        if (!confirmed || lo == 0 || hi - lo > SYNCED) {
+            s->anchor = 0;
+            return;
+        }
+        p = mid - s->anchor;
+        if (s->anchor && p >= MINPERIOD && p <= MAXPERIOD) {
+            s->period = p;
+            s->lo = lo;
+            s->hi = hi;
+        }
+        s->anchor = mid;
+        return;
+    }
+
+    k = nearest(hi - s->hi, s->period);
+    if (k < 1)
+        k = 1;
+    plo = s->lo + k * s->period - ((long long)WXSCHED_SLACK << s->unsure);
+    phi = s->hi + k * s->period + WXSCHED_SLACK;
+    if (plo < hi && phi > lo) {
+        if (plo > lo)
+            lo = plo;
+        if (phi < hi)
+            hi = phi;
+    }
+    if (hi - lo > s->period / 4) {
+        s->lo = s->hi = 0;
+        s->anchor = 0;
+        return;
+    }
+    s->lo = lo;
+    s->hi = hi;
+    // After that the period only comes from frames we're sure of
+    if (!confirmed || hi - lo > SYNCED)
+        return;
+    mid = (lo + hi) / 2;
+    k = nearest(mid - s->anchor, s->period);
+    if (s->anchor && k >= 1 && k <= 20) {
+        p = (mid - s->anchor) / k;
+        if (p >= MINPERIOD && p <= MAXPERIOD)
+            s->period += (p - s->period) / 4;
+    }
+    s->anchor = mid;
+}
+
+static long until(long long when, long long now)
+{
+    return when - now > 1 ? when - now : 1;
+}
+
+long wxsched_next(struct wxsched *s, long long sent, long long now, int fresh)
+{
+    long long prev = s->lastSent, lo, hi;
+
+    s->lastSent = sent;
+    if (fresh) {
+        found(s, prev, sent, s->wasStale);
+        s->missed = 0;
+        s->stale = 0;
+        s->wasStale = FALSE;
+        goto aim;
+    }
+    s->wasStale = TRUE;
+    if (s->hi) {
+        hi = s->hi + s->period + WXSCHED_SLACK;
+        // Not there yet, it has to be in what's left of the window
+        if (sent < hi)
+            return until(hi, now);
+        // Late, or it's not coming.  Keep looking, less and less often,
+        // for a while; guess wrong and the next frame gets taken for
+        // this one, a period out.
+        if (sent < hi + s->period / 8)
+            return (2 * WXSCHED_SLACK) << (s->stale < 4 ? s->stale++ : 4);
+        s->stale = 0;
+        // Never came.  The one after should be where it always was.
+        if (++s->missed < MISSES) {
+            s->lo += s->period;
+            s->hi += s->period;
+        } else
+            s->lo = s->hi = 0;
+    } else if (++s->stale * WXSCHED_SEARCH > 3 * s->period)
+        return s->maxWait;
+
+aim:
+    if (s->hi == 0)
+        return WXSCHED_SEARCH;
+    lo = s->lo + s->period - ((long long)WXSCHED_SLACK << s->unsure);
+    hi = s->hi + s->period + WXSCHED_SLACK;
+    return until(lo + (hi - lo) * PROBE / 4, now);
+}
+
+/*
+    The heap.  Ids are small numbers, so where each one is in the heap
+    is kept in an array by id, and moving one is a sift either way.
+*/
+static void place(struct wxsched_heap *h, int i, int id)
+{
+    h->id[i] = id;
+    h->pos[id] = i;
+}
+
+static void siftUp(struct wxsched_heap *h, int i)
+{
+    int id = h->id[i], parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (h->due[h->id[parent]] <= h->due[id])
+            break;
+        place(h, i, h->id[parent]);
+        i = parent;
+    }
+    place(h, i, id);
+}
+
+static void siftDown(struct wxsched_heap *h, int i)
+{
+    int id = h->id[i], child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= h->n)
+            break;
+        if (child + 1 < h->n && h->due[h->id[child + 1]] < h->due[h->id[child]])
+            child++;
+        if (h->due[id] <= h->due[h->id[child]])
+            break;
+        place(h, i, h->id[child]);
+        i = child;
+    }
+    place(h, i, id);
+}
+
+void wxsched_heap_init(struct wxsched_heap *h)
+{
+    int i;
+
+    h->n = 0;
+    for (i = 0; i < WXSCHED_MAX; i++)
+        h->pos[i] = -1;
+}
+
+void wxsched_set(struct wxsched_heap *h, int id, long long due)
+{
+    int i;
+
+    if (id < 0 || id >= WXSCHED_MAX)
+        return;
+    i = h->pos[id];
+    h->due[id] = due;
+    if (i < 0) {
+        i = h->n++;
+        place(h, i, id);
+    }
+    siftUp(h, i);
+    siftDown(h, h->pos[id]);
+}
+
+void wxsched_remove(struct wxsched_heap *h, int id)
+{
+    int i, last;
+
+    if (id < 0 || id >= WXSCHED_MAX || (i = h->pos[id]) < 0)
+        return;
+    h->pos[id] = -1;
+    last = h->id[--h->n];
+    if (i == h->n)
+        return;
+    place(h, i, last);
+    siftUp(h, i);
+    siftDown(h, h->pos[last]);
+}
+
+int wxsched_peek(const struct wxsched_heap *h, long long *due)
+{
+    if (h->n == 0)
+        return -1;
+    if (due)
+        *due = h->due[h->id[0]];
+    return h->id[0];
+}
+
+int wxsched_pop(struct wxsched_heap *h)
+{
+    int id = wxsched_peek(h, NULL);
+
+    if (id >= 0)
+        wxsched_remove(h, id);
+    return id;
+}
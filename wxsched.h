@@ -0,0 +1,73 @@
+/*
+    When to read report 1.
+
+    The 5 in 1 head sends a frame about every 18 seconds and the console
+    hands back the last one it got however often it's asked, so reading
+    on a fixed 10 second tick gets mostly frames we already have, and a
+    new one sits in the console for 5 seconds on average before we see
+    it.  Instead each station learns when its head sends and reads just
+    after that.
+
+    A read that brings back the frame we had is stale, one with a new
+    frame is fresh.  A fresh read says the frame was sent since the read
+    before it, so we always know a window it was sent in, and a period
+    later is the window for the next one, give or take a little slack.
+    The first read goes three quarters of the way into that window.
+    Fresh, and the window for the next one is that much narrower; stale,
+    and a second read at the end of the window finds it, in a window a
+    quarter the size.  Either way it settles down to a window of a few
+    hundred milliseconds, where most frames take one read and none
+    waits long.  The period is measured from the windows as they go by.
+
+    A frame that's late gets looked for a few more times.  One the head
+    doesn't send at all, or the console doesn't hear, just means
+    looking a period later.  A few of those in a row and we've
+    lost it: read every second until a frame turns up, and if none does
+    for a while, fall back to the old fixed tick.
+
+    The deadlines for all the stations go on a min-heap, so one loop
+    timer set for the soonest does for all of them.
+*/
+#ifndef WXSCHED_H
+#define WXSCHED_H
+
+#define WXSCHED_PERIOD  18000   // ms, what the head is supposed to do
+#define WXSCHED_SLACK   100     // how far a frame can wander from the period
+#define WXSCHED_SEARCH  1000    // read this often when we don't know
+#define WXSCHED_MAX     32      // stations on a heap
+
+// One per station
+struct wxsched {
+    long        period;     // ms between frames, as measured
+    long        maxWait;    // the old tick, for when we've lost it
+    long long   lo, hi;     // the last frame was sent after lo and by hi, 0 when we don't know
+    long long   anchor;     // the middle of the last window we were sure of
+    long long   lastSent;   // when the last read went out
+    int         missed;     // frames in a row that didn't turn up
+    int         stale;      // reads in a row that didn't find one when it was due
+    int         wasStale;   // the last read
+    int         unsure;     // frames since a stale read showed where one wasn't
+};
+
+void wxsched_init(struct wxsched *s, long maxWait);
+// A report 1 read that went out at sent (ms) came back.  Returns how
+// many ms after now to send the next one.
+long wxsched_next(struct wxsched *s, long long sent, long long now, int fresh);
+
+// Deadlines by id, soonest first
+struct wxsched_heap {
+    int         n;
+    int         id[WXSCHED_MAX];        // the heap
+    int         pos[WXSCHED_MAX];       // where each id is in it, -1 if it isn't
+    long long   due[WXSCHED_MAX];       // by id
+};
+
+void wxsched_heap_init(struct wxsched_heap *h);
+// Put id on the heap for due, or move it there if it's on already
+void wxsched_set(struct wxsched_heap *h, int id, long long due);
+void wxsched_remove(struct wxsched_heap *h, int id);
+// The soonest id, and when, or -1 if there's nothing on the heap
+int wxsched_peek(const struct wxsched_heap *h, long long *due);
+int wxsched_pop(struct wxsched_heap *h);
+
+#endif
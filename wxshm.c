@@ -0,0 +1,103 @@
+/*
+    Publishing observations to shared memory, see wxshm.h.
+
+    The segment is left where it is when the daemon stops, so readers
+    can keep it mapped across a restart; starting again empties it in
+    place.  magic goes to 0 while that's going on, which is what tells
+    a reader to wait.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "weatherstation.h"
+#include "wxshm.h"
+#include "wxlog.h"
+
+struct wxshm {
+    struct wxshm_header *   hdr;
+    struct wxshm_slot *     slots;
+    size_t                  size;
+};
+
+struct wxshm *wxshm_create(const char *name)
+{
+    struct wxshm *shm = calloc(1, sizeof(struct wxshm));
+    void *map;
+    int fd;
+
+    if (shm == NULL)
+        return NULL;
+    shm->size = sizeof(struct wxshm_header) + WXSHM_SLOTS * sizeof(struct wxshm_slot);
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        goto fail;
+    // Readable by anybody whatever the umask says, that's the point of it
+    fchmod(fd, 0644);
+    if (ftruncate(fd, shm->size) < 0) {
+        close(fd);
+        goto fail;
+    }
+    map = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        goto fail;
+    shm->hdr = map;
+    shm->slots = (struct wxshm_slot *)(shm->hdr + 1);
+
+    __atomic_store_n(&shm->hdr->magic, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(shm->slots, 0, WXSHM_SLOTS * sizeof(struct wxshm_slot));
+    shm->hdr->version = WXSHM_VERSION;
+    shm->hdr->nslots = WXSHM_SLOTS;
+    shm->hdr->slotSize = sizeof(struct wxshm_slot);
+    shm->hdr->pid = getpid();
+    shm->hdr->started = time(NULL);
+    __atomic_store_n(&shm->hdr->head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->hdr->magic, WXSHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+
+fail:
+    wxlog_error("Couldn't share observations in %s, %s\n", name, strerror(errno));
+    free(shm);
+    return NULL;
+}
+
+void wxshm_close(struct wxshm *shm)
+{
+    if (shm == NULL)
+        return;
+    munmap(shm->hdr, shm->size);
+    free(shm);
+}
+
+void wxshm_publish(struct wxshm *shm, int station, unsigned int sample, time_t when,
+                   const struct weatherData *wx)
+{
+    uint32_t head = __atomic_load_n(&shm->hdr->head, __ATOMIC_RELAXED);
+    struct wxshm_slot *s = &shm->slots[head & (WXSHM_SLOTS - 1)];
+    struct wxshm_obs *o = &s->obs;
+
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    o->when = when;
+    o->station = station;
+    o->sample = sample;
+    o->windSpeed = wx->windSpeed;
+    o->windDirection = wx->windDirection;
+    o->temperature = wx->temperature;
+    o->humidity = wx->humidity;
+    o->rainCounter = wx->rainCounter;
+    o->rainRaw = wx->rainRaw;
+    o->barometer = wx->barometer;
+    o->wsTime = wx->wsTime;
+    o->wdTime = wx->wdTime;
+    o->tTime = wx->tTime;
+    o->hTime = wx->hTime;
+    o->rcTime = wx->rcTime;
+    o->rrTime = wx->rrTime;
+    o->bTime = wx->bTime;
+    __atomic_store_n(&s->seq, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm->hdr->head, head + 1, __ATOMIC_RELEASE);
+}
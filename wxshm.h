@@ -0,0 +1,173 @@
+/*
+    Every observation, in shared memory for anything else on the box
+    that wants it (-m name).  A dashboard or a logger maps
+    /dev/shm/name and reads it, without asking the daemon for anything,
+    without a system call for each one, and without the daemon knowing
+    or caring how many there are.
+
+    It's the same ring as wxhistory.h, laid out for other processes:
+    a header, then WXSHM_SLOTS slots of one observation each.  The
+    daemon is the only writer.  A slot's seq is 0 while it's being
+    written and the observation's number plus one once it's done, and
+    head is how many there have ever been, so the newest is number
+    head - 1.  A reader copies a slot out and checks seq is still what
+    it was; if it isn't, the daemon has lapped it and that one's gone.
+
+    Everything's native byte order and a fixed size, with the padding
+    spelled out, so the layout is the same on every compiler; anything
+    that changes it changes WXSHM_VERSION.  When the daemon starts again
+    it empties the ring in place, so a reader that keeps it mapped sees
+    started change and head go back to 0 and carries on.
+
+    The reader half is all in here, so a C program only needs this file
+    (and -lrt on older glibc).  wxshm.py is the same thing for Python.
+*/
+#ifndef WXSHM_H
+#define WXSHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define WXSHM_MAGIC     0x4d534857u     // "WXSM"
+#define WXSHM_VERSION   1
+#define WXSHM_SLOTS     4096            // a power of two, most of a day with one console
+
+struct wxshm_header {
+    uint32_t    magic;      // WXSHM_MAGIC once it's ready to read
+    uint32_t    version;
+    uint32_t    nslots;
+    uint32_t    slotSize;
+    uint32_t    head;       // observations ever published
+    uint32_t    pid;        // of the daemon
+    int64_t     started;    // when it started, different every time
+    uint8_t     pad[32];
+};
+
+// weatherData, with the sizes pinned down.  Times are Unix seconds.
+struct wxshm_obs {
+    int64_t     when;
+    uint32_t    station;
+    uint32_t    sample;         // the trace id, see wxtrace.h
+    float       windSpeed;      // mph
+    int32_t     windDirection;  // 0-15, an index into Direction[]
+    float       temperature;    // °F
+    int32_t     humidity;       // %
+    int32_t     rainCounter;    // hundredths of an inch today
+    int32_t     rainRaw;
+    float       barometer;      // inHg
+    uint32_t    pad;
+    int64_t     wsTime, wdTime, tTime, hTime, rcTime, rrTime, bTime;
+};
+
+struct wxshm_slot {
+    uint32_t            seq;
+    uint32_t            pad;
+    struct wxshm_obs    obs;
+    uint8_t             pad2[16];
+};
+
+_Static_assert(sizeof(struct wxshm_header) == 64, "wxshm header layout");
+_Static_assert(sizeof(struct wxshm_obs) == 104, "wxshm observation layout");
+_Static_assert(sizeof(struct wxshm_slot) == 128, "wxshm slot layout");
+
+/*
+    Reading.  wxshm_open_reader() maps it read only and starts at the
+    newest; set next back as far as head - nslots to get what's there
+    already.  wxshm_next() returns 1 with the next observation, or 0 when
+    there's nothing new yet.  Ones the daemon overwrote before we got to
+    them are skipped and counted in lost.
+*/
+struct wxshm_reader {
+    const struct wxshm_header * hdr;
+    const struct wxshm_slot *   slots;
+    size_t                      size;
+    int64_t                     started;
+    uint32_t                    next;       // the number we want next
+    unsigned long               lost;
+};
+
+static inline int wxshm_open_reader(struct wxshm_reader *r, const char *name)
+{
+    size_t size = sizeof(struct wxshm_header) + WXSHM_SLOTS * sizeof(struct wxshm_slot);
+    void *map;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    r->hdr = map;
+    r->slots = (const struct wxshm_slot *)(r->hdr + 1);
+    r->size = size;
+    r->started = r->hdr->started;
+    r->next = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    r->lost = 0;
+    if (r->hdr->version != WXSHM_VERSION || r->hdr->nslots != WXSHM_SLOTS ||
+        r->hdr->slotSize != sizeof(struct wxshm_slot)) {
+        munmap(map, size);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void wxshm_close_reader(struct wxshm_reader *r)
+{
+    munmap((void *)r->hdr, r->size);
+}
+
+static inline int wxshm_next(struct wxshm_reader *r, struct wxshm_obs *obs)
+{
+    const struct wxshm_header *h = r->hdr;
+    const struct wxshm_slot *s;
+    uint32_t head, seq;
+
+    for (;;) {
+        // Being emptied for a new start
+        if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != WXSHM_MAGIC)
+            return 0;
+        head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (h->started != r->started || head < r->next) {
+            r->started = h->started;
+            r->next = 0;
+        }
+        if (r->next == head)
+            return 0;
+        if (head - r->next > WXSHM_SLOTS) {
+            r->lost += head - r->next - WXSHM_SLOTS;
+            r->next = head - WXSHM_SLOTS;
+        }
+        s = &r->slots[r->next & (WXSHM_SLOTS - 1)];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == r->next + 1) {
+            memcpy(obs, &s->obs, sizeof(*obs));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+                r->next++;
+                return 1;
+            }
+        }
+        r->lost++;
+        r->next++;
+    }
+}
+
+/*
+    Writing, the daemon only.  name is what shm_open() wants, "/name".
+*/
+struct weatherData;
+struct wxshm;
+
+// NULL if it can't be made
+struct wxshm *wxshm_create(const char *name);
+void wxshm_close(struct wxshm *shm);
+void wxshm_publish(struct wxshm *shm, int station, unsigned int sample, time_t when,
+                   const struct weatherData *wx);
+
+#endif
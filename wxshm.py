@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Reading the observations weatherstation publishes with -m name, see
+wxshm.h for the layout.  This is wxshm_next() over again.
+
+    import wxshm
+    r = wxshm.Reader("weather")
+    while True:
+        for obs in r:
+            print(obs["temperature"])
+        time.sleep(1)
+
+Or run it, python3 wxshm.py weather, and it prints each one as a line
+of JSON as it turns up.  -a starts with what's there already.
+
+Python can't fence the way the C reader does, but copying the slot out
+and checking seq again afterwards catches the daemon writing over it
+all the same on anything the daemon runs on.
+"""
+import json
+import mmap
+import os
+import struct
+import sys
+import time
+
+MAGIC = 0x4d534857
+VERSION = 1
+SLOTS = 4096
+
+HEADER = struct.Struct("=IIIIIIq32x")
+OBS = "qIIfifiiif4xqqqqqqq"
+SLOT = struct.Struct("=I4x" + OBS + "16x")
+FIELDS = ("when", "station", "sample", "windSpeed", "windDirection",
+          "temperature", "humidity", "rainCounter", "rainRaw", "barometer",
+          "wsTime", "wdTime", "tTime", "hTime", "rcTime", "rrTime", "bTime")
+
+
+class Reader:
+    def __init__(self, name, everything=False):
+        path = os.path.join("/dev/shm", name.lstrip("/"))
+        with open(path, "rb") as f:
+            self.map = mmap.mmap(f.fileno(), HEADER.size + SLOTS * SLOT.size,
+                                 prot=mmap.PROT_READ)
+        magic, version, nslots, size, head, pid, started = self.header()
+        if version != VERSION or nslots != SLOTS or size != SLOT.size:
+            self.map.close()
+            raise ValueError("%s isn't version %d of the layout" % (path, VERSION))
+        self.started = started
+        self.next = max(head - SLOTS, 0) if everything else head
+        self.lost = 0
+
+    def header(self):
+        return HEADER.unpack_from(self.map, 0)
+
+    def close(self):
+        self.map.close()
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        while True:
+            magic, _, _, _, head, _, started = self.header()
+            # Being emptied for a new start
+            if magic != MAGIC:
+                raise StopIteration
+            if started != self.started or head < self.next:
+                self.started = started
+                self.next = 0
+            if self.next == head:
+                raise StopIteration
+            if head - self.next > SLOTS:
+                self.lost += head - self.next - SLOTS
+                self.next = head - SLOTS
+            at = HEADER.size + (self.next % SLOTS) * SLOT.size
+            slot = SLOT.unpack_from(self.map, at)
+            if slot[0] == self.next + 1 and \
+               struct.unpack_from("=I", self.map, at)[0] == slot[0]:
+                self.next += 1
+                return dict(zip(FIELDS, slot[1:]))
+            self.lost += 1
+            self.next += 1
+
+
+def main():
+    args = [a for a in sys.argv[1:] if a != "-a"]
+    if len(args) != 1:
+        sys.exit("usage: wxshm.py [-a] name")
+    r = Reader(args[0], everything="-a" in sys.argv[1:])
+    try:
+        while True:
+            for obs in r:
+                print(json.dumps(obs), flush=True)
+            time.sleep(0.25)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,312 @@
+/*
+    Output sinks, see wxsink.h.
+
+    The JSON has the same names showit() always used, less the second
+    "windDirection" (its WDD went in with WDS) and less the quotes
+    around the numbers, plus which console it's from:
+
+        {"station":0,"windSpeed":{"WS":3.5,"t":1700000000},
+         "windDirection":{"WDS":"NW","WDD":315,"t":1700000000},
+         "windDirRaw":{"WDR":0,"t":1700000000}, ...}
+
+    all on one line.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "wxsink.h"
+#include "wxdecode.h"
+
+_Static_assert(sizeof(struct wxsink_rec) == 104, "wxsink_rec layout changed");
+_Static_assert(sizeof(struct wxsink_rec) <= WXSINK_RECMAX, "wxsink_rec too big");
+
+// A full batch and the CSV header can be more than one writev() takes
+#ifndef IOV_MAX
+#define IOV_MAX 16  // what POSIX promises
+#endif
+
+static const char csvHeader[] =
+    "time,station,windSpeed,windDirection,temperature,humidity,rainCounter,rainRaw,barometer\n";
+
+struct wxsink {
+    int             fd;
+    int             format;
+    int             batch;
+    int             n;          // records waiting
+    char *          buf;        // batch slots of WXSINK_RECMAX
+    struct iovec *  iov;
+    int             needHeader;
+    struct wxsink_stats stats;
+};
+
+/*
+    Number formatting.  Each one writes at p and returns the end.
+*/
+#define PUTS(p, s)  (memcpy((p), (s), sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+static char *putInt(char *p, long v)
+{
+    char tmp[24];
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+    int n = 0;
+
+    if (v < 0)
+        *p++ = '-';
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+// One place after the point, like %0.1f
+static char *putTenths(char *p, float f)
+{
+    double d = f;
+    long t;
+
+    // Nothing we measure gets anywhere near this, but NaN might
+    if (!(d > -1e12 && d < 1e12))
+        d = 0;
+    t = (long)(d * 10.0 + (d < 0 ? -0.5 : 0.5));
+    if (t < 0) {
+        *p++ = '-';
+        t = -t;
+    }
+    p = putInt(p, t / 10);
+    *p++ = '.';
+    *p++ = '0' + t % 10;
+    return p;
+}
+
+static char *putStr(char *p, const char *s)
+{
+    while (*s)
+        *p++ = *s++;
+    return p;
+}
+
+static int formatJson(int station, const struct weatherData *wx, char *buf)
+{
+    int dir = wx->windDirection & 0x0f;
+    char *p = buf;
+
+    p = PUTS(p, "{\"station\":");
+    p = putInt(p, station);
+    p = PUTS(p, ",\"windSpeed\":{\"WS\":");
+    p = putTenths(p, wx->windSpeed);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->wsTime);
+    p = PUTS(p, "},\"windDirection\":{\"WDS\":\"");
+    p = putStr(p, Direction[dir]);
+    p = PUTS(p, "\",\"WDD\":");
+    p = putStr(p, DirectionNum[dir]);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->wdTime);
+    p = PUTS(p, "},\"windDirRaw\":{\"WDR\":");
+    p = putInt(p, wx->windDirection);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->wdTime);
+    p = PUTS(p, "},\"temperature\":{\"T\":");
+    p = putTenths(p, wx->temperature);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->tTime);
+    p = PUTS(p, "},\"humidity\":{\"H\":");
+    p = putInt(p, wx->humidity);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->hTime);
+    p = PUTS(p, "},\"rainCounter\":{\"RC\":");
+    p = putInt(p, wx->rainCounter);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->rcTime);
+    p = PUTS(p, "},\"rainRaw\":{\"RR\":");
+    p = putInt(p, wx->rainRaw);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->rrTime);
+    p = PUTS(p, "},\"Barometer\":{\"BP\":");
+    p = putTenths(p, wx->barometer);
+    p = PUTS(p, ",\"t\":");
+    p = putInt(p, wx->bTime);
+    p = PUTS(p, "}}\n");
+    return p - buf;
+}
+
+static int formatCsv(int station, time_t when, const struct weatherData *wx, char *buf)
+{
+    char *p = buf;
+
+    p = putInt(p, when);
+    *p++ = ',';
+    p = putInt(p, station);
+    *p++ = ',';
+    p = putTenths(p, wx->windSpeed);
+    *p++ = ',';
+    p = putInt(p, wx->windDirection);
+    *p++ = ',';
+    p = putTenths(p, wx->temperature);
+    *p++ = ',';
+    p = putInt(p, wx->humidity);
+    *p++ = ',';
+    p = putInt(p, wx->rainCounter);
+    *p++ = ',';
+    p = putInt(p, wx->rainRaw);
+    *p++ = ',';
+    p = putTenths(p, wx->barometer);
+    *p++ = '\n';
+    return p - buf;
+}
+
+static int formatBin(int station, time_t when, const struct weatherData *wx, char *buf)
+{
+    struct wxsink_rec rec;
+
+    rec.magic = WXSINK_MAGIC;
+    rec.size = sizeof(rec);
+    rec.version = WXSINK_VERSION;
+    rec.time = when;
+    rec.wsTime = wx->wsTime;
+    rec.wdTime = wx->wdTime;
+    rec.tTime = wx->tTime;
+    rec.hTime = wx->hTime;
+    rec.rcTime = wx->rcTime;
+    rec.rrTime = wx->rrTime;
+    rec.bTime = wx->bTime;
+    rec.windSpeed = wx->windSpeed;
+    rec.temperature = wx->temperature;
+    rec.barometer = wx->barometer;
+    rec.windDirection = wx->windDirection;
+    rec.humidity = wx->humidity;
+    rec.rainCounter = wx->rainCounter;
+    rec.rainRaw = wx->rainRaw;
+    rec.station = station;
+    memcpy(buf, &rec, sizeof(rec));
+    return sizeof(rec);
+}
+
+int wxsink_format(int format, int station, time_t when, const struct weatherData *wx, char *buf)
+{
+    switch (format) {
+        case WXSINK_JSON:
+            return formatJson(station, wx, buf);
+        case WXSINK_CSV:
+            return formatCsv(station, when, wx, buf);
+        case WXSINK_BIN:
+            return formatBin(station, when, wx, buf);
+    }
+    return 0;
+}
+
+int wxsink_format_by_name(const char *name)
+{
+    if (strcmp(name, "json") == 0)
+        return WXSINK_JSON;
+    if (strcmp(name, "csv") == 0)
+        return WXSINK_CSV;
+    if (strcmp(name, "bin") == 0)
+        return WXSINK_BIN;
+    return -1;
+}
+
+struct wxsink *wxsink_open(int fd, int format, int batch)
+{
+    struct wxsink *sink;
+
+    if (batch < 1)
+        batch = 1;
+    if (batch > WXSINK_MAXBATCH)
+        batch = WXSINK_MAXBATCH;
+    sink = calloc(1, sizeof(struct wxsink));
+    if (sink == NULL)
+        return NULL;
+    sink->fd = fd;
+    sink->format = format;
+    sink->batch = batch;
+    sink->buf = malloc((size_t)batch * WXSINK_RECMAX);
+    sink->iov = calloc(batch + 1, sizeof(struct iovec));
+    if (sink->buf == NULL || sink->iov == NULL) {
+        wxsink_close(sink);
+        return NULL;
+    }
+    sink->needHeader = format == WXSINK_CSV;
+    return sink;
+}
+
+void wxsink_close(struct wxsink *sink)
+{
+    if (sink == NULL)
+        return;
+    if (sink->buf && sink->iov)
+        wxsink_flush(sink);
+    free(sink->buf);
+    free(sink->iov);
+    free(sink);
+}
+
+int wxsink_flush(struct wxsink *sink)
+{
+    struct iovec *iov = sink->iov;
+    int niov = sink->n + sink->needHeader;
+    ssize_t done;
+
+    if (sink->n == 0)
+        return 0;
+    // The CSV header rides along with the first batch, wxsink_write()
+    // left slot 0 for it
+    if (sink->needHeader) {
+        iov[0].iov_base = (void *)csvHeader;
+        iov[0].iov_len = sizeof(csvHeader) - 1;
+    }
+
+    // Keep at it until it's all gone, a pipe can take less than we give
+    // it, and no more than IOV_MAX at a time
+    while (niov > 0) {
+        done = writev(sink->fd, iov, niov < IOV_MAX ? niov : IOV_MAX);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            sink->stats.lost += sink->n;
+            sink->n = 0;
+            return -1;
+        }
+        sink->stats.writes++;
+        sink->stats.bytes += done;
+        while (niov > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    sink->needHeader = 0;
+    sink->n = 0;
+    return 0;
+}
+
+int wxsink_write(struct wxsink *sink, int station, time_t when, const struct weatherData *wx)
+{
+    char *slot = sink->buf + (size_t)sink->n * WXSINK_RECMAX;
+    int slotIov = sink->n + sink->needHeader;
+
+    sink->iov[slotIov].iov_base = slot;
+    sink->iov[slotIov].iov_len = wxsink_format(sink->format, station, when, wx, slot);
+    sink->n++;
+    sink->stats.records++;
+    if (sink->n == sink->batch)
+        return wxsink_flush(sink);
+    return 0;
+}
+
+void wxsink_get_stats(struct wxsink *sink, struct wxsink_stats *stats)
+{
+    *stats = sink->stats;
+}
@@ -0,0 +1,88 @@
+/*
+    Output sinks for the observation we print every so often.
+
+    Three formats, pick the one the reader wants:
+
+        WXSINK_JSON     one object per line, numbers as numbers
+        WXSINK_CSV      a header line, then one row per record
+        WXSINK_BIN      struct wxsink_rec, fixed layout, nothing to parse
+
+    A sink owns a buffer with room for batch records, set up when it's
+    opened.  Records are formatted straight into their slot, numbers by
+    hand, no printf and no malloc, and once batch of them are waiting
+    they all go out in one writev().  A batch of 1 writes every record
+    as it comes, which is what you want on a terminal or a pipe.
+
+    Only one thread may use a sink.
+*/
+#ifndef WXSINK_H
+#define WXSINK_H
+
+#include <stdint.h>
+#include <time.h>
+#include "weatherstation.h"
+
+#define WXSINK_JSON     0
+#define WXSINK_CSV      1
+#define WXSINK_BIN      2
+
+// Biggest a record can get in any format
+#define WXSINK_RECMAX   512
+// Most records held for one writev()
+#define WXSINK_MAXBATCH 1024
+
+/*
+    The binary record.  Host byte order, which is little endian on
+    anything this runs on; from Python it's
+
+        struct.unpack("<IHHq7q3f4iI", rec)
+*/
+#define WXSINK_MAGIC    0x52535857  // "WXSR"
+#define WXSINK_VERSION  1
+
+struct wxsink_rec {
+    uint32_t    magic;
+    uint16_t    size;       // sizeof(struct wxsink_rec)
+    uint16_t    version;
+    int64_t     time;       // when the record was written
+    int64_t     wsTime, wdTime, tTime, hTime, rcTime, rrTime, bTime;
+    float       windSpeed;
+    float       temperature;
+    float       barometer;
+    int32_t     windDirection;
+    int32_t     humidity;
+    int32_t     rainCounter;
+    int32_t     rainRaw;
+    uint32_t    station;    // which console, 0 when there's only the one
+};
+
+struct wxsink_stats {
+    unsigned long   records;
+    unsigned long   writes;     // writev() calls
+    unsigned long   bytes;
+    unsigned long   lost;       // records in batches that couldn't be written
+};
+
+struct wxsink;
+
+// Parse "json", "csv" or "bin".  -1 if it's none of them.
+int wxsink_format_by_name(const char *name);
+
+// Write to fd, which the sink doesn't close.  NULL if there's no memory.
+struct wxsink *wxsink_open(int fd, int format, int batch);
+// Flushes what's waiting before closing.
+void wxsink_close(struct wxsink *sink);
+
+// Add a record for station's wx at time when.  Returns 0, or -1 if the
+// batch it filled couldn't be written.
+int wxsink_write(struct wxsink *sink, int station, time_t when, const struct weatherData *wx);
+// Write out whatever is waiting.
+int wxsink_flush(struct wxsink *sink);
+
+// Just the formatting, into buf which has room for WXSINK_RECMAX.
+// Returns the length.
+int wxsink_format(int format, int station, time_t when, const struct weatherData *wx, char *buf);
+
+void wxsink_get_stats(struct wxsink *sink, struct wxsink_stats *stats);
+
+#endif
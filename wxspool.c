@@ -0,0 +1,355 @@
+/*
+    Upload spool, see wxspool.h.
+
+    Each segment file starts with a small header and is followed by
+    records packed end to end on 8 byte boundaries:
+
+        uint32  magic
+        uint16  length of the url, counting the NUL
+        uint8   target
+        uint8   state, pending or sent
+        char    url[length]
+
+    A fresh segment is all zeros, so the first record without the magic
+    marks the end.  The magic is written last, which means a record that
+    was half written when the power went out is simply not there.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wxspool.h"
+#include "wxlog.h"
+
+#define SEGMAGIC    0x50535857  // "WXSP"
+#define RECMAGIC    0x43455257  // "WREC"
+#define PENDING     1
+#define SENT        2
+// A slash and a segment's name after the directory, at their longest
+#define SEGNAMESZ   sizeof("/4294967295.seg")
+
+struct seghdr {
+    uint32_t    magic;
+    uint32_t    seq;
+};
+
+struct rechdr {
+    uint32_t    magic;
+    uint16_t    len;
+    uint8_t     target;
+    uint8_t     state;
+};
+
+#define RECSIZE(len)    ((sizeof(struct rechdr) + (len) + 7) & ~7u)
+
+struct seg {
+    unsigned int    seq;
+    unsigned char * map;
+    unsigned int    used;   // where the next record goes
+    unsigned int    first;  // nothing before here is pending
+    unsigned int    pending;
+};
+
+struct wxspool {
+    char            dir[PATH_MAX - SEGNAMESZ];  // so any segment's path fits
+    unsigned int    maxSegments;
+    unsigned int    nseg;
+    struct seg *    seg;    // oldest first
+    unsigned long   appended;
+    unsigned long   sent;
+    unsigned long   evicted;
+};
+
+static void segPath(struct wxspool *spool, unsigned int seq, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/%08u.seg", spool->dir, seq);
+}
+
+// Map segment seq, making it if it isn't there yet.  Returns -1 if it
+// couldn't be, or BADSEG if the file is there but isn't one of ours.
+#define BADSEG  -2
+static int mapSeg(struct wxspool *spool, unsigned int seq, struct seg *seg)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    struct seghdr *hdr;
+    int fd;
+
+    segPath(spool, seq, path);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size != WXSPOOL_SEGSIZE && ftruncate(fd, WXSPOOL_SEGSIZE) < 0)) {
+        close(fd);
+        return -1;
+    }
+    seg->map = mmap(NULL, WXSPOOL_SEGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg->map == MAP_FAILED)
+        return -1;
+    seg->seq = seq;
+    seg->used = sizeof(struct seghdr);
+    seg->first = seg->used;
+    seg->pending = 0;
+
+    hdr = (struct seghdr *)seg->map;
+    if (hdr->magic == 0) {
+        hdr->seq = seq;
+        hdr->magic = SEGMAGIC;
+        return 0;
+    }
+    if (hdr->magic != SEGMAGIC || hdr->seq != seq) {
+        munmap(seg->map, WXSPOOL_SEGSIZE);
+        return BADSEG;
+    }
+    // An old one, find out what's still in it
+    for (;;) {
+        struct rechdr *rec = (struct rechdr *)(seg->map + seg->used);
+        if (seg->used + sizeof(struct rechdr) > WXSPOOL_SEGSIZE ||
+            rec->magic != RECMAGIC ||
+            seg->used + RECSIZE(rec->len) > WXSPOOL_SEGSIZE)
+            break;
+        if (rec->state == PENDING) {
+            if (seg->pending++ == 0)
+                seg->first = seg->used;
+        }
+        seg->used += RECSIZE(rec->len);
+    }
+    if (seg->pending == 0)
+        seg->first = seg->used;
+    return 0;
+}
+
+// Forget the oldest segment and delete its file.
+static void dropOldest(struct wxspool *spool)
+{
+    char path[PATH_MAX];
+
+    segPath(spool, spool->seg[0].seq, path);
+    munmap(spool->seg[0].map, WXSPOOL_SEGSIZE);
+    unlink(path);
+    spool->nseg--;
+    memmove(&spool->seg[0], &spool->seg[1], spool->nseg * sizeof(struct seg));
+}
+
+static int newSeg(struct wxspool *spool)
+{
+    unsigned int seq = spool->nseg ? spool->seg[spool->nseg-1].seq + 1 : 1;
+
+    if (spool->nseg == spool->maxSegments) {
+        spool->evicted += spool->seg[0].pending;
+        wxlog_warn("Spool full, evicting segment %u with %u unsent\n",
+            spool->seg[0].seq, spool->seg[0].pending);
+        dropOldest(spool);
+    }
+    if (mapSeg(spool, seq, &spool->seg[spool->nseg]) < 0)
+        return -1;
+    spool->nseg++;
+    return 0;
+}
+
+static int bySeq(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+struct wxspool *wxspool_open(const char *dir, unsigned int maxSegments)
+{
+    struct wxspool *spool;
+    struct dirent *de;
+    DIR *d;
+    unsigned int *found = NULL, nfound = 0, seq, i;
+    char path[PATH_MAX];
+    int rc;
+
+    // We need somewhere to append while the oldest is still being sent
+    if (maxSegments < 2)
+        maxSegments = 2;
+    if (strlen(dir) >= PATH_MAX - SEGNAMESZ) {
+        wxlog_error("Spool directory %s is too long a name\n", dir);
+        return NULL;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return NULL;
+    spool = calloc(1, sizeof(struct wxspool));
+    if (spool == NULL)
+        return NULL;
+    snprintf(spool->dir, sizeof(spool->dir), "%s", dir);
+    spool->maxSegments = maxSegments;
+    spool->seg = calloc(maxSegments, sizeof(struct seg));
+    found = calloc(maxSegments * 4, sizeof(unsigned int));
+    d = opendir(dir);
+    if (spool->seg == NULL || found == NULL || d == NULL)
+        goto fail;
+
+    while ((de = readdir(d)) != NULL) {
+        char tail;
+        if (sscanf(de->d_name, "%8u.se%c", &seq, &tail) != 2 || tail != 'g')
+            continue;
+        if (nfound == maxSegments * 4)
+            break;
+        found[nfound++] = seq;
+    }
+    closedir(d);
+    d = NULL;
+    qsort(found, nfound, sizeof(unsigned int), bySeq);
+
+    for (i = 0; i < nfound; i++) {
+        // More left over than we're allowed now, the oldest go, and so
+        // does anything that isn't a segment.  One we just couldn't map
+        // this time is left for the next.
+        rc = nfound - i > maxSegments ? BADSEG : mapSeg(spool, found[i], &spool->seg[spool->nseg]);
+        if (rc == BADSEG) {
+            wxlog_warn("Dropping old spool segment %u\n", found[i]);
+            segPath(spool, found[i], path);
+            unlink(path);
+            continue;
+        }
+        if (rc < 0) {
+            wxlog_warn("Couldn't open spool segment %u, %s, leaving it\n", found[i], strerror(errno));
+            continue;
+        }
+        spool->nseg++;
+    }
+    // Anything fully sent, other than the newest, can go now
+    for (i = 0; i + 1 < spool->nseg; ) {
+        if (spool->seg[i].pending)
+            break;
+        dropOldest(spool);
+    }
+    if (spool->nseg == 0 && newSeg(spool) < 0)
+        goto fail;
+    free(found);
+    return spool;
+
+fail:
+    if (d)
+        closedir(d);
+    free(found);
+    wxspool_close(spool);
+    return NULL;
+}
+
+void wxspool_close(struct wxspool *spool)
+{
+    unsigned int i;
+
+    if (spool == NULL)
+        return;
+    for (i = 0; i < spool->nseg; i++) {
+        msync(spool->seg[i].map, WXSPOOL_SEGSIZE, MS_SYNC);
+        munmap(spool->seg[i].map, WXSPOOL_SEGSIZE);
+    }
+    free(spool->seg);
+    free(spool);
+}
+
+int wxspool_append(struct wxspool *spool, int target, const char *url)
+{
+    size_t len = strlen(url) + 1;
+    unsigned int size = RECSIZE(len);
+    struct seg *tail;
+    struct rechdr *rec;
+    uintptr_t page, end;
+
+    if (size > WXSPOOL_SEGSIZE - sizeof(struct seghdr) || target < 0 || target > 31)
+        return -1;
+    tail = &spool->seg[spool->nseg-1];
+    if (tail->used + size > WXSPOOL_SEGSIZE) {
+        if (newSeg(spool) < 0)
+            return -1;
+        tail = &spool->seg[spool->nseg-1];
+    }
+    rec = (struct rechdr *)(tail->map + tail->used);
+    rec->len = len;
+    rec->target = target;
+    rec->state = PENDING;
+    memcpy(rec + 1, url, len);
+    __atomic_store_n(&rec->magic, RECMAGIC, __ATOMIC_RELEASE);
+    if (tail->pending++ == 0)
+        tail->first = tail->used;
+    tail->used += size;
+    spool->appended++;
+
+    // Start it on its way to the card without waiting for it
+    page = (uintptr_t)rec & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+    end = (uintptr_t)rec + size;
+    msync((void *)page, end - page, MS_ASYNC);
+    return 0;
+}
+
+int wxspool_peek(struct wxspool *spool, unsigned int targets, struct wxspool_rec *recs, int max)
+{
+    unsigned int i, off;
+    int n = 0;
+
+    for (i = 0; i < spool->nseg && n < max; i++) {
+        struct seg *seg = &spool->seg[i];
+        if (seg->pending == 0)
+            continue;
+        for (off = seg->first; off < seg->used && n < max; ) {
+            struct rechdr *rec = (struct rechdr *)(seg->map + off);
+            if (rec->state == PENDING && (targets & (1u << rec->target))) {
+                recs[n].target = rec->target;
+                recs[n].url = (const char *)(rec + 1);
+                recs[n].seq = seg->seq;
+                recs[n].off = off;
+                n++;
+            }
+            off += RECSIZE(rec->len);
+        }
+    }
+    return n;
+}
+
+void wxspool_ack(struct wxspool *spool, const struct wxspool_rec *rec)
+{
+    struct rechdr *hdr;
+    struct seg *seg = NULL;
+    unsigned int i;
+
+    for (i = 0; i < spool->nseg; i++)
+        if (spool->seg[i].seq == rec->seq) {
+            seg = &spool->seg[i];
+            break;
+        }
+    // Evicted while it was being sent
+    if (seg == NULL)
+        return;
+    hdr = (struct rechdr *)(seg->map + rec->off);
+    if (hdr->state != PENDING)
+        return;
+    hdr->state = SENT;
+    seg->pending--;
+    spool->sent++;
+    while (seg->first < seg->used &&
+           ((struct rechdr *)(seg->map + seg->first))->state != PENDING)
+        seg->first += RECSIZE(((struct rechdr *)(seg->map + seg->first))->len);
+
+    // Done with the oldest segments, as long as we aren't still writing them
+    while (spool->nseg > 1 && spool->seg[0].pending == 0)
+        dropOldest(spool);
+}
+
+void wxspool_get_stats(struct wxspool *spool, struct wxspool_stats *stats)
+{
+    unsigned int i;
+
+    stats->appended = spool->appended;
+    stats->sent = spool->sent;
+    stats->evicted = spool->evicted;
+    stats->segments = spool->nseg;
+    stats->pending = 0;
+    for (i = 0; i < spool->nseg; i++)
+        stats->pending += spool->seg[i].pending;
+}
@@ -0,0 +1,59 @@
+/*
+    Store and forward spool for uploads that didn't make it.
+
+    When a site can't be reached the URL we tried to send is appended to
+    the spool on disk (the uploader leaves any password out of it), and once the site is answering again the upload
+    thread plays the spool back a batch at a time.  The spool is a
+    directory of fixed size segment files, numbered in order, each one
+    memory mapped while we have it open.  Records are only ever appended;
+    sending one just flips its state byte in place.  A segment file is
+    deleted once everything in it has been sent.
+
+    The disk is a small SD card, so the spool has a cap of maxSegments
+    segment files.  When a new segment is needed and the cap has been
+    reached, the oldest segment is evicted, unsent records and all, and
+    the evicted records are counted.  Newest data wins.
+
+    Only one thread may use a spool.
+*/
+#ifndef WXSPOOL_H
+#define WXSPOOL_H
+
+#define WXSPOOL_SEGSIZE     (64 * 1024)
+
+struct wxspool;
+
+// One pending record handed out by wxspool_peek().  url points into the
+// mapped segment and is good until the next append, ack or close.
+struct wxspool_rec {
+    int             target;
+    const char *    url;
+    unsigned int    seq;    // which segment
+    unsigned int    off;    // where in it
+};
+
+struct wxspool_stats {
+    unsigned long   appended;
+    unsigned long   sent;
+    unsigned long   evicted;    // thrown away unsent to stay under the cap
+    unsigned long   pending;
+    unsigned int    segments;
+};
+
+// Opens (creating if need be) the spool in dir and picks up anything left
+// from last time.  Returns NULL if dir can't be used.
+struct wxspool *wxspool_open(const char *dir, unsigned int maxSegments);
+void wxspool_close(struct wxspool *spool);
+
+// Returns 0, or -1 if it couldn't be written.
+int wxspool_append(struct wxspool *spool, int target, const char *url);
+
+// Fill in up to max of the oldest pending records for the targets set in
+// targets (bit n for target n).  Returns how many.
+int wxspool_peek(struct wxspool *spool, unsigned int targets, struct wxspool_rec *recs, int max);
+// Mark a record from wxspool_peek() as delivered.
+void wxspool_ack(struct wxspool *spool, const struct wxspool_rec *rec);
+
+void wxspool_get_stats(struct wxspool *spool, struct wxspool_stats *stats);
+
+#endif
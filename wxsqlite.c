@@ -0,0 +1,180 @@
+/*
+    SQLite sink, see wxsqlite.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#include "wxsqlite.h"
+#include "wxlog.h"
+
+static const char *schema =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS observation ("
+    "  time          INTEGER NOT NULL,"     // unix seconds
+    "  station       INTEGER NOT NULL DEFAULT 0,"   // which console
+    "  report        INTEGER NOT NULL,"     // 1 or 2, which USB report
+    "  windSpeed     REAL,"
+    "  windDirection INTEGER,"
+    "  temperature   REAL,"
+    "  humidity      INTEGER,"
+    "  rainCounter   INTEGER,"
+    "  rainRaw       INTEGER,"
+    "  barometer     REAL"
+    ");"
+    "CREATE INDEX IF NOT EXISTS observation_time ON observation(time);";
+
+static const char *insert =
+    "INSERT INTO observation (time, station, report, windSpeed, windDirection,"
+    " temperature, humidity, rainCounter, rainRaw, barometer)"
+    " VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+
+// Databases from before there could be more than one console
+static const char *addStation =
+    "ALTER TABLE observation ADD COLUMN station INTEGER NOT NULL DEFAULT 0;";
+
+struct wxsqlite {
+    sqlite3 *       db;
+    sqlite3_stmt *  insert;
+    sqlite3_stmt *  begin;
+    sqlite3_stmt *  commit;
+    sqlite3_stmt *  rollback;
+    int             batchSamples;
+    int             batchSecs;
+    int             inTxn;      // BEGIN has been and COMMIT hasn't
+    int             inBatch;    // rows in the open transaction
+    time_t          started;    // when it was opened, by now() not the frames
+};
+
+// The batch's age goes by this and not the rows' own times, which are
+// hours apart when a capture's being replayed, and it doesn't jump when
+// the wall clock does.
+static time_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int step(struct wxsqlite *db, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        wxlog_error("sqlite: %s\n", sqlite3_errmsg(db->db));
+        return -1;
+    }
+    return 0;
+}
+
+// Something in the batch failed, so let it all go rather than leave a
+// transaction open that the next BEGIN would trip over.  SQLite may have
+// rolled it back already.
+static void abandon(struct wxsqlite *db)
+{
+    if (!sqlite3_get_autocommit(db->db))
+        step(db, db->rollback);
+    if (db->inBatch)
+        wxlog_error("sqlite: lost %d rows\n", db->inBatch);
+    db->inTxn = 0;
+    db->inBatch = 0;
+}
+
+struct wxsqlite *wxsqlite_open(const char *path, int batchSamples, int batchSecs)
+{
+    struct wxsqlite *db = calloc(1, sizeof(struct wxsqlite));
+    sqlite3_stmt *probe = NULL;
+    char *msg = NULL;
+
+    if (db == NULL)
+        return NULL;
+    db->batchSamples = batchSamples > 0 ? batchSamples : 1;
+    db->batchSecs = batchSecs;
+    if (sqlite3_open(path, &db->db) != SQLITE_OK)
+        goto fail;
+    if (sqlite3_exec(db->db, schema, NULL, NULL, &msg) != SQLITE_OK) {
+        wxlog_error("sqlite schema: %s\n", msg);
+        sqlite3_free(msg);
+        goto fail;
+    }
+    if (sqlite3_prepare_v2(db->db, "SELECT station FROM observation;", -1, &probe, NULL) != SQLITE_OK &&
+        sqlite3_exec(db->db, addStation, NULL, NULL, NULL) != SQLITE_OK)
+        goto fail;
+    sqlite3_finalize(probe);
+    if (sqlite3_prepare_v2(db->db, insert, -1, &db->insert, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db->db, "BEGIN;", -1, &db->begin, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db->db, "COMMIT;", -1, &db->commit, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db->db, "ROLLBACK;", -1, &db->rollback, NULL) != SQLITE_OK)
+        goto fail;
+    return db;
+
+fail:
+    wxlog_error("Couldn't open database %s, %s\n", path, sqlite3_errmsg(db->db));
+    wxsqlite_close(db);
+    return NULL;
+}
+
+void wxsqlite_close(struct wxsqlite *db)
+{
+    if (db == NULL)
+        return;
+    if (db->rollback && wxsqlite_flush(db, 1) < 0)
+        abandon(db);
+    sqlite3_finalize(db->insert);
+    sqlite3_finalize(db->begin);
+    sqlite3_finalize(db->commit);
+    sqlite3_finalize(db->rollback);
+    sqlite3_close(db->db);
+    free(db);
+}
+
+int wxsqlite_store(struct wxsqlite *db, int station, int report, time_t when, const struct weatherData *wx)
+{
+    sqlite3_stmt *s = db->insert;
+
+    if (!db->inTxn) {
+        if (step(db, db->begin) < 0)
+            return -1;
+        db->inTxn = 1;
+        db->started = now();
+    }
+    sqlite3_bind_int64(s, 1, (sqlite3_int64)when);
+    sqlite3_bind_int(s, 2, station);
+    sqlite3_bind_int(s, 3, report);
+    sqlite3_bind_double(s, 4, wx->windSpeed);
+    sqlite3_bind_int(s, 5, wx->windDirection);
+    sqlite3_bind_double(s, 6, wx->temperature);
+    sqlite3_bind_int(s, 7, wx->humidity);
+    sqlite3_bind_int(s, 8, wx->rainCounter);
+    sqlite3_bind_int(s, 9, wx->rainRaw);
+    sqlite3_bind_double(s, 10, wx->barometer);
+    if (step(db, s) < 0) {
+        abandon(db);
+        return -1;
+    }
+    db->inBatch++;
+    if (db->inBatch >= db->batchSamples)
+        return wxsqlite_flush(db, 1);
+    return wxsqlite_flush(db, 0);
+}
+
+int wxsqlite_flush(struct wxsqlite *db, int force)
+{
+    if (!db->inTxn)
+        return 0;
+    if (!force && now() - db->started < db->batchSecs)
+        return 0;
+    if (step(db, db->commit) < 0) {
+        // Busy, someone's reading, and it's all still there to commit
+        // next time.  Anything else and it's gone.
+        if (sqlite3_errcode(db->db) != SQLITE_BUSY)
+            abandon(db);
+        return -1;
+    }
+    db->inTxn = 0;
+    db->inBatch = 0;
+    return 0;
+}
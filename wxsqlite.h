@@ -0,0 +1,39 @@
+/*
+    Local SQLite store for every frame we decode.
+
+    The database runs in WAL mode with synchronous=NORMAL, the insert is
+    prepared once and reused, and rows are grouped into one transaction
+    per batchSamples rows or batchSecs seconds, whichever comes first.
+    That way the SD card sees a handful of page writes per batch instead
+    of a journal and an fsync for every row.
+
+    Rows are keyed by time so a range of them comes straight off the
+    index:
+
+        SELECT * FROM observation WHERE time BETWEEN ? AND ?;
+
+    Each row says which console (station) it came from, 0 when there's
+    only the one.
+
+    Only one thread may use a database handle.
+*/
+#ifndef WXSQLITE_H
+#define WXSQLITE_H
+
+#include "weatherstation.h"
+
+struct wxsqlite;
+
+// Opens, creating if need be, the database at path.  NULL if it can't.
+struct wxsqlite *wxsqlite_open(const char *path, int batchSamples, int batchSecs);
+// Commits anything outstanding before closing.
+void wxsqlite_close(struct wxsqlite *db);
+
+// Add a row for the frame from report that just updated station's wx.
+// Returns 0, or -1 if it couldn't be written.
+int wxsqlite_store(struct wxsqlite *db, int station, int report, time_t when, const struct weatherData *wx);
+// Commit the open batch if it's older than batchSecs, or now if force is
+// set.  Call it from a timer so a quiet station still gets its rows out.
+int wxsqlite_flush(struct wxsqlite *db, int force);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+    Trace spans, see wxtrace.h.
+
+    Each slot has a sequence number, 0 while it's being filled and the
+    span's number plus one once it's done.  The dump copies a slot and
+    then checks the number is still what it was before it trusts the
+    copy, so a span being overwritten as it's read is just left out.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#include "wxtrace.h"
+
+#define RINGMASK    (WXTRACE_RING - 1)
+
+_Static_assert((WXTRACE_RING & RINGMASK) == 0, "WXTRACE_RING has to be a power of two");
+
+struct span {
+    atomic_uint     seq;
+    uint32_t        sample;
+    const char *    stage;
+    uint64_t        start;
+    uint64_t        duration;
+};
+
+struct wxtrace_ring {
+    char            thread[16];
+    atomic_uint     head;       // spans ever recorded
+    struct span     spans[WXTRACE_RING];
+};
+
+int wxtrace_enabled = 0;
+
+static struct wxtrace_ring *rings[WXTRACE_MAXRINGS];
+static int nrings;
+
+uint64_t wxtrace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct wxtrace_ring *wxtrace_ring(const char *thread)
+{
+    struct wxtrace_ring *ring;
+    int i;
+
+    if (nrings == WXTRACE_MAXRINGS)
+        return NULL;
+    ring = calloc(1, sizeof(struct wxtrace_ring));
+    if (ring == NULL)
+        return NULL;
+    snprintf(ring->thread, sizeof(ring->thread), "%s", thread);
+    atomic_init(&ring->head, 0);
+    for (i = 0; i < WXTRACE_RING; i++)
+        atomic_init(&ring->spans[i].seq, 0);
+    rings[nrings++] = ring;
+    return ring;
+}
+
+void wxtrace_record(struct wxtrace_ring *ring, const char *stage, uint32_t sample,
+                    uint64_t start, uint64_t duration)
+{
+    unsigned int head;
+    struct span *sp;
+
+    if (ring == NULL)
+        return;
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    sp = &ring->spans[head & RINGMASK];
+    atomic_store_explicit(&sp->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sp->sample = sample;
+    sp->stage = stage;
+    sp->start = start;
+    sp->duration = duration;
+    atomic_store_explicit(&sp->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copy out span number n if it's still there and whole
+static int readSpan(struct wxtrace_ring *ring, unsigned int n, struct span *out)
+{
+    struct span *sp = &ring->spans[n & RINGMASK];
+    unsigned int seq = atomic_load_explicit(&sp->seq, memory_order_acquire);
+
+    if (seq != n + 1)
+        return -1;
+    out->sample = sp->sample;
+    out->stage = sp->stage;
+    out->start = sp->start;
+    out->duration = sp->duration;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&sp->seq, memory_order_relaxed) == seq ? 0 : -1;
+}
+
+int wxtrace_dump(const char *path)
+{
+    char tmp[PATH_MAX];
+    struct span sp;
+    unsigned int head, n;
+    int i, first = 1;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+    fp = fopen(tmp, "w");
+    if (fp == NULL)
+        return -1;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = 0; i < nrings; i++) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", i + 1, rings[i]->thread);
+        first = 0;
+        head = atomic_load_explicit(&rings[i]->head, memory_order_acquire);
+        for (n = head > WXTRACE_RING ? head - WXTRACE_RING : 0; n != head; n++) {
+            if (readSpan(rings[i], n, &sp) < 0)
+                continue;
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"wx\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%llu,\"dur\":%llu,\"args\":{\"sample\":%u}}",
+                sp.stage, i + 1, (unsigned long long)sp.start,
+                (unsigned long long)sp.duration, sp.sample);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
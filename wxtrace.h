@@ -0,0 +1,58 @@
+/*
+    Trace spans for following a sample through the daemon: the USB
+    transfer, decoding it, storing it, writing it out, and the upload
+    it ends up in, each tagged with the sample's id.
+
+    Every thread that records takes a ring of its own at startup, and
+    only that thread writes to it, so recording is a few stores and no
+    lock.  When the ring is full the oldest spans go.  wxtrace_dump()
+    writes all the rings out as Chrome trace event JSON, for
+    chrome://tracing or https://ui.perfetto.dev.
+
+    Tracing is always compiled in.  While it's off, wxtrace_begin() is a
+    load and a branch and wxtrace_end() is a branch, nothing else.
+*/
+#ifndef WXTRACE_H
+#define WXTRACE_H
+
+#include <stdint.h>
+
+// Spans kept per thread, a power of two
+#define WXTRACE_RING    4096
+#define WXTRACE_MAXRINGS 4
+
+struct wxtrace_ring;
+
+extern int wxtrace_enabled;
+
+// Monotonic microseconds, what the trace format wants
+uint64_t wxtrace_now(void);
+
+// One per thread that records, named for the trace viewer.  Take them
+// before the threads start.  NULL if they're all taken.
+struct wxtrace_ring *wxtrace_ring(const char *thread);
+
+void wxtrace_record(struct wxtrace_ring *ring, const char *stage, uint32_t sample,
+                    uint64_t start, uint64_t duration);
+
+// Where a span starts; 0 when tracing is off
+static inline uint64_t wxtrace_begin(void)
+{
+    return wxtrace_enabled ? wxtrace_now() : 0;
+}
+
+// Record the span from start to now.  stage has to be a string that
+// lives forever, only the pointer is kept.
+static inline void wxtrace_end(struct wxtrace_ring *ring, const char *stage,
+                               uint32_t sample, uint64_t start)
+{
+    if (start)
+        wxtrace_record(ring, stage, sample, start, wxtrace_now() - start);
+}
+
+// Write every ring out to path as Chrome trace JSON.  Safe to call from
+// any thread while the others carry on recording.  Returns 0, or -1 if
+// the file couldn't be written.
+int wxtrace_dump(const char *path);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+    Upload worker thread, see wxupload.h.
+
+    The worker sleeps in read() on a pipe.  The producer drops one byte
+    in the pipe after each push to wake it up; the pipe is non-blocking
+    on the write side, so if a pile of wakeups is already waiting the
+    extra byte is just lost, which is fine since the worker empties the
+    whole ring every time it wakes.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "wxupload.h"
+#include "wxlog.h"
+
+struct observation {
+    time_t              when;
+    int                 station;
+    unsigned int        sample;
+    struct weatherData  wx;
+    struct wxagg_summary agg;
+};
+
+struct wxupload {
+    struct wxring * ring;
+    wxupload_fn     fn;
+    void *          arg;
+    int             wake[2];
+    atomic_int      stopping;
+    pthread_t       thread;
+};
+
+static void drain(struct wxupload *up)
+{
+    struct observation ob;
+
+    while (wxring_pop(up->ring, &ob) == 0)
+        up->fn(ob.station, ob.sample, &ob.wx, &ob.agg, ob.when, up->arg);
+}
+
+static void *worker(void *arg)
+{
+    struct wxupload *up = arg;
+    char buf[64];
+    ssize_t n;
+
+    while (!atomic_load(&up->stopping)) {
+        n = read(up->wake[0], buf, sizeof(buf));
+        if (n < 0 && errno != EINTR) {
+            wxlog_error("upload worker, %s\n", strerror(errno));
+            break;
+        }
+        drain(up);
+    }
+    // Whatever made it into the ring before we were told to stop still
+    // goes out
+    drain(up);
+    return NULL;
+}
+
+struct wxupload *wxupload_start(unsigned int depth, wxupload_fn fn, void *arg)
+{
+    struct wxupload *up = calloc(1, sizeof(struct wxupload));
+
+    if (up == NULL)
+        return NULL;
+    up->fn = fn;
+    up->arg = arg;
+    up->wake[0] = up->wake[1] = -1;
+    atomic_init(&up->stopping, 0);
+    up->ring = wxring_new(sizeof(struct observation), depth);
+    if (up->ring == NULL || pipe(up->wake) < 0)
+        goto fail;
+    fcntl(up->wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(up->wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(up->wake[1], F_SETFD, FD_CLOEXEC);
+    if (pthread_create(&up->thread, NULL, worker, up) != 0)
+        goto fail;
+    return up;
+
+fail:
+    if (up->wake[0] >= 0) {
+        close(up->wake[0]);
+        close(up->wake[1]);
+    }
+    wxring_free(up->ring);
+    free(up);
+    return NULL;
+}
+
+void wxupload_stop(struct wxupload *up)
+{
+    char b = 0;
+
+    if (up == NULL)
+        return;
+    atomic_store(&up->stopping, 1);
+    if (write(up->wake[1], &b, 1) < 0)
+        ;
+    pthread_join(up->thread, NULL);
+    close(up->wake[0]);
+    close(up->wake[1]);
+    wxring_free(up->ring);
+    free(up);
+}
+
+int wxupload_submit(struct wxupload *up, int station, unsigned int sample,
+                    const struct weatherData *wx, const struct wxagg_summary *agg)
+{
+    struct observation ob;
+    char b = 0;
+
+    ob.when = time(NULL);
+    ob.station = station;
+    ob.sample = sample;
+    ob.wx = *wx;
+    ob.agg = *agg;
+    if (wxring_push(up->ring, &ob) < 0)
+        return -1;
+    // EAGAIN means there's a wakeup waiting already
+    if (write(up->wake[1], &b, 1) < 0)
+        ;
+    return 0;
+}
+
+unsigned int wxupload_pending(struct wxupload *up)
+{
+    return wxring_depth(up->ring);
+}
+
+void wxupload_get_stats(struct wxupload *up, struct wxring_stats *stats)
+{
+    wxring_get_stats(up->ring, stats);
+}
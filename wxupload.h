@@ -0,0 +1,42 @@
+/*
+    Background upload worker.
+
+    The acquisition side hands over a copy of the weather data and goes
+    straight back to the USB device; a separate thread takes the copies
+    off a wxring and does the slow network work with them.  If the
+    network is so slow the ring fills up, new observations are dropped
+    and counted rather than making the acquisition side wait.
+*/
+#ifndef WXUPLOAD_H
+#define WXUPLOAD_H
+
+#include "weatherstation.h"
+#include "wxring.h"
+#include "wxagg.h"
+
+// Called on the worker thread for every observation, in order.  station,
+// sample and agg are whatever was handed to wxupload_submit() with it and
+// when is the time it was handed over.
+typedef void (*wxupload_fn)(int station, unsigned int sample, const struct weatherData *wx,
+                            const struct wxagg_summary *agg, time_t when, void *arg);
+
+struct wxupload;
+
+// Start the worker thread with room for depth observations waiting.
+// Block any signals you want handled elsewhere before calling this.
+struct wxupload *wxupload_start(unsigned int depth, wxupload_fn fn, void *arg);
+// Let the worker finish what is already queued, then join and free it.
+void wxupload_stop(struct wxupload *up);
+
+// Queue a copy of wx from station, and of the station's aggregates as
+// they were at the time.  sample is just passed along, to say which
+// sample it was.  Never blocks.  Returns -1 if it had to be dropped.
+int wxupload_submit(struct wxupload *up, int station, unsigned int sample,
+                    const struct weatherData *wx, const struct wxagg_summary *agg);
+
+// How many observations are waiting for the worker.  The worker can use
+// this to cut short anything optional it's doing.
+unsigned int wxupload_pending(struct wxupload *up);
+void wxupload_get_stats(struct wxupload *up, struct wxring_stats *stats);
+
+#endif